@@ -0,0 +1,348 @@
+/*
+ * DM3058E binary capture format
+ *
+ * Shared by dm3058e-sdl (writer, -L <file>.dmc) and meterlog (reader)
+ *
+ * Layout, all little endian:
+ *
+ *   capture_header_s                 CAPTURE_HEADER_SIZE bytes
+ *   block 0: capture_sync_s          16 bytes
+ *            capture_record_s x N    16 bytes each, N = block_records
+ *   block 1: ...
+ *
+ * Every block starts with a sync record holding the absolute time
+ * of its first sample, the records in the block only carry the
+ * delta from the previous one.  Blocks are a fixed size so block k
+ * lives at header_size + k * block_size, which lets a reader mmap
+ * the file and binary search the sync records for any timestamp
+ * without a separate index.  The last block may be partial; a
+ * crashed writer loses at most the unwritten tail.
+ *
+ */
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define CAPTURE_MAGIC "DMCAPT01"
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_SIZE 1024
+#define CAPTURE_BLOCK_RECORDS 1024
+#define CAPTURE_MODES_MAX 16
+
+#define CAPTURE_FLAG_FILLER 0x0001 // padding to close a block early, not a sample
+#define CAPTURE_FLAG_TRIGGER 0x0002 // the sample a pre-trigger capture was triggered at
+#define CAPTURE_FLAG_RATE 0x000c	// reading rate, 0 unknown or fixed, 1..3 = S, M, F
+#define CAPTURE_FLAG_RATE_SHIFT 2
+#define CAPTURE_FLAG_GAP 0x0010 // dm3058e-sdl -E didn't bridge the interval before this sample
+
+#define CAPTURE_HDR_ACQ_TIME 0x0001 // record times are when the reading was taken (estimated), not when it came in
+
+struct capture_mode_s
+{
+	char scpi[8];
+	char units[8];
+};
+
+struct capture_header_s
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t record_size;
+	uint32_t block_records;
+	int64_t start_wall_ns;	// CLOCK_REALTIME when the capture started
+	uint64_t start_mono_ns; // CLOCK_MONOTONIC at the same moment
+	char idn[128];			// meter *IDN? reply
+	uint32_t mode_count;
+	uint32_t flags; // CAPTURE_HDR_*
+	struct capture_mode_s modes[CAPTURE_MODES_MAX];
+	uint8_t pad[CAPTURE_HEADER_SIZE - 8 - 4 * 4 - 8 - 8 - 128 - 4 - 4 - CAPTURE_MODES_MAX * 16];
+};
+
+struct capture_sync_s
+{
+	uint64_t t_us;	// first sample of the block, microseconds since start_mono_ns
+	uint64_t index; // record number of that sample
+};
+
+struct capture_record_s
+{
+	uint32_t dt_us; // since the previous record, 0 for the first in a block
+	uint8_t mode;	// index into capture_header_s.modes
+	int8_t range;	// meter range code, -1 if none
+	uint16_t flags;
+	double value;
+};
+
+static_assert(sizeof(struct capture_header_s) == CAPTURE_HEADER_SIZE, "capture header size");
+static_assert(sizeof(struct capture_sync_s) == 16, "capture sync size");
+static_assert(sizeof(struct capture_record_s) == 16, "capture record size");
+
+static inline uint16_t capture_rate_flags(char rate)
+{
+	const char *p = rate ? strchr("SMF", rate) : NULL;
+
+	return p ? (uint16_t)((p - "SMF" + 1) << CAPTURE_FLAG_RATE_SHIFT) : 0;
+}
+
+static inline char capture_flags_rate(uint16_t flags)
+{
+	int r = (flags & CAPTURE_FLAG_RATE) >> CAPTURE_FLAG_RATE_SHIFT;
+
+	return r ? "SMF"[r - 1] : '\0';
+}
+
+/*
+ * Reader side view of a mapped capture
+ *
+ */
+struct capture_view_s
+{
+	const uint8_t *base;
+	size_t size;
+	const struct capture_header_s *hdr;
+	size_t block_size;
+	uint64_t blocks; // including a partial last block
+};
+
+static inline int capture_view(struct capture_view_s *cv, const void *base, size_t size)
+{
+	cv->base = (const uint8_t *)base;
+	cv->size = size;
+	cv->hdr = (const struct capture_header_s *)base;
+
+	if ((size < CAPTURE_HEADER_SIZE) || (memcmp(cv->hdr->magic, CAPTURE_MAGIC, 8) != 0))
+		return -1;
+	if ((cv->hdr->record_size != sizeof(struct capture_record_s)) || (cv->hdr->block_records == 0))
+		return -1;
+	if ((cv->hdr->header_size < CAPTURE_HEADER_SIZE) || (cv->hdr->header_size > size))
+		return -1; // truncated or corrupt, the block arithmetic below would run off the mapping
+
+	cv->block_size = sizeof(struct capture_sync_s) + (size_t)cv->hdr->block_records * cv->hdr->record_size;
+	cv->blocks = (size - cv->hdr->header_size + cv->block_size - 1) / cv->block_size;
+	if ((cv->blocks > 0) && (size - cv->hdr->header_size - (cv->blocks - 1) * cv->block_size < sizeof(struct capture_sync_s)))
+		cv->blocks--; // only a torn sync record at the end
+
+	return 0;
+}
+
+static inline const struct capture_sync_s *capture_block_sync(const struct capture_view_s *cv, uint64_t block)
+{
+	return (const struct capture_sync_s *)(cv->base + cv->hdr->header_size + block * cv->block_size);
+}
+
+/*
+ * Number of complete records in a block
+ *
+ */
+static inline uint32_t capture_block_count(const struct capture_view_s *cv, uint64_t block)
+{
+	size_t off = cv->hdr->header_size + block * cv->block_size + sizeof(struct capture_sync_s);
+	size_t avail;
+
+	if (off >= cv->size)
+		return 0;
+	avail = (cv->size - off) / sizeof(struct capture_record_s);
+	return avail < cv->hdr->block_records ? (uint32_t)avail : cv->hdr->block_records;
+}
+
+static inline const struct capture_record_s *capture_block_records(const struct capture_view_s *cv, uint64_t block)
+{
+	return (const struct capture_record_s *)(capture_block_sync(cv, block) + 1);
+}
+
+/*
+ * capture_find_block()
+ *
+ * Binary search the sync records for the last block starting at
+ * or before t_us, O(log n) page touches
+ *
+ */
+static inline uint64_t capture_find_block(const struct capture_view_s *cv, uint64_t t_us)
+{
+	uint64_t lo = 0, hi = cv->blocks;
+
+	while (hi - lo > 1)
+	{
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (capture_block_sync(cv, mid)->t_us <= t_us)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Min/max/mean pyramid
+ *
+ * Built alongside a capture and kept next to it, one file per
+ * level: <capture>.p1 ... <capture>.p<PYRAMID_LEVELS>.  A level 1
+ * entry summarises PYRAMID_FACTOR samples, a level k entry
+ * PYRAMID_FACTOR level k-1 entries.  An entry is closed early when
+ * the meter mode changes so it never mixes units, so entries are
+ * found by time (binary search on t_first_us), not by position.
+ *
+ * To draw any span at w pixels pick the coarsest level that still
+ * has about w entries in the span; that touches O(w) entries no
+ * matter how long the capture is.
+ *
+ */
+#define PYRAMID_MAGIC "DMPYR001"
+#define PYRAMID_VERSION 1
+#define PYRAMID_FACTOR 16
+#define PYRAMID_LEVELS 6
+
+struct pyramid_header_s
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t level;
+	uint32_t factor;
+	uint32_t entry_size;
+	uint8_t pad[40];
+};
+
+struct pyramid_entry_s
+{
+	uint64_t t_first_us; // same time base as the capture records
+	uint64_t t_last_us;
+	double min, max;
+	double sum;		// mean is sum / count
+	uint32_t count; // samples, at every level
+	uint8_t mode;
+	uint8_t pad[3];
+};
+
+static_assert(sizeof(struct pyramid_header_s) == 64, "pyramid header size");
+static_assert(sizeof(struct pyramid_entry_s) == 48, "pyramid entry size");
+
+/*
+ * Builder state, the open entry and its child count per level
+ *
+ */
+struct pyramid_s
+{
+	struct pyramid_entry_s open[PYRAMID_LEVELS];
+	uint32_t children[PYRAMID_LEVELS];
+};
+
+typedef void (*pyramid_emit_fn)(void *ctx, int level, const struct pyramid_entry_s *e);
+
+static inline void pyramid_merge(struct pyramid_entry_s *d, const struct pyramid_entry_s *e)
+{
+	if (d->count == 0)
+	{
+		*d = *e;
+		return;
+	}
+	d->t_last_us = e->t_last_us;
+	if (e->min < d->min)
+		d->min = e->min;
+	if (e->max > d->max)
+		d->max = e->max;
+	d->sum += e->sum;
+	d->count += e->count;
+}
+
+/*
+ * pyramid_close()
+ *
+ * Emit the open entry of level i (0 based, so file .p<i+1>) and
+ * fold it into the level above, closing that too if it's full
+ *
+ */
+static inline void pyramid_close(struct pyramid_s *p, int i, pyramid_emit_fn emit, void *ctx)
+{
+	while (1)
+	{
+		emit(ctx, i + 1, &(p->open[i]));
+		if (i + 1 < PYRAMID_LEVELS)
+		{
+			pyramid_merge(&(p->open[i + 1]), &(p->open[i]));
+			p->children[i + 1]++;
+		}
+		memset(&(p->open[i]), 0, sizeof(p->open[i]));
+		p->children[i] = 0;
+
+		i++;
+		if ((i >= PYRAMID_LEVELS) || (p->children[i] < PYRAMID_FACTOR))
+			break;
+	}
+}
+
+/*
+ * pyramid_flush()
+ *
+ * Close every partial entry, bottom up, eg at the end of a capture
+ *
+ */
+static inline void pyramid_flush(struct pyramid_s *p, pyramid_emit_fn emit, void *ctx)
+{
+	for (int i = 0; i < PYRAMID_LEVELS; i++)
+	{
+		if (p->open[i].count == 0)
+			continue;
+		emit(ctx, i + 1, &(p->open[i]));
+		if (i + 1 < PYRAMID_LEVELS)
+		{
+			pyramid_merge(&(p->open[i + 1]), &(p->open[i]));
+			p->children[i + 1]++;
+		}
+		memset(&(p->open[i]), 0, sizeof(p->open[i]));
+		p->children[i] = 0;
+	}
+}
+
+/*
+ * pyramid_add()
+ *
+ * One sample in, amortised O(1), emits at most PYRAMID_LEVELS
+ * entries (twice that on a mode change)
+ *
+ */
+static inline void pyramid_add(struct pyramid_s *p, uint64_t t_us, double v, uint8_t mode, pyramid_emit_fn emit, void *ctx)
+{
+	struct pyramid_entry_s e;
+
+	if ((p->open[0].count > 0) && (p->open[0].mode != mode))
+		pyramid_flush(p, emit, ctx);
+
+	memset(&e, 0, sizeof(e));
+	e.t_first_us = e.t_last_us = t_us;
+	e.min = e.max = e.sum = v;
+	e.count = 1;
+	e.mode = mode;
+	pyramid_merge(&(p->open[0]), &e);
+
+	if (++(p->children[0]) >= PYRAMID_FACTOR)
+		pyramid_close(p, 0, emit, ctx);
+}
+
+/*
+ * pyramid_find()
+ *
+ * First entry of a level ending at or after t_us
+ *
+ */
+static inline uint64_t pyramid_find(const struct pyramid_entry_s *e, uint64_t n, uint64_t t_us)
+{
+	uint64_t lo = 0, hi = n;
+
+	while (lo < hi)
+	{
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (e[mid].t_last_us < t_us)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+#endif
@@ -8,26 +8,76 @@
  * modified by Artin Amudzhiyan (artin961@gmail.com)
  */
 
+/*
+ * The display (SDL2/SDL_ttf) and global hotkey (X11) layers can
+ * be left out at build time, eg: make USE_SDL=0 USE_X11=0
+ * which gives a lean binary that only runs in headless mode
+ *
+ */
+#ifndef USE_SDL
+#define USE_SDL 1
+#endif
+
+#ifndef USE_X11
+#define USE_X11 1
+#endif
+
+#if USE_SDL
 #include <SDL.h>
 #include <SDL_ttf.h>
+#include "fonts.h"
+#endif
+
+#include "capture.h"
+#include "dm3058e-shm.h"
+#include "hostmath.h"
 
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/file.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
-
+#include <pthread.h>
+#include <zlib.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#if USE_X11
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/XKBlib.h>
+#include <X11/extensions/shape.h>
+#if USE_SDL
+#include <SDL_syswm.h>
+#endif
+#endif
+
+#if !USE_SDL
+typedef struct SDL_Color
+{
+	uint8_t r, g, b, a;
+} SDL_Color;
+#endif
 
 #define FL __FILE__, __LINE__
 
@@ -97,10 +147,19 @@ struct mmode_s
 #define READSTATE_FINISHED_CONTLIMIT 10
 #define READSTATE_FINISHED_ALL 11
 #define READSTATE_DONE 12
+#define READSTATE_REPLAY 13 // waiting for the next recorded reading to fall due
+#define READSTATE_TIMEOUT 14 // the poll in progress wasn't answered by its deadline
+#define READSTATE_RESYNC 15	 // waiting out stray replies after a *CLS
+#define READSTATE_READING_RATE 16
+#define READSTATE_FINISHED_RATE 17
 #define READSTATE_ERROR 999
 
 #define READ_BUF_SIZE 4096
 
+#define HEADLESS_NONE 0
+#define HEADLESS_TEXT 1
+#define HEADLESS_JSON 2
+
 struct mmode_s mmodes[] = {
 	{"DCV", "Volts DC", ":MEAS:VOLT:DC?\r\n", ":MEAS:VOLT:DC:RANG?\r\n", "V DC"},
 	{"ACV", "Volts AC", ":MEAS:VOLT:AC?\r\n", ":MEAS:VOLT:AC:RANG?\r\n", "V AC"},
@@ -114,6 +173,43 @@ struct mmode_s mmodes[] = {
 	{"FREQ", "Frequency", ":MEAS:FREQ?\r\n", ":MEAS:FREQ:RANG?\r\n", "Hz"},
 	{"PERIOD", "Period", ":MEAS:PER?\r\n", ":MEAS:PER:RANG?\r\n", "s"}};
 
+/*
+ * Full scale of each range code, per mode, used by the bar graph.
+ * Functions without a range (CONT, DIODE) use entry 0, a zero
+ * entry means no bar for that mode/range.
+ *
+ */
+const double range_fullscale[MMODES_MAX + 1][8] = {
+	{0.2, 2, 20, 200, 1000},						   // DCV
+	{0.2, 2, 20, 200, 750},							   // ACV
+	{200e-6, 2e-3, 20e-3, 200e-3, 2, 10},			   // DCI
+	{20e-3, 200e-3, 2, 10},							   // ACI
+	{200, 2e3, 20e3, 200e3, 1e6, 10e6, 100e6},		   // 2WR
+	{2e-9, 20e-9, 200e-9, 2e-6, 200e-6, 10000e-6},	   // CAP
+	{2000},											   // CONT
+	{200, 2e3, 20e3, 200e3, 1e6, 10e6, 100e6},		   // 4WR
+	{2},											   // DIODE
+	{0},											   // FREQ
+	{0}};											   // PERIOD
+
+/*
+ * Reading rate (integration time) setting of each mode, NULL for
+ * the ones that have a fixed rate
+ *
+ */
+const char *rate_scpi[MMODES_MAX + 1] = {
+	":RATE:VOLT:DC", // DCV
+	":RATE:VOLT:AC", // ACV
+	":RATE:CURR:DC", // DCI
+	":RATE:CURR:AC", // ACI
+	":RATE:RES",	 // 2WR
+	NULL,			 // CAP
+	NULL,			 // CONT
+	":RATE:FRES",	 // 4WR
+	NULL,			 // DIODE
+	NULL,			 // FREQ
+	NULL};			 // PERIOD
+
 const char SCPI_FUNC[] = ":FUNC?\r\n";
 const char SCPI_MEAS[] = ":MEAS?\r\n";
 
@@ -132,9 +228,900 @@ struct serial_params_s
 	char device[PATH_MAX];
 	int fd, n;
 	int cnt, size, s_cnt;
+	int baud;  // 0 if not known, eg usbtmc
+	int probe; // -s auto, find the rate the meter answers at
 	struct termios oldtp, newtp;
 };
 
+/*
+ * termios2, for speeds that aren't one of the B* constants
+ *
+ * glibc's <termios.h> doesn't have it and <asm/termbits.h> can't be
+ * included alongside it, so this is the kernel's generic layout
+ * (x86, arm, riscv).  Where the ioctl isn't there the standard
+ * speeds still work through cfsetspeed().
+ *
+ */
+struct serial_termios2
+{
+	tcflag_t c_iflag, c_oflag, c_cflag, c_lflag;
+	cc_t c_line;
+	cc_t c_cc[19];
+	speed_t c_ispeed, c_ospeed;
+};
+
+#define SERIAL_TCGETS2 _IOR('T', 0x2A, struct serial_termios2)
+#define SERIAL_TCSETS2 _IOW('T', 0x2B, struct serial_termios2)
+#define SERIAL_BOTHER 0010000
+#define SERIAL_IBSHIFT 16
+#define SERIAL_TOLERANCE 3 // percent a driver may round a speed by and the UARTs still agree
+
+/*
+ * Rates the meter's RS232 menu offers, fastest first, and the order
+ * they're probed in: ours, the factory setting, then the rest
+ *
+ */
+static const int serial_meter_rates[] = {115200, 57600, 38400, 19200, 9600, 4800, 2400, 0};
+static const int serial_probe_rates[] = {115200, 9600, 57600, 38400, 19200, 4800, 2400, 0};
+
+#define SERIAL_IDN_MS 400  // *IDN? reply deadline while probing, plus the time the reply takes on the wire
+#define SERIAL_SWITCH_MS 100 // for the meter to change rate after being told to
+#define SERIAL_RTT_QUERIES 8
+#define SERIAL_PROBE_PORTS 10 // ttyUSB0-9
+
+/*
+ * Command queue
+ *
+ * Every command sent to the meter that expects a reply is tracked,
+ * in the order it went out; the meter answers in order so each reply
+ * line belongs to the oldest entry.  Polling sends one command at a
+ * time.  User commands (the hotkeys) go out ahead of any polling and
+ * make the polling in flight stale, its replies are recognised by
+ * sequence and dropped as they arrive rather than waited for.
+ *
+ */
+#define CMD_USER_MAX 8
+#define CMD_INFLIGHT_MAX 8
+#define CMD_TIMEOUT_MS 1500			// default reply deadline, -st
+#define CMD_RETRIES 1				// resends of an unanswered poll before a resync
+#define CMD_RESYNC_NS 200000000ULL	// quiet time after *CLS
+#define CMD_UI_TICK_MS 50			// longest data_read() waits with a window to keep alive
+
+#define CMD_USER_MODE 1	 // a mode switch, answered with a reading
+#define CMD_USER_RANGE 2 // a range setting, no reply
+#define CMD_USER_RATE 3	 // a reading rate setting, no reply
+#define CMD_USER_PROXY 4 // a line from an SCPI proxy client
+
+struct cmd_s
+{
+	uint64_t seq;
+	int user;
+	int stale;		// polling that a user command overtook
+	int late;		// past its first deadline, see cmd_expire()
+	int mode_index; // user commands, the mode switched to
+	int range;		// CMD_USER_RANGE, the code to set or RANGE_AUTO
+	char rate;		// CMD_USER_RATE, S, M or F
+	int proxy;		// CMD_USER_PROXY, the transaction
+	uint64_t t_ns;	// sent, or queued for a user command
+	uint64_t deadline_ns;
+};
+
+struct cmdq_s
+{
+	struct cmd_s user[CMD_USER_MAX];
+	int user_n;
+	struct cmd_s inflight[CMD_INFLIGHT_MAX];
+	int head, n;
+	uint64_t seq;
+	uint64_t stale_replies, expired;
+
+	// deadlines and recovery
+	uint64_t timeout_ns;
+	const char *poll_cmd; // last poll sent, for a retry
+	int timeout_state;	  // read state the timeout happened in
+	int retries;
+	uint64_t resync_until;
+	uint64_t timeouts, resyncs;
+
+	// the poll the state machine last got a reply to
+	uint64_t reply_write_ns, reply_rx_ns;
+
+	// hotkey to first reading in the new mode
+	uint64_t hotkey_ns;
+	int hotkey_mode;
+	uint64_t hotkey_n, hotkey_sum_ns, hotkey_max_ns;
+};
+
+/*
+ * Range lock (-r, the l and up/down keys)
+ *
+ * Autoranging costs extra readings every time the signal crosses a
+ * range boundary.  Locked, the meter stays put and the range is
+ * known without asking, so the :RANG? query is only sent every
+ * RANGE_VERIFY readings to notice the lock being lost (front panel,
+ * or a query resetting it), and restore it.
+ *
+ */
+#define RANGE_AUTO -1
+#define RANGE_HOLD -2 // -r hold, lock whatever autorange picks first
+#define RANGE_VERIFY 32
+
+struct rangelock_s
+{
+	int locked;
+	int mode_index; // the lock only holds in the mode it was set in
+	int code;
+	int pending;	// -r, set once the first range is known, or RANGE_AUTO
+	int unverified; // readings since the range was last read back
+	uint64_t sets, skipped, restored;
+};
+
+/*
+ * Reading rate (-n, the n key)
+ *
+ * The meter's slow/medium/fast integration, per mode.  The setting
+ * is read back whenever the mode changes so the display is right
+ * even if it was set on the front panel, and readings per second
+ * are measured for each mode and setting.
+ *
+ */
+#define RATES "SMF"
+#define RATE_TRIES 3
+
+struct rate_s
+{
+	char want[MMODES_MAX + 1]; // 0 = leave it as the meter has it
+	int known_mode;			   // mode active was read for, -1 = ask
+	char active;
+
+	int meas_mode;
+	char meas_rate;
+	uint64_t meas_t0, meas_n;
+	double sps; // over the last second
+
+	uint64_t n[MMODES_MAX + 1][3], ns[MMODES_MAX + 1][3];
+	uint64_t sets;
+	int tries; // settings sent that the read back didn't show
+};
+
+/*
+ * Charge and energy integration (-E)
+ *
+ * DCI readings are integrated over their monotonic timestamps with
+ * the trapezoid rule, so an uneven poll interval weighs each pair
+ * of readings by the time between them.  W.h needs a voltage too,
+ * a fixed one (-Ev) or the latest DCV reading of a second
+ * dm3058e-sdl publishing shared memory (-Es).
+ *
+ * An interval is never bridged if it's longer than -Eg, the link was
+ * resynced in it, a reply timeout stretched it past twice the usual
+ * interval, or the meter left DCI; it's counted as a gap, flagged
+ * on the reading after it, and integration carries on from there.
+ *
+ */
+#define INTEG_GAP_MS 2000
+#define INTEG_VOLTS_AGE_NS 2000000000ULL // -Es reading further than this from the current one isn't used
+#define INTEG_OVERLOAD 1e9				 // O.L comes back as 9.9e37
+
+struct integ_s
+{
+	double volts;	// -Ev, 0 = none
+	char *shm_name; // -Es
+	struct dm3058e_shm *vshm;
+	uint64_t vshm_retry_ns;
+	uint64_t gap_ns;
+
+	int have_last;
+	int left; // readings in another mode since the last one
+	uint64_t last_ns;
+	uint64_t last_timeouts, last_resyncs;
+	double dt_avg; // usual interval, seconds, 0 until there is one
+	double last_a, last_w;
+	int last_w_ok;
+
+	double as, ws; // A.s and W.s so far
+	double a_s, w_s; // seconds integrated, current and power
+	uint64_t gaps;
+	double gap_s; // seconds not integrated
+};
+
+/*
+ * Reading timestamps
+ *
+ * A reading is published once its range has been asked for too, so
+ * the time it's published at is late by a couple of round trips and
+ * however long the loop took to get to it.  Instead the value query
+ * is timed when it's written and when its reply completes.
+ *
+ * The meter runs free and answers the value query with its latest
+ * completed reading, so that reading's integration window ended no
+ * earlier than one reading period before the query arrived and no
+ * later than the reply starting back.  With T the integration time
+ * (one period, free running) the centre of the window is somewhere in
+ *
+ *   [write + query on the wire - 3T/2, reply - reply on the wire - T/2]
+ *
+ * and the estimate is the middle of that, the uncertainty half its
+ * width.  T is the nominal time for the reading rate in use, the
+ * DM3058E's 2.5, 20 and 123 readings/s; 0 where the rate isn't
+ * known or the mode has no setting, which leaves the round trip.
+ *
+ */
+const uint64_t acq_integ_ns[3] = {400000000ULL, 50000000ULL, 8130000ULL}; // S, M, F, see RATES
+
+struct acq_s
+{
+	uint64_t write_ns; // value query written, CLOCK_MONOTONIC
+	uint64_t reply_ns; // its reply complete
+	uint64_t t_ns;	   // estimated middle of the integration window, 0 if not known
+	uint64_t unc_ns;   // +/- on t_ns
+};
+
+/*
+ * One completed reading, as handed to the outputs by publish_sample()
+ *
+ */
+struct sample_s
+{
+	uint64_t t_ns;		 // CLOCK_MONOTONIC when the reading completed
+	struct timespec wall; // CLOCK_REALTIME at the same moment
+	double v;			 // raw value as returned by the meter
+	int mode_index;
+	int range_index; // meter range code, -1 if the function has none
+	char rate;		 // reading rate S, M or F, 0 if unknown or fixed
+	int gap;		 // -E, the interval before this reading wasn't integrated
+	double ah, wh;	 // -E totals including this reading
+	struct acq_s acq; // when it was actually taken, zero for a replay
+};
+
+#if USE_SDL
+#define BARGRAPH_TICKS 3
+
+/*
+ * Bar graph strip under the reading, showing the value as a
+ * percentage of the current range plus min/max peak hold markers.
+ *
+ * All the rectangles are computed once by bargraph_layout(), a
+ * new sample only changes fill.w and the marker x positions so a
+ * frame costs two fills and no TTF work at all.
+ *
+ */
+struct bargraph_s
+{
+	int enabled;
+	SDL_Rect area;							 // whole strip
+	SDL_Rect decor[4 + BARGRAPH_TICKS];		 // outline edges and tick marks
+	SDL_Rect fill;							 // the bar itself
+	SDL_Rect peaks[2];						 // min and max hold markers
+	int visible;							 // mode/range has a full scale
+	double fullscale;
+	double peak_lo, peak_hi;				 // as a fraction of full scale
+	uint64_t peak_t;						 // when the peaks were last reset
+	uint64_t hold_ns;
+	int mode_index, range_index;
+};
+#endif
+
+/*
+ * Localhost web view (-W <port>)
+ *
+ * The acquisition path only copies each sample into a broadcast
+ * ring and pokes an eventfd; a single epoll thread owns every
+ * socket, formats each sample once and fans it out to all the
+ * Server-Sent Events clients.  Adding viewers never touches the
+ * serial port or slows acquisition.
+ *
+ */
+#define WEB_RING_SIZE 256 // power of two
+#define WEB_MAX_CLIENTS 32
+#define WEB_CLIENT_BACKLOG 65536 // bytes queued for a slow viewer before it's dropped
+
+struct web_slot_s
+{
+	uint64_t seq; // sequence number + 1 once the slot is complete
+	struct sample_s s;
+	char range[32];
+	char display[64];
+};
+
+struct web_client_s
+{
+	int fd;
+	int sse; // subscribed to /events
+	char req[1024];
+	size_t req_len;
+	char *out; // pending output for a slow reader
+	size_t out_len;
+};
+
+struct web_s
+{
+	int port;
+	int listen_fd, event_fd, epoll_fd;
+	pthread_t thread;
+	uint64_t head; // next sequence to be written
+	uint64_t sent; // next sequence to broadcast, web_thread() only
+	struct web_slot_s ring[WEB_RING_SIZE];
+	struct web_client_s clients[WEB_MAX_CLIENTS];
+};
+
+/*
+ * JSON-RPC control socket (-J <socket path>)
+ *
+ * Scripts drive the meter through dm3058e-sdl instead of fighting it
+ * for the port.  One request per line, JSON-RPC 2.0, or a batch
+ * (array) that's worked through in order and answered in one line
+ * once every call in it is done, so a whole measurement plan can go
+ * in one write:
+ *
+ *	[{"jsonrpc":"2.0","id":1,"method":"set_function","params":{"mode":"2WR"}},
+ *	 {"jsonrpc":"2.0","id":2,"method":"read","params":{"n":10}}]
+ *
+ * An epoll thread owns the socket and every client.  Calls that
+ * change the meter are handed to the main loop, which queues them
+ * on the same command queue as the hotkeys, so the serial port still
+ * has one owner and nothing is sent that the polling wouldn't send.
+ * Readings come back through a broadcast ring like the web view's.
+ *
+ */
+#define RPC_MAX_CLIENTS 16
+#define RPC_RING_SIZE 1024 // power of two
+#define RPC_OPS 64
+#define RPC_CALLS_MAX 64 // in one batch
+#define RPC_LINE_MAX 16384
+#define RPC_READ_MAX 100000
+#define RPC_READ_TIMEOUT_MS 10000 // default for read, and for a mode switch to show
+
+#define RPC_SET_FUNCTION 1
+#define RPC_SET_RANGE 2
+#define RPC_SET_RATE 3
+#define RPC_READ 4
+#define RPC_STATS 5
+#define RPC_PAUSE 6
+#define RPC_RESUME 7
+#define RPC_STATUS 8
+
+#define RPC_CALL_NEW 0
+#define RPC_CALL_MAIN 1	 // with the main loop
+#define RPC_CALL_WAIT 2	 // waiting on readings
+#define RPC_CALL_DONE 3
+
+struct rpc_call_s
+{
+	char id[64]; // as sent, raw JSON
+	int notify;	 // no id, no answer
+	int method;
+	int mode;  // set_function
+	int code;  // set_range, or RANGE_AUTO
+	char rate; // set_rate
+	int n;	   // read
+	int reset; // stats
+	int timeout_ms;
+	int state;
+	uint64_t deadline_ns;
+	uint64_t t_ns;
+	int got;
+	char *out; // result or error member, without the braces round the response
+	size_t out_len, out_size;
+};
+
+struct rpc_op_s
+{
+	int client, gen, call; // to find the call again, if the client's still there
+	int method;
+	int mode, code;
+	char rate;
+	int error;
+	uint64_t seq; // readings published when it was carried out
+	char result[256];
+};
+
+struct rpc_client_s
+{
+	int fd;
+	int gen;
+	char req[RPC_LINE_MAX];
+	size_t req_len;
+	struct rpc_call_s calls[RPC_CALLS_MAX];
+	int ncalls, cur, batch;
+	int expect_mode; // set_function in this plan, reads only take this mode
+	uint64_t next;	 // ring cursor
+	char *out;
+	size_t out_len;
+};
+
+struct rpc_stats_s
+{
+	uint64_t count;
+	double min, max, mean, m2;
+};
+
+struct rpc_s
+{
+	char *path;
+	int listen_fd, wake_fd, epoll_fd;
+	pthread_t thread;
+	uint64_t head; // next sequence to be written
+	struct web_slot_s ring[RPC_RING_SIZE];
+	struct rpc_client_s clients[RPC_MAX_CLIENTS];
+
+	// thread -> main loop, and back
+	pthread_mutex_t lock;
+	struct rpc_op_s ops[RPC_OPS], done[RPC_OPS];
+	int ops_n, done_n;
+	int quit; // rpc_stop(), then wake_fd
+
+	// thread side
+	uint64_t stats_next;
+	struct rpc_stats_s stats[MMODES_MAX + 1];
+	uint64_t calls, batches;
+};
+
+/*
+ * SCPI proxy (-X <port>)
+ *
+ * Lab tools that speak raw SCPI over TCP (usually port 5025) share
+ * the meter through dm3058e-sdl.  Every client's lines go onto the
+ * one serial link through the command queue, interleaved with the
+ * display polling; each client's own requests are answered in order.
+ *
+ * Identical queries from several clients are coalesced: one already
+ * on its way to the meter, or answered within the last transaction
+ * time (one sample period), is answered from that one transaction.
+ * Anything that isn't a query can change what a query returns, so
+ * it ends any coalescing.
+ *
+ */
+#define PROXY_MAX_CLIENTS 32
+#define PROXY_TX_MAX 64
+#define PROXY_CMD_MAX 256
+#define PROXY_QUEUE_MAX 64 // requests a client can have waiting
+
+#define PROXY_TX_FREE 0
+#define PROXY_TX_QUEUED 1 // handed to the main loop
+#define PROXY_TX_DONE 2	  // answered, the reply can serve identical queries until valid_until
+
+struct proxy_tx_s
+{
+	int state;
+	char cmd[PROXY_CMD_MAX];
+	int query;
+	uint32_t waiters; // clients, bit per slot
+	uint32_t joined;  // the waiters that were coalesced onto it
+	uint32_t served;  // clients given the reply, a client asking again wants a new reading
+	int gen[PROXY_MAX_CLIENTS];
+	uint64_t t_ns;
+	char reply[PROXY_CMD_MAX];
+	int ok;
+	uint64_t valid_until;
+	int superseded; // a setting was queued after it, its reply is from before
+};
+
+struct proxy_req_s
+{
+	char cmd[PROXY_CMD_MAX];
+	uint64_t t_ns;
+};
+
+struct proxy_client_s
+{
+	int fd;
+	int gen;
+	char name[32];
+	char in[PROXY_CMD_MAX * 4];
+	size_t in_len;
+	struct proxy_req_s q[PROXY_QUEUE_MAX];
+	int q_head, q_n;
+	int busy; // the head request is with the meter
+	char *out;
+	size_t out_len;
+
+	uint64_t requests, coalesced, dropped;
+	int depth_max;
+	uint64_t wait_sum_ns, wait_max_ns;
+};
+
+struct proxy_done_s
+{
+	int tx;
+	int ok;
+	char reply[PROXY_CMD_MAX];
+};
+
+struct proxy_s
+{
+	int port;
+	int listen_fd, wake_fd, epoll_fd;
+	pthread_t thread;
+	struct proxy_client_s clients[PROXY_MAX_CLIENTS];
+	struct proxy_tx_s tx[PROXY_TX_MAX];
+
+	// thread -> main loop, and back
+	pthread_mutex_t lock;
+	int ops[PROXY_TX_MAX], ops_n;
+	struct proxy_done_s done[PROXY_TX_MAX];
+	int done_n;
+	int quit; // proxy_stop(), then wake_fd
+
+	uint64_t transactions, coalesced;
+};
+
+/*
+ * Append-only sample log (-L <file>)
+ *
+ * Readings are formatted into a large in-memory buffer and a
+ * background thread writes the buffer out in one go, so the
+ * acquisition path never waits on the disk.  Two buffers swap
+ * between the producer and the writer; if both are ever full the
+ * producer waits rather than dropping a sample.
+ *
+ * The same path writes the binary capture format (capture.h) when
+ * the file name ends in .dmc
+ *
+ * With -Lr / -Li / -Lz the log is cut into segments named after
+ * the time of their first sample, eg bench-20260101-120000.csv.
+ * A segment is written as <name>.part and renamed when it's
+ * complete, so anything without .part is whole.  The producer
+ * marks where in the buffer the next segment starts and the writer
+ * does the rotation when it reaches that point.  Finished segments
+ * are handed to an idle priority thread for gzip; only the writer
+ * ever talks to it.
+ *
+ * A capture also gets its min/max pyramid (capture.h).  The
+ * producer folds each sample in and the closed entries ride along
+ * in a second pair of buffers that swap with the main ones.
+ *
+ */
+#define LOG_BUF_SIZE (1024 * 1024)
+#define LOG_FLUSH_MS 250 // longest a sample sits in memory
+
+#define LOG_FSYNC_NEVER -1
+#define LOG_FSYNC_EVERY_FLUSH 0
+
+#define LOG_FORMAT_CSV 0
+#define LOG_FORMAT_TSV 1
+#define LOG_FORMAT_CAPTURE 2
+
+#define LOG_ZCHUNK (64 * 1024)
+#define LOG_PYR_MAX 8192 // pyramid entries per buffer
+
+struct pyramid_out_s
+{
+	int level;
+	struct pyramid_entry_s e;
+};
+
+struct log_segment_s
+{
+	char path[PATH_MAX];
+	uint64_t samples, bytes;
+	struct log_segment_s *next;
+};
+
+struct logger_s
+{
+	char *path;
+	int fd;
+	int format;
+	char sep; // ',' or '\t'
+	const char *idn;
+	int fsync_ms;
+	uint64_t last_sync_ns;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;  // writer has work
+	pthread_cond_t space; // producer may continue
+
+	char *buf[2];
+	size_t len[2];
+	int active;	 // buffer the producer appends to
+	int writing; // writer owns the other buffer
+	int quit;
+
+	uint64_t samples, bytes, flushes, stalls;
+
+	// binary capture state
+	uint64_t start_mono_ns;
+	uint64_t last_t_us;
+	uint32_t block_fill; // records in the current block, block_records means a sync is due
+	int need_header;	 // new file, header goes in with the first sample
+
+	// pyramid, captures only
+	struct pyramid_s pyr;
+	struct pyramid_out_s *pbuf[2];
+	size_t plen[2];
+	ssize_t pcut[2];
+	int pyr_fd[PYRAMID_LEVELS];
+	struct pyramid_entry_s *pyr_scratch;
+
+	// segments, all off unless one of -Lr -Li -Lz is given
+	int segmented;
+	int compress;
+	uint64_t rotate_bytes; // 0 = no size limit
+	int rotate_secs;	   // 0 = no time limit, else cut on multiples of this
+	time_t next_rotate;
+	uint64_t seg_samples, seg_bytes; // producer side, current segment
+	ssize_t cut[2];					 // offset in buf[] where the next segment starts, -1 if none
+	uint64_t cut_samples[2];		 // samples in the segment that ends at the cut
+	struct timespec cut_wall[2];	 // first sample of the segment that starts there
+	char seg_path[PATH_MAX];		 // name the open segment gets once complete
+	int integ;						 // -E, CSV/TSV get ah, wh and gap columns
+	uint64_t seg_written;			 // writer side
+	uint64_t segments;
+
+	pthread_t zthread;
+	pthread_mutex_t zlock;
+	pthread_cond_t zwake;
+	struct log_segment_s *zhead, *ztail;
+	int zquit;
+};
+
+/*
+ * Replay of a recorded log (-R <file>)
+ *
+ * The CSV/TSV logs and .dmc captures are mmap'd and fed back one
+ * reading at a time through the same formatting and output path as
+ * live readings.  Replay time is anchored to the monotonic clock;
+ * seeking, pausing or changing speed just moves the anchor.
+ *
+ * CSV has no block index, so a sparse one (every REPLAY_INDEX_STRIDE
+ * rows) is built when the file is opened.
+ *
+ */
+#define REPLAY_INDEX_STRIDE 1024
+
+struct replay_s
+{
+	char *path;
+	double speed; // 1 = real time, 0 = as fast as possible
+	double from_s;
+	int format;
+	const char *map;
+	size_t size;
+
+	struct capture_view_s cv;
+	uint64_t block;
+	uint32_t rec;
+
+	size_t off; // CSV cursor
+	size_t *index_off;
+	uint64_t *index_t;
+	size_t index_n;
+
+	// the reading at the cursor
+	int have;
+	uint64_t t_us; // since the first reading of the file
+	double v;
+	int mode_index, range_index;
+
+	uint64_t first_ns; // CSV t_mono of the first row
+	int64_t wall0_ns;  // wall clock of t_us 0, from the capture header
+	uint64_t anchor_t_us, anchor_ns;
+	int paused;
+
+	uint64_t count, bench_ns;
+};
+
+/*
+ * Limit alarms (-A <rule>)
+ *
+ * Rules hang off a list per mode, so a reading only looks at the
+ * rules for its own mode and each of those is a couple of compares;
+ * that is all the acquisition path ever does.  A rule that trips or
+ * clears queues an event for the alarm thread, which runs the
+ * command and writes the event line, so a slow command or a full
+ * pipe can't hold up the serial loop.  The OSD flash is picked up
+ * by the next frame.
+ *
+ * Every action records its latency from the reading's timestamp,
+ * summarised on exit.
+ *
+ */
+#define ALARM_MAX 16
+#define ALARM_QUEUE 64				// events, power of two
+#define ALARM_FLASH_NS 250000000ULL // half period of the OSD flash
+
+#define ALARM_ABOVE 0
+#define ALARM_BELOW 1
+#define ALARM_OUTSIDE 2
+
+#define ALARM_ACT_FLASH 0x01
+#define ALARM_ACT_EVENT 0x02
+#define ALARM_ACT_EXEC 0x04
+#define ALARM_ACT_CAPTURE 0x08 // pre-trigger capture, -P
+
+#define ALARM_LAT_FLASH 0
+#define ALARM_LAT_EVENT 1
+#define ALARM_LAT_EXEC 2
+
+struct alarm_rule_s
+{
+	char *spec; // as given on the command line
+	int mode_index;
+	int kind;
+	double lo, hi; // lo is the limit for ABOVE and BELOW
+	double hyst;
+	uint64_t hold_ns; // the reading has to stay beyond the limit this long
+	int actions;
+	char *exec;
+
+	int active;
+	int pending;
+	uint64_t pending_ns; // first reading beyond the limit
+	uint64_t trips;
+	struct alarm_rule_s *next; // next rule for the same mode
+};
+
+struct alarm_event_s
+{
+	int rule;
+	int tripped; // 0 when it cleared
+	double v;
+	uint64_t t0_ns; // latency is measured from here
+	struct timespec wall;
+};
+
+struct alarm_lat_s
+{
+	uint64_t n, sum_ns, min_ns, max_ns;
+};
+
+struct alarms_s
+{
+	struct alarm_rule_s rules[ALARM_MAX];
+	int count;
+	struct alarm_rule_s *by_mode[MMODES_MAX + 1];
+	int last_mode;
+
+	char *event_path; // unix socket, NULL for stdout
+	int event_fd;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	struct alarm_event_s queue[ALARM_QUEUE];
+	uint64_t head, tail;
+	uint64_t dropped;
+	int quit;
+
+	// OSD, main thread only
+	int flashing; // active rules that flash
+	uint64_t flash_start_ns;
+	uint64_t flash_t0_ns; // trip not yet on screen, 0 if none
+
+	struct alarm_lat_s lat[3];
+};
+
+/*
+ * Production test sequencer (-T <step file>)
+ *
+ * Each step names a test point, the meter function, the limits
+ * and how to take the reading:
+ *
+ *	# name	mode	low	high	[samples=N] [settle=ms] [stable=tolerance]
+ *	railA	DCV	3.20	3.40	samples=3 settle=50
+ *	netB	2WR	0	10	stable=0.01
+ *	C	CONT	0	10
+ *
+ * The function is set by the mode's mmodes[].query, which also
+ * takes a reading, so a step with no settle time uses that first
+ * reply as a sample.  Queries are pipelined (-Tp, default 2 in
+ * flight) so the meter never sits idle waiting for the host, and
+ * the next step's function change goes out as soon as the current
+ * step has all its queries queued.  With stable= readings are
+ * discarded until two in a row agree within the tolerance, instead
+ * of waiting a fixed worst case settle time.
+ *
+ * A DUT is run for every line on stdin (eg a barcode scanner), the
+ * line is the DUT's id, and one result record is written to stdout.
+ *
+ */
+#define SEQ_STEPS_MAX 64
+#define SEQ_PIPE_MAX 8
+#define SEQ_REPLY_MS 2000  // longest wait for any one reply
+#define SEQ_STABLE_MS 2000 // longest wait for readings to agree
+
+struct seq_step_s
+{
+	char name[32];
+	int mode_index;
+	double low, high;
+	int samples;
+	int settle_ms;
+	double stable; // 0 = off
+
+	// per DUT
+	int switch_sent, switched;
+	uint64_t t_switch;
+	int queued; // sample queries in flight
+	int accepted;
+	int settled;
+	double prev;
+	double min, max, sum;
+	const char *error;
+};
+
+struct seq_pending_s
+{
+	int step;
+	int is_switch;
+};
+
+struct sequence_s
+{
+	char *path;
+	int depth;
+	struct seq_step_s steps[SEQ_STEPS_MAX];
+	int count;
+
+	struct seq_pending_s pipe[SEQ_PIPE_MAX];
+	int pipe_head, pipe_len;
+	char rx[READ_BUF_SIZE];
+	size_t rx_len;
+
+	uint64_t duts, passed, total_ns, queries;
+};
+
+/*
+ * Pre-trigger capture (-P <file prefix>)
+ *
+ * Every reading goes into a fixed ring, so memory is bounded by the
+ * window sizes however long the session runs.  A trigger (an alarm
+ * rule with :capture, a mode change with -Pm, the t key or SIGUSR1)
+ * marks the reading it happened at; once the post-trigger window has
+ * filled, the span around it is handed to the dump thread, which
+ * copies it out of the live ring and writes it as a .dmc capture.
+ * The acquisition path only ever stores a sample and compares a
+ * couple of counters.
+ *
+ * The ring has slack beyond the two windows so the dump thread can
+ * copy a span while new readings keep arriving; if it falls so far
+ * behind that the span is overwritten the dump is abandoned.
+ *
+ */
+#define PRETRIG_RATE_MAX 200 // readings/s assumed to size a window given in seconds
+#define PRETRIG_JOBS 4
+
+struct pretrig_window_s
+{
+	uint64_t count; // readings, or
+	uint64_t ns;	// time
+};
+
+struct pretrig_job_s
+{
+	uint64_t first, trigger, end; // ring positions, first is where the pre window may start
+	char reason[64];
+};
+
+struct pretrig_s
+{
+	char *prefix;
+	struct pretrig_window_s pre, post;
+	int on_mode;
+	const char *idn;
+
+	struct sample_s *ring;
+	uint64_t size; // power of two
+	uint64_t head; // readings stored
+	uint64_t pre_cap, post_cap;
+	int last_mode;
+
+	int armed;
+	uint64_t trig_seq, trig_ns;
+	char reason[64];
+	uint64_t fired, ignored;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	struct pretrig_job_s jobs[PRETRIG_JOBS];
+	uint64_t jhead, jtail;
+	int quit;
+	uint64_t dumps, lost;
+};
+
 struct glb
 {
 	uint8_t debug;
@@ -142,6 +1129,10 @@ struct glb
 	uint16_t flags;
 	uint16_t error_flag;
 	char *output_file;
+	char *shm_name;
+	struct dm3058e_shm *shm;
+	uint32_t shm_slots;
+	size_t shm_size;
 	char device[PATH_MAX];
 
 	int usb_fhandle;
@@ -149,7 +1140,19 @@ struct glb
 	int comms_mode;
 	char *com_address;
 	char *serial_parameters_string;		  // this is the raw from the command line
+	int serial_fastest;					  // -sf
 	struct serial_params_s serial_params; // this is the decoded version
+	struct cmdq_s cmdq;
+	struct rangelock_s rangelock;
+	struct rate_s rate;
+	struct hostmath_s math[MMODES_MAX + 1]; // -M, per mode
+	char rx[READ_BUF_SIZE]; // received, not yet through data_read()
+	size_t rx_len, rx_pos;
+	int rx_taken; // the line in read_buffer went to the state machine
+	uint64_t rx_ns; // when the data in rx was read
+
+	struct acq_s acq;
+	uint64_t acq_n, acq_rtt_ns, acq_unc_ns; // for the exit summary
 
 	int mode_index;
 	int read_state;
@@ -163,11 +1166,35 @@ struct glb
 	char func[READ_BUF_SIZE];
 	char range[READ_BUF_SIZE];
 
+	int range_index;
+	struct sample_s sample;
+	char idn[128];
+
+	int headless;
+	struct web_s *web;
+	struct rpc_s *rpc;
+	struct proxy_s *proxy;
+	struct logger_s *logger;
+	struct replay_s *replay;
+	struct alarms_s *alarms;
+	struct sequence_s *sequence;
+	struct pretrig_s *pretrig;
+	struct integ_s *integ;
 	int interval;
+	int text_interval; // minimum us between re-rendering the text
 	int font_size;
+	int font_medium;
 	int window_width, window_height;
 	int wx_forced, wy_forced;
+	int wpx, wpy; // window position, -wp
+	int overlay;
+	float overlay_opacity;
 	SDL_Color font_color_pri, font_color_sec, background_color;
+
+#if USE_SDL
+	struct bargraph_s bar;
+	int frame_dirty;
+#endif
 };
 
 /*
@@ -180,6 +1207,17 @@ struct glb
  */
 struct glb *glbs;
 
+/*
+ * Set from the signal handler, checked by the main loop
+ *
+ */
+volatile sig_atomic_t quit_signal = 0;
+
+void handle_quit_signal(int sig)
+{
+	quit_signal = sig;
+}
+
 /*
  * Test to see if a file exists
  *
@@ -218,23 +1256,67 @@ int init(struct glb *g)
 	g->flags = 0;
 	g->error_flag = 0;
 	g->output_file = NULL;
-	g->interval = 100000; // 100ms / 100,000us interval of sleeping between frames
+	g->shm_name = NULL;
+	g->shm = NULL;
+	g->shm_slots = 0;
+	g->interval = -1; // default decided once we know if we're headless
+	g->headless = HEADLESS_NONE;
+	g->web = NULL;
+	g->rpc = NULL;
+	g->proxy = NULL;
+	g->logger = NULL;
+	g->replay = NULL;
+	g->alarms = NULL;
+	g->sequence = NULL;
+	g->pretrig = NULL;
+	g->integ = NULL;
+	g->range_index = -1;
+	memset(&(g->rangelock), 0, sizeof(g->rangelock));
+	g->rangelock.pending = RANGE_AUTO;
+	memset(&(g->rate), 0, sizeof(g->rate));
+	g->rate.known_mode = -1;
+	g->rate.meas_mode = -1;
+	for (int i = 0; i <= MMODES_MAX; i++)
+		hostmath_init(&(g->math[i]));
+	g->idn[0] = '\0';
+	g->text_interval = 200000; // numeric readout refreshes at 5Hz like the front panel
 	g->device[0] = '\0';
 	g->comms_mode = CMODE_NONE;
 
 	g->serial_parameters_string = NULL;
+	g->serial_fastest = 0;
+	memset(&(g->cmdq), 0, sizeof(g->cmdq));
+	g->cmdq.timeout_ns = CMD_TIMEOUT_MS * 1000000ULL;
+	g->rx_len = g->rx_pos = 0;
+	g->rx_taken = 0;
+	g->rx_ns = 0;
+	memset(&(g->acq), 0, sizeof(g->acq));
+	g->acq_n = g->acq_rtt_ns = g->acq_unc_ns = 0;
 
 	g->font_size = 60;
+	g->font_medium = 0;
 	g->window_width = 400;
 	g->window_height = 100;
 	g->wx_forced = 0;
 	g->wy_forced = 0;
+	g->wpx = -1;
+	g->wpy = -1;
+	g->overlay = 0;
+	g->overlay_opacity = 1.0;
 
 	g->font_color_pri = {10, 200, 10};
 	g->font_color_sec = {200, 200, 10};
 	g->background_color = {0, 0, 0};
 
-	return 0;
+#if USE_SDL
+	memset(&(g->bar), 0, sizeof(g->bar));
+	g->bar.enabled = 1;
+	g->bar.hold_ns = 2000000000ULL; // 2s peak hold
+	g->bar.mode_index = -2;			// force a full scale lookup on the first sample
+	g->frame_dirty = 1;
+#endif
+
+	return 0;
 }
 
 void show_help(void)
@@ -250,18 +1332,337 @@ void show_help(void)
 					"\t-q: quiet output\r\n"
 					"\t-v: show version\r\n"
 					"\t-z <font size in pt>\r\n"
+					"\t-m: use the medium weight font for the reading\r\n"
 					"\t-cv <volts colour, a0a0ff>\r\n"
 					"\t-ca <amps colour, ffffa0>\r\n"
 					"\t-cb <background colour, 101010>\r\n"
-					"\t-t <interval> (sleep delay between samples, default 100,000us)\r\n"
+					"\t-t <interval> (sleep delay between samples, default 100,000us, headless 0us)\r\n"
+					"\t-tt <interval> (minimum time between text redraws, default 200,000us)\r\n"
+					"\t-wx <width> -wy <height> force the window size\r\n"
+					"\t-wp <x>,<y> window position\r\n"
+					"\t-O: overlay; borderless, always on top, click-through (needs X11), only the text is opaque\r\n"
+					"\t-Oa <0.0-1.0> overlay opacity (needs a compositor)\r\n"
+					"\t-gn: no bar graph\r\n"
+					"\t-gp <ms> bar graph peak hold time (default 2000ms)\r\n"
 					"\t-p <comport>: Set the com port for the meter, eg: -p /dev/ttyUSB0\r\n"
-					"\t-s <115200|57600|38400|19200|9600> serial speed (default 115200)\r\n"
-					"\t-o <output file>\r\n"
+					"\t-s <auto|baud> serial speed, any rate the port takes (default auto, probes with *IDN?)\r\n"
+					"\t-sf switch the meter and port to the fastest rate both take, and report the difference\r\n"
+					"\t-st <ms> reply deadline, then a retry and a *CLS resync (default 1500ms)\r\n"
+					"\t-r <range code|hold> lock the range, hold = wherever autorange lands first\r\n"
+					"\t-n <[mode:]S|M|F> reading rate slow/medium/fast, all modes or one, repeatable\r\n"
+					"\t-E integrate DCI readings into A.h, shown and logged\r\n"
+					"\t-Ev <volts> fixed voltage for W.h\r\n"
+					"\t-Es <shm name> take the voltage for W.h from a second dm3058e-sdl -S on DCV\r\n"
+					"\t-Eg <ms> readings further apart than this aren't bridged (default 2000ms)\r\n"
+					"\t-M <mode>:<math>[:<math>] host side math, repeatable, eg -M DCV:rel or -M ACV:dbm=600\r\n"
+					"\t          rel[=<null>] db[=<ref>] dbm[=<ohms>] scale=<a> offset=<b> units=<text>\r\n"
+					"\t-o <output file> legacy FlexBV handshake, written when the file is absent\r\n"
+					"\t-S <shm name> publish readings in POSIX shared memory, see dm3058e-shm.h\r\n"
+					"\t-Sn <slots> shared memory ring size in readings (default 4096)\r\n"
+					"\t-H <text|json> headless; no X11/SDL, stream every reading to stdout\r\n"
+					"\t-W <port> serve a live web view on http://127.0.0.1:<port>/\r\n"
+					"\t-X <port> SCPI proxy on 127.0.0.1:<port> (eg 5025), shares the meter, coalesces queries\r\n"
+					"\t-J <socket path> JSON-RPC control socket; set_function, set_range, set_rate, read,\r\n"
+					"\t                 stats, pause, resume, status, one request or batch per line\r\n"
+					"\t-L <log file> append every reading, CSV (TSV if the name ends .tsv,\r\n"
+					"\t                 binary capture if it ends .dmc, see meterlog)\r\n"
+					"\t-Ls <never|flush|ms> log fsync policy (default never)\r\n"
+					"\t-Lr <size[k|M|G]> start a new log segment at this size\r\n"
+					"\t-Li <seconds[m|h|d]> start a new log segment every interval, eg -Li 1h\r\n"
+					"\t-Lz gzip finished log segments in the background\r\n"
+					"\t-A <rule> limit alarm, repeatable, eg -A DCV:above:5.25:hyst=0.05:for=200:flash\r\n"
+					"\t          <mode>:<above|below|outside>:<limit>[,<limit>][:hyst=<v>][:for=<ms>]\r\n"
+					"\t          [:flash][:event][:capture][:exec=<command, gets value and mode as $1 $2>]\r\n"
+					"\t-Ae <socket path> alarm event lines to a unix socket instead of stdout\r\n"
+					"\t-T <step file> production test sequencer, one DUT per line on stdin\r\n"
+					"\t-Tp <n> sequencer queries in flight (default 2, 1 = no pipelining)\r\n"
+					"\t-P <file prefix> pre-trigger capture, readings around each trigger go to <prefix>-<time>.dmc\r\n"
+					"\t-Pb <n|seconds s> keep this much before a trigger (default 1000 readings)\r\n"
+					"\t-Pa <n|seconds s> and this much after it (default 1000 readings)\r\n"
+					"\t-Pm trigger on a mode change; t key, SIGUSR1 and -A ..:capture always trigger\r\n"
+					"\t-R <log file> replay a CSV/TSV log or .dmc capture instead of reading the meter\r\n"
+					"\t-Rs <speed> replay speed, 1 = real time (default), 0 = as fast as possible\r\n"
+					"\t-Rf <seconds> start the replay this far into the log\r\n"
+					"\t              replay keys: p pause, left/right seek 10s, pgup/pgdn 10min, +/- speed\r\n"
 					"\r\n"
 					"\texample: DM3058E-sdl -p /dev/ttyUSB0 -s 38400\r\n",
 			BUILD_VER, BUILD_DATE);
 }
 
+/*
+ * parse_size()
+ *
+ * Byte count with an optional k, M or G (binary) suffix
+ *
+ */
+uint64_t parse_size(const char *p)
+{
+	char *e;
+	uint64_t v = strtoull(p, &e, 10);
+
+	switch (*e)
+	{
+	case 'G':
+		v *= 1024;
+		// fall through
+	case 'M':
+		v *= 1024;
+		// fall through
+	case 'k':
+	case 'K':
+		v *= 1024;
+	}
+
+	return v;
+}
+
+/*
+ * parse_interval()
+ *
+ * Seconds with an optional s, m, h or d suffix
+ *
+ */
+int parse_interval(const char *p)
+{
+	char *e;
+	int v = strtol(p, &e, 10);
+
+	switch (*e)
+	{
+	case 'd':
+		return v * 86400;
+	case 'h':
+		return v * 3600;
+	case 'm':
+		return v * 60;
+	}
+
+	return v;
+}
+
+/*
+ * parse_window()
+ *
+ * Pre-trigger window, a reading count or seconds with an s, m or h
+ * suffix, eg 500 or 2.5s
+ *
+ */
+void parse_window(const char *p, struct pretrig_window_s *w)
+{
+	char *e;
+	double v = strtod(p, &e);
+
+	w->count = 0;
+	w->ns = 0;
+	switch (*e)
+	{
+	case 'h':
+		v *= 60;
+		// fall through
+	case 'm':
+		v *= 60;
+		// fall through
+	case 's':
+		w->ns = v * 1e9;
+		break;
+	default:
+		w->count = v;
+		break;
+	}
+}
+
+/*
+ * rate_parse()
+ *
+ * -n F sets every mode that has a rate setting, -n DCV:S just one
+ *
+ */
+int rate_parse(struct glb *g, const char *arg)
+{
+	const char *c = strchr(arg, ':');
+	const char *r = c ? c + 1 : arg;
+	char rate = (r[0] >= 'a') ? r[0] - 'a' + 'A' : r[0];
+
+	if ((rate == '\0') || !strchr(RATES, rate) || (r[1] != '\0'))
+	{
+		fprintf(stderr, "%s:%d: Reading rate '%s' isn't S, M or F\n", FL, r);
+		return -1;
+	}
+
+	for (int i = 0; i <= MMODES_MAX; i++)
+	{
+		if (!rate_scpi[i])
+			continue;
+		if (c && ((strncmp(mmodes[i].scpi, arg, c - arg) != 0) || (mmodes[i].scpi[c - arg] != '\0')))
+			continue;
+		g->rate.want[i] = rate;
+		if (c)
+			return 0;
+	}
+
+	if (c)
+	{
+		fprintf(stderr, "%s:%d: No reading rate setting for mode '%.*s'\n", FL, (int)(c - arg), arg);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * alarm_parse()
+ *
+ * One -A rule, <mode>:<above|below|outside>:<limit>[,<limit>] then
+ * any of :hyst=<value> :for=<ms> :flash :event :capture
+ * :exec=<command>.
+ * exec has to come last, the command may contain ':'.  A rule
+ * without an action writes an event line.
+ *
+ */
+int alarm_parse(struct alarms_s *a, char *spec)
+{
+	struct alarm_rule_s *r;
+	char *s, *f, *save, *e;
+	int mi;
+
+	if (a->count >= ALARM_MAX)
+	{
+		fprintf(stdout, "Too many alarm rules, at most %d\n", ALARM_MAX);
+		return -1;
+	}
+	r = &(a->rules[a->count]);
+	memset(r, 0, sizeof(*r));
+	r->spec = spec;
+
+	s = strdup(spec);
+	e = strstr(s, ":exec=");
+	if (e)
+	{
+		*e = '\0';
+		r->exec = e + 6;
+		r->actions |= ALARM_ACT_EXEC;
+	}
+
+	f = strtok_r(s, ":", &save);
+	for (mi = 0; f && (mi <= MMODES_MAX); mi++)
+	{
+		if (strcasecmp(f, mmodes[mi].scpi) == 0)
+			break;
+	}
+	if (!f || (mi > MMODES_MAX))
+	{
+		fprintf(stdout, "Alarm '%s': unknown mode, use the SCPI name eg DCV, ACI, 2WR\n", spec);
+		return -1;
+	}
+	r->mode_index = mi;
+
+	f = strtok_r(NULL, ":", &save);
+	if (f && (strcmp(f, "above") == 0))
+		r->kind = ALARM_ABOVE;
+	else if (f && (strcmp(f, "below") == 0))
+		r->kind = ALARM_BELOW;
+	else if (f && (strcmp(f, "outside") == 0))
+		r->kind = ALARM_OUTSIDE;
+	else
+	{
+		fprintf(stdout, "Alarm '%s': expected above, below or outside\n", spec);
+		return -1;
+	}
+
+	f = strtok_r(NULL, ":", &save);
+	if (!f)
+	{
+		fprintf(stdout, "Alarm '%s': no limit\n", spec);
+		return -1;
+	}
+	r->lo = strtod(f, &e);
+	if (r->kind == ALARM_OUTSIDE)
+	{
+		if (*e != ',')
+		{
+			fprintf(stdout, "Alarm '%s': outside needs <low>,<high>\n", spec);
+			return -1;
+		}
+		r->hi = strtod(e + 1, NULL);
+		if (r->hi < r->lo)
+		{
+			double t = r->lo;
+			r->lo = r->hi;
+			r->hi = t;
+		}
+	}
+
+	while ((f = strtok_r(NULL, ":", &save)))
+	{
+		if (strncmp(f, "hyst=", 5) == 0)
+		{
+			r->hyst = strtod(f + 5, NULL);
+			if (r->hyst < 0)
+				r->hyst = -r->hyst;
+		}
+		else if (strncmp(f, "for=", 4) == 0)
+			r->hold_ns = strtoull(f + 4, NULL, 10) * 1000000ULL;
+		else if (strcmp(f, "flash") == 0)
+			r->actions |= ALARM_ACT_FLASH;
+		else if (strcmp(f, "event") == 0)
+			r->actions |= ALARM_ACT_EVENT;
+		else if (strcmp(f, "capture") == 0)
+			r->actions |= ALARM_ACT_CAPTURE;
+		else
+		{
+			fprintf(stdout, "Alarm '%s': unknown option '%s'\n", spec, f);
+			return -1;
+		}
+	}
+
+	if (!r->actions)
+		r->actions = ALARM_ACT_EVENT;
+	a->count++;
+
+	return 0;
+}
+
+/*
+ * math_parse()
+ *
+ * One -M, <mode>:<math>[:<math>...], see hostmath_option().
+ * Repeats for the same mode add to it.  Continuity is left alone,
+ * its open/short call is made on the raw resistance.
+ *
+ */
+int math_parse(struct glb *g, const char *spec)
+{
+	char *s, *f, *save;
+	int mi;
+
+	s = strdup(spec);
+	f = strtok_r(s, ":", &save);
+	for (mi = 0; f && (mi <= MMODES_MAX); mi++)
+	{
+		if (strcasecmp(f, mmodes[mi].scpi) == 0)
+			break;
+	}
+	if (!f || (mi > MMODES_MAX) || (mi == MMODES_CONT))
+	{
+		fprintf(stdout, "Math '%s': unknown mode, use the SCPI name eg DCV, ACV, 2WR (not CONT)\n", spec);
+		free(s);
+		return -1;
+	}
+
+	while ((f = strtok_r(NULL, ":", &save)))
+	{
+		if (hostmath_option(&(g->math[mi]), f) != 0)
+		{
+			fprintf(stdout, "Math '%s': can't use '%s'\n", spec, f);
+			free(s);
+			return -1;
+		}
+	}
+	free(s);
+
+	return 0;
+}
+
 /*-----------------------------------------------------------------\
   Date Code:	: 20180127-220258
   Function Name	: parse_parameters
@@ -351,307 +1752,6951 @@ int parse_parameters(struct glb *g, int argc, char **argv)
 				}
 				break;
 
+			case 'S':
+				i++;
+				if (i >= argc)
+				{
+					fprintf(stdout, "Insufficient parameters; -S <shm name>, eg -S %s / -Sn <ring slots>\n", DM3058E_SHM_NAME);
+					exit(1);
+				}
+				if (argv[i - 1][2] == 'n')
+					g->shm_slots = strtoul(argv[i], NULL, 10);
+				else
+					g->shm_name = argv[i];
+				break;
+
+			case 'A':
+				i++;
+				if (i >= argc)
+				{
+					fprintf(stdout, "Insufficient parameters; -A <rule> / -Ae <event socket>\n");
+					exit(1);
+				}
+				if (!g->alarms)
+				{
+					g->alarms = (struct alarms_s *)calloc(1, sizeof(struct alarms_s));
+					g->alarms->last_mode = -1;
+					g->alarms->event_fd = -1;
+				}
+				if (argv[i - 1][2] == 'e')
+					g->alarms->event_path = argv[i];
+				else if (alarm_parse(g->alarms, argv[i]) != 0)
+					exit(1);
+				break;
+
+			case 'T':
+				i++;
+				if (i >= argc)
+				{
+					fprintf(stdout, "Insufficient parameters; -T <step file> / -Tp <queries in flight>\n");
+					exit(1);
+				}
+				if (!g->sequence)
+				{
+					g->sequence = (struct sequence_s *)calloc(1, sizeof(struct sequence_s));
+					g->sequence->depth = 2;
+				}
+				if (argv[i - 1][2] == 'p')
+				{
+					g->sequence->depth = atoi(argv[i]);
+					if (g->sequence->depth < 1)
+						g->sequence->depth = 1;
+					if (g->sequence->depth > SEQ_PIPE_MAX)
+						g->sequence->depth = SEQ_PIPE_MAX;
+				}
+				else
+					g->sequence->path = argv[i];
+				break;
+
+			case 'P':
+				if (!g->pretrig)
+				{
+					g->pretrig = (struct pretrig_s *)calloc(1, sizeof(struct pretrig_s));
+					g->pretrig->pre.count = 1000;
+					g->pretrig->post.count = 1000;
+					g->pretrig->last_mode = -1;
+				}
+				if (argv[i][2] == 'm')
+				{
+					g->pretrig->on_mode = 1;
+					break;
+				}
+				i++;
+				if (i >= argc)
+				{
+					fprintf(stdout, "Insufficient parameters; -P <file prefix> / -Pb <before> / -Pa <after> / -Pm\n");
+					exit(1);
+				}
+				if (argv[i - 1][2] == 'b')
+					parse_window(argv[i], &(g->pretrig->pre));
+				else if (argv[i - 1][2] == 'a')
+					parse_window(argv[i], &(g->pretrig->post));
+				else
+					g->pretrig->prefix = argv[i];
+				break;
+
 			case 'd':
 				g->debug = 1;
 				break;
 
-			case 'q':
-				g->quiet = 1;
+			case 'm':
+				g->font_medium = 1;
 				break;
 
-			case 'v':
-				fprintf(stdout, "Build %d\r\n", BUILD_VER);
-				exit(0);
+			case 'L':
+				if (!g->logger)
+				{
+					g->logger = (struct logger_s *)calloc(1, sizeof(struct logger_s));
+					g->logger->fsync_ms = LOG_FSYNC_NEVER;
+				}
+				if (argv[i][2] == 'z')
+				{
+					g->logger->compress = 1;
+					g->logger->segmented = 1;
+					break;
+				}
+				i++;
+				if (i >= argc)
+				{
+					fprintf(stdout, "Insufficient parameters; -L <log file> / -Ls <never|flush|ms> / -Lr <size> / -Li <interval>\n");
+					exit(1);
+				}
+				if (argv[i - 1][2] == 'r')
+				{
+					g->logger->rotate_bytes = parse_size(argv[i]);
+					g->logger->segmented = 1;
+				}
+				else if (argv[i - 1][2] == 'i')
+				{
+					g->logger->rotate_secs = parse_interval(argv[i]);
+					g->logger->segmented = 1;
+				}
+				else if (argv[i - 1][2] == 's')
+				{
+					if (strcmp(argv[i], "never") == 0)
+						g->logger->fsync_ms = LOG_FSYNC_NEVER;
+					else if (strcmp(argv[i], "flush") == 0)
+						g->logger->fsync_ms = LOG_FSYNC_EVERY_FLUSH;
+					else
+						g->logger->fsync_ms = atoi(argv[i]);
+				}
+				else
+				{
+					g->logger->path = argv[i];
+				}
 				break;
 
-			case 't':
+			case 'r':
 				i++;
-				g->interval = atoi(argv[i]);
+				if (i >= argc)
+				{
+					fprintf(stdout, "Insufficient parameters; -r <range code|hold>\n");
+					exit(1);
+				}
+				if (strcmp(argv[i], "hold") == 0)
+					g->rangelock.pending = RANGE_HOLD;
+				else if ((argv[i][0] >= '0') && (argv[i][0] <= '9'))
+					g->rangelock.pending = atoi(argv[i]);
+				else
+				{
+					fprintf(stderr, "%s:%d: -r takes a range code, 0 for the lowest, or hold\n", FL);
+					exit(1);
+				}
 				break;
 
-			case 'c':
-				if (argv[i][2] == 'v')
+			case 'n':
+				i++;
+				if (i >= argc)
 				{
-					i++;
-					sscanf(argv[i], "%2hhx%2hhx%2hhx", &g->font_color_pri.r, &g->font_color_pri.g, &g->font_color_pri.b);
+					fprintf(stdout, "Insufficient parameters; -n <[mode:]S|M|F>\n");
+					exit(1);
 				}
-				else if (argv[i][2] == 'a')
+				if (rate_parse(g, argv[i]) != 0)
+					exit(1);
+				break;
+
+			case 'E':
+				if (!g->integ)
 				{
-					i++;
-					sscanf(argv[i], "%2hhx%2hhx%2hhx", &g->font_color_sec.r, &g->font_color_sec.g, &g->font_color_sec.b);
+					g->integ = (struct integ_s *)calloc(1, sizeof(struct integ_s));
+					if (!g->integ)
+					{
+						fprintf(stderr, "%s:%d: Unable to allocate the integrator\n", FL);
+						exit(1);
+					}
+					g->integ->gap_ns = INTEG_GAP_MS * 1000000ULL;
 				}
-				else if (argv[i][2] == 'b')
+				if (argv[i][2] == '\0')
+					break;
+				i++;
+				if (i >= argc)
 				{
-					i++;
-					sscanf(argv[i], "%2hhx%2hhx%2hhx", &(g->background_color.r), &(g->background_color.g), &(g->background_color.b));
+					fprintf(stdout, "Insufficient parameters; -Ev <volts> / -Es <shm name> / -Eg <ms>\n");
+					exit(1);
+				}
+				if (argv[i - 1][2] == 'v')
+				{
+					char *e;
+
+					g->integ->volts = strtod(argv[i], &e);
+					if ((e == argv[i]) || *e)
+					{
+						fprintf(stdout, "Invalid voltage '%s'; -Ev <volts>\n", argv[i]);
+						exit(1);
+					}
+				}
+				else if (argv[i - 1][2] == 's')
+					g->integ->shm_name = argv[i];
+				else if (argv[i - 1][2] == 'g')
+				{
+					char *e;
+					unsigned long long ms = strtoull(argv[i], &e, 10);
+
+					if ((e == argv[i]) || *e || (ms == 0))
+					{
+						fprintf(stdout, "Invalid gap '%s'; -Eg <ms>, 1 or more\n", argv[i]);
+						exit(1);
+					}
+					g->integ->gap_ns = ms * 1000000ULL;
+				}
+				else
+				{
+					fprintf(stdout, "Unknown option '%s'\n", argv[i - 1]);
+					exit(1);
 				}
 				break;
 
-			case 'w':
-				if (argv[i][2] == 'x')
+			case 'M':
+				i++;
+				if (i >= argc)
 				{
-					i++;
-					g->wx_forced = atoi(argv[i]);
+					fprintf(stdout, "Insufficient parameters; -M <mode>:<math>\n");
+					exit(1);
 				}
-				else if (argv[i][2] == 'y')
+				if (math_parse(g, argv[i]) != 0)
+					exit(1);
+				break;
+
+			case 'R':
+				i++;
+				if (i >= argc)
 				{
-					i++;
-					g->wy_forced = atoi(argv[i]);
+					fprintf(stdout, "Insufficient parameters; -R <log file> / -Rs <speed> / -Rf <seconds>\n");
+					exit(1);
+				}
+				if (!g->replay)
+				{
+					g->replay = (struct replay_s *)calloc(1, sizeof(struct replay_s));
+					g->replay->speed = 1.0;
 				}
+				if (argv[i - 1][2] == 's')
+					g->replay->speed = atof(argv[i]);
+				else if (argv[i - 1][2] == 'f')
+					g->replay->from_s = atof(argv[i]);
+				else
+					g->replay->path = argv[i];
 				break;
 
-			case 's':
+			case 'X':
+				i++;
+				if (i < argc)
+				{
+					g->proxy = (struct proxy_s *)calloc(1, sizeof(struct proxy_s));
+					g->proxy->port = atoi(argv[i]);
+				}
+				else
+				{
+					fprintf(stdout, "Insufficient parameters; -X <port>\n");
+					exit(1);
+				}
+				break;
+
+			case 'J':
 				i++;
-				g->serial_parameters_string = argv[i];
+				if (i < argc)
+				{
+					g->rpc = (struct rpc_s *)calloc(1, sizeof(struct rpc_s));
+					g->rpc->path = argv[i];
+				}
+				else
+				{
+					fprintf(stdout, "Insufficient parameters; -J <socket path>\n");
+					exit(1);
+				}
+				break;
+
+			case 'W':
+				i++;
+				if (i < argc)
+				{
+					char *end;
+					long port = strtol(argv[i], &end, 10);
+
+					if ((end == argv[i]) || *end || (port < 1) || (port > 65535))
+					{
+						fprintf(stdout, "Invalid port '%s'; -W <port>, 1..65535\n", argv[i]);
+						exit(1);
+					}
+					if (!g->web)
+						g->web = (struct web_s *)calloc(1, sizeof(struct web_s));
+					if (!g->web)
+					{
+						fprintf(stderr, "%s:%d: Unable to allocate the web view\n", FL);
+						exit(1);
+					}
+					g->web->port = port;
+				}
+				else
+				{
+					fprintf(stdout, "Insufficient parameters; -W <port>\n");
+					exit(1);
+				}
+				break;
+
+			case 'H':
+				/*
+				 * Headless; one line per reading on stdout,
+				 * either tab separated text or JSON
+				 *
+				 */
+				i++;
+				if (i < argc)
+				{
+					if (strcmp(argv[i], "json") == 0)
+						g->headless = HEADLESS_JSON;
+					else if (strcmp(argv[i], "text") == 0)
+						g->headless = HEADLESS_TEXT;
+					else
+					{
+						fprintf(stdout, "Invalid headless format '%s'; -H <text|json>\n", argv[i]);
+						exit(1);
+					}
+				}
+				else
+				{
+					fprintf(stdout, "Insufficient parameters; -H <text|json>\n");
+					exit(1);
+				}
+				break;
+
+			case 'q':
+				g->quiet = 1;
+				break;
+
+			case 'v':
+				fprintf(stdout, "Build %d\r\n", BUILD_VER);
+				exit(0);
+				break;
+
+			case 't':
+				i++;
+				if (i < argc)
+				{
+					if (argv[i - 1][2] == 't')
+						g->text_interval = atoi(argv[i]);
+					else
+						g->interval = atoi(argv[i]);
+				}
+				break;
+
+#if USE_SDL
+			case 'g':
+				if (argv[i][2] == 'n')
+				{
+					g->bar.enabled = 0;
+				}
+				else if (argv[i][2] == 'p')
+				{
+					i++;
+					if (i < argc)
+						g->bar.hold_ns = strtoull(argv[i], NULL, 10) * 1000000ULL;
+				}
+				break;
+#endif
+
+			case 'c':
+				if (argv[i][2] == 'v')
+				{
+					i++;
+					sscanf(argv[i], "%2hhx%2hhx%2hhx", &g->font_color_pri.r, &g->font_color_pri.g, &g->font_color_pri.b);
+				}
+				else if (argv[i][2] == 'a')
+				{
+					i++;
+					sscanf(argv[i], "%2hhx%2hhx%2hhx", &g->font_color_sec.r, &g->font_color_sec.g, &g->font_color_sec.b);
+				}
+				else if (argv[i][2] == 'b')
+				{
+					i++;
+					sscanf(argv[i], "%2hhx%2hhx%2hhx", &(g->background_color.r), &(g->background_color.g), &(g->background_color.b));
+				}
+				break;
+
+			case 'w':
+				if (argv[i][2] == 'x')
+				{
+					i++;
+					g->wx_forced = atoi(argv[i]);
+				}
+				else if (argv[i][2] == 'y')
+				{
+					i++;
+					g->wy_forced = atoi(argv[i]);
+				}
+				else if (argv[i][2] == 'p')
+				{
+					i++;
+					if ((i >= argc) || (sscanf(argv[i], "%d,%d", &g->wpx, &g->wpy) != 2))
+					{
+						fprintf(stdout, "Insufficient parameters; -wp <x>,<y>\n");
+						exit(1);
+					}
+				}
+				break;
+
+			case 'O':
+				g->overlay = 1;
+				if (argv[i][2] == 'a')
+				{
+					char *end;
+
+					i++;
+					if (i >= argc)
+					{
+						fprintf(stdout, "Insufficient parameters; -Oa <0.0-1.0>\n");
+						exit(1);
+					}
+					g->overlay_opacity = strtof(argv[i], &end);
+					if ((end == argv[i]) || *end || !(g->overlay_opacity >= 0.0) || (g->overlay_opacity > 1.0))
+					{
+						fprintf(stdout, "Invalid overlay opacity '%s'; -Oa <0.0-1.0>\n", argv[i]);
+						exit(1);
+					}
+				}
+				break;
+
+			case 's':
+				if (argv[i][2] == 'f')
+				{
+					g->serial_fastest = 1;
+					break;
+				}
+				i++;
+				if (i >= argc)
+				{
+					fprintf(stdout, "Insufficient parameters; -s <auto|speed> / -st <reply timeout ms>\n");
+					exit(1);
+				}
+				if (argv[i - 1][2] == 't')
+					g->cmdq.timeout_ns = strtoull(argv[i], NULL, 10) * 1000000ULL;
+				else
+					g->serial_parameters_string = argv[i];
+				break;
+
+			default:
+				break;
+			} // switch
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * now_ns()
+ *
+ * Monotonic time in nanoseconds, used for all sample timing
+ *
+ */
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * serial_speed()
+ *
+ * Set both directions to any rate, through termios2 if the driver
+ * takes it, else the nearest B* constant must be exact.  s->baud is
+ * what the driver actually set.  0 if it's within SERIAL_TOLERANCE.
+ *
+ */
+int serial_speed(struct serial_params_s *s, int baud)
+{
+	static const struct
+	{
+		int baud;
+		speed_t b;
+	} std[] = {{2400, B2400}, {4800, B4800}, {9600, B9600}, {19200, B19200}, {38400, B38400}, {57600, B57600}, {115200, B115200}, {230400, B230400}, {460800, B460800}, {921600, B921600}, {0, B0}};
+	struct serial_termios2 t2;
+
+	if (baud <= 0)
+		return -1;
+
+	if (ioctl(s->fd, SERIAL_TCGETS2, &t2) == 0)
+	{
+		t2.c_cflag &= ~(CBAUD | (CBAUD << SERIAL_IBSHIFT));
+		t2.c_cflag |= SERIAL_BOTHER | (SERIAL_BOTHER << SERIAL_IBSHIFT);
+		t2.c_ispeed = t2.c_ospeed = baud;
+		if ((ioctl(s->fd, SERIAL_TCSETS2, &t2) == 0) && (ioctl(s->fd, SERIAL_TCGETS2, &t2) == 0) && (t2.c_ospeed > 0))
+		{
+			s->baud = t2.c_ospeed;
+			return abs(s->baud - baud) * 100 <= baud * SERIAL_TOLERANCE ? 0 : -1;
+		}
+	}
+
+	for (int i = 0; std[i].baud; i++)
+	{
+		if (std[i].baud != baud)
+			continue;
+		cfsetspeed(&(s->newtp), std[i].b);
+		if (tcsetattr(s->fd, TCSANOW, &(s->newtp)) != 0)
+			return -1;
+		s->baud = baud;
+		return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * open_port()
+ *
+ * The DM3058E is fixed in the 8n1 parameters but the
+ * serial speed can vary between 2400-115200
+ *
+ * No flow control
+ *
+ * Default is auto, the port starts at 115200 and the meter's
+ * rate is found by serial_probe(); -s <baud> sets any rate
+ *
+ */
+int open_port(struct glb *g)
+{
+
+	struct serial_params_s *s = &(g->serial_params);
+	char *p = g->serial_parameters_string;
+	char default_params[] = "auto";
+	int r, baud;
+
+	if (!p)
+		p = default_params;
+
+	if (g->debug)
+		fprintf(stderr, "%s:%d: Attempting to open '%s'\n", FL, s->device);
+	s->fd = open(s->device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (s->fd < 0)
+	{
+		perror(s->device);
+		return -1;
+	}
+
+	r = flock(s->fd, LOCK_EX | LOCK_NB);
+	if (r == -1)
+	{
+		fprintf(stderr, "%s:%d: Unable to set lock on %s, Error '%s'\n", FL, s->device, strerror(errno));
+		return -1;
+	}
+
+	tcgetattr(s->fd, &(s->oldtp)); // save current serial port settings
+	tcgetattr(s->fd, &(s->newtp)); // save current serial port settings in to what will be our new settings
+	cfmakeraw(&(s->newtp));
+
+	s->newtp.c_cflag = CS8 | CLOCAL | CREAD;
+
+	// never blocks, every wait is a poll() with a deadline, see data_read()
+	s->newtp.c_cc[VTIME] = 0;
+	s->newtp.c_cc[VMIN] = 0;
+
+	//  This meter only accepts 8n1, no flow control
+
+	s->newtp.c_iflag &= ~(IXON | IXOFF | IXANY);
+	cfsetspeed(&(s->newtp), B115200);
+
+	r = tcsetattr(s->fd, TCSANOW, &(s->newtp));
+	if (r)
+	{
+		fprintf(stderr, "%s:%d: Error setting terminal (%s)\n", FL, strerror(errno));
+		return -1;
+	}
+
+	/*
+	 * auto starts at 115200 and is probed once the port's chosen,
+	 * see serial_probe()
+	 *
+	 */
+	s->probe = (strcmp(p, "auto") == 0);
+	baud = s->probe ? serial_probe_rates[0] : atoi(p);
+	if (baud <= 0)
+	{
+		fprintf(stdout, "Invalid serial speed '%s', -s <auto|baud>\r\n", p);
+		exit(1);
+	}
+	if (serial_speed(s, baud) != 0)
+	{
+		fprintf(stderr, "%s:%d: %s can't run at %d baud (got %d)\n", FL, s->device, baud, s->baud);
+		return -1;
+	}
+
+	if (g->debug)
+		fprintf(stderr, "Serial port opened, FD[%d]\n", s->fd);
+	return 0;
+}
+
+/*
+ * serial_line()
+ *
+ * Read one reply line, outside the polling loop (probing, *IDN?).
+ * Returns the length, or -1 if nothing complete came within ms.
+ *
+ */
+int serial_line(int fd, char *buf, size_t size, int ms)
+{
+	uint64_t deadline = now_ns() + ms * 1000000ULL;
+	size_t n = 0;
+
+	while (n < size - 1)
+	{
+		struct pollfd pfd;
+		uint64_t now = now_ns();
+		char c;
+
+		if (read(fd, &c, 1) == 1)
+		{
+			if (c == '\n')
+			{
+				buf[n] = '\0';
+				return n;
+			}
+			if (c != '\r')
+				buf[n++] = c;
+			continue;
+		}
+
+		if (now >= deadline)
+			break;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		poll(&pfd, 1, (deadline - now) / 1000000ULL + 1);
+	}
+	buf[n] = '\0';
+
+	return n == size - 1 ? (int)n : -1;
+}
+
+#define PORT_OK 0
+#define PORT_CANT_LOCK 10
+#define PORT_INVALID 11
+#define PORT_CANT_SET 12
+#define PORT_NO_SUCCESS -1
+
+/*
+ * serial_idn()
+ *
+ * One *IDN? at the port's current rate, skipping anything that isn't
+ * a DM3058/DM3068 reply.  The leading newline ends whatever the meter
+ * made of earlier tries at the wrong rate.  Length of the reply in
+ * buf, -1 if none came.
+ *
+ */
+int serial_idn(struct serial_params_s *s, char *buf, size_t size)
+{
+	uint64_t deadline = now_ns() + (SERIAL_IDN_MS + (s->baud ? 10000ULL * size / s->baud : 0)) * 1000000ULL;
+	uint64_t now;
+
+	tcflush(s->fd, TCIOFLUSH);
+	if (write(s->fd, "\n*IDN?\r\n", 8) != 8)
+		return -1;
+
+	while ((now = now_ns()) < deadline)
+	{
+		int n = serial_line(s->fd, buf, size, (deadline - now) / 1000000ULL + 1);
+
+		if (n < 0)
+			break;
+		if (strstr(buf, "DM3058") || strstr(buf, "DM3068"))
+			return n;
+	}
+	buf[0] = '\0';
+
+	return -1;
+}
+
+/*
+ * serial_probe_ports()
+ *
+ * Find which of n open ports has the meter on it, and at what rate.
+ * Every port gets the same rate and *IDN? at once, so the probe
+ * takes one reply deadline per rate however many ports there are,
+ * under 4s.  Index of the port that answered, left at
+ * that rate with g->idn filled in, or -1.
+ *
+ */
+int serial_probe_ports(struct glb *g, struct serial_params_s *ports, int n)
+{
+	char buf[SERIAL_PROBE_PORTS][sizeof(g->idn)];
+	size_t len[SERIAL_PROBE_PORTS];
+	struct pollfd pfd[SERIAL_PROBE_PORTS];
+
+	if (n > SERIAL_PROBE_PORTS)
+		n = SERIAL_PROBE_PORTS;
+
+	for (int r = 0; serial_probe_rates[r]; r++)
+	{
+		uint64_t deadline = now_ns() + (SERIAL_IDN_MS + 10000ULL * sizeof(buf[0]) / serial_probe_rates[r]) * 1000000ULL;
+		uint64_t now;
+		int live = 0;
+
+		for (int k = 0; k < n; k++)
+		{
+			pfd[k].fd = -1; // left out of this round
+			pfd[k].events = POLLIN;
+			len[k] = 0;
+			if (serial_speed(&(ports[k]), serial_probe_rates[r]) != 0)
+				continue;
+			if (g->debug)
+				fprintf(stderr, "%s:%d: Probing %s at %d baud\n", FL, ports[k].device, ports[k].baud);
+			// leading newline as in serial_idn()
+			tcflush(ports[k].fd, TCIOFLUSH);
+			if (write(ports[k].fd, "\n*IDN?\r\n", 8) != 8)
+				continue;
+			pfd[k].fd = ports[k].fd;
+			live++;
+		}
+
+		while (live && ((now = now_ns()) < deadline))
+		{
+			if (poll(pfd, n, (deadline - now) / 1000000ULL + 1) <= 0)
+				continue;
+
+			for (int k = 0; k < n; k++)
+			{
+				char c;
+
+				if (pfd[k].fd < 0)
+					continue;
+				if (pfd[k].revents & (POLLERR | POLLHUP | POLLNVAL))
+				{
+					pfd[k].fd = -1;
+					live--;
+					continue;
+				}
+				while (read(pfd[k].fd, &c, 1) == 1)
+				{
+					if (c == '\r')
+						continue;
+					if (c != '\n')
+					{
+						if (len[k] < sizeof(buf[k]) - 1)
+							buf[k][len[k]++] = c;
+						continue;
+					}
+					buf[k][len[k]] = '\0';
+					len[k] = 0;
+					if (strstr(buf[k], "DM3058") || strstr(buf[k], "DM3068"))
+					{
+						snprintf(g->idn, sizeof(g->idn), "%s", buf[k]);
+						return k;
+					}
+				}
+			}
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * serial_probe()
+ *
+ * Find the rate the meter on the port is set to, see
+ * serial_probe_ports().  If nothing answers the port is left at
+ * the first rate and -1 returned.
+ *
+ */
+int serial_probe(struct glb *g)
+{
+	if (serial_probe_ports(g, &(g->serial_params), 1) == 0)
+		return 0;
+	serial_speed(&(g->serial_params), serial_probe_rates[0]);
+
+	return -1;
+}
+
+/*
+ * serial_rtt()
+ *
+ * Average *IDN? round trip in ms over n queries, -1 if one went
+ * unanswered
+ *
+ */
+double serial_rtt(struct serial_params_s *s, int n)
+{
+	char buf[128];
+	uint64_t t0 = now_ns();
+
+	for (int i = 0; i < n; i++)
+	{
+		if (serial_idn(s, buf, sizeof(buf)) <= 0)
+			return -1;
+	}
+
+	return (now_ns() - t0) / 1e6 / n;
+}
+
+/*
+ * serial_fastest()
+ *
+ * -sf, move the meter and the port to the fastest rate both take.
+ * Each faster rate is first checked on the port, then the meter is
+ * told (it keeps the setting) and has to answer *IDN? at it; if it
+ * doesn't it's probed for again wherever it ended up.
+ *
+ */
+int serial_fastest(struct glb *g)
+{
+	struct serial_params_s *s = &(g->serial_params);
+	int from = s->baud;
+	double rtt0, rtt1;
+	char cmd[64], buf[sizeof(g->idn)];
+
+	rtt0 = serial_rtt(s, SERIAL_RTT_QUERIES);
+	if (rtt0 < 0)
+	{
+		fprintf(stderr, "Serial: no *IDN? reply at %d baud, not changing rate\n", from);
+		return -1;
+	}
+
+	for (int i = 0; serial_meter_rates[i] > from; i++)
+	{
+		int r = serial_meter_rates[i];
+
+		if ((serial_speed(s, r) != 0) || (serial_speed(s, from) != 0))
+		{
+			serial_speed(s, from);
+			continue; // the port can't do it
+		}
+
+		if (g->debug)
+			fprintf(stderr, "%s:%d: Switching the meter to %d baud\n", FL, r);
+		snprintf(cmd, sizeof(cmd), ":SYST:COMM:RS232:BAUD %d\r\n", r);
+		if (write(s->fd, cmd, strlen(cmd)) != (ssize_t)strlen(cmd))
+			return -1;
+		tcdrain(s->fd);
+		usleep(SERIAL_SWITCH_MS * 1000);
+
+		serial_speed(s, r);
+		if (serial_idn(s, buf, sizeof(buf)) > 0)
+			break;
+
+		// didn't follow, no point trying the slower ones
+		if (serial_probe(g) != 0)
+		{
+			fprintf(stderr, "Serial: lost the meter switching from %d to %d baud\n", from, r);
+			return -1;
+		}
+		break;
+	}
+
+	rtt1 = serial_rtt(s, SERIAL_RTT_QUERIES);
+	if (s->baud == from)
+		fprintf(stderr, "Serial: %d baud, %s, *IDN? round trip %.1f ms\n", from,
+				from >= serial_meter_rates[0] ? "already the fastest the meter takes" : "the meter or port won't go faster", rtt1 < 0 ? rtt0 : rtt1);
+	else
+		fprintf(stderr, "Serial: %d -> %d baud (%d -> %d bytes/s), *IDN? round trip %.1f -> %.1f ms\n",
+				from, s->baud, from / 10, s->baud / 10, rtt0, rtt1);
+
+	return rtt1 < 0 ? -1 : 0;
+}
+
+int find_port(struct glb *g)
+{
+
+	/*
+		For this multimeter, we actually *want* the read to time out
+		because it means that it's not just spewing out data, ie not
+		a SCPI device
+	 */
+	struct serial_params_s *s = &(g->serial_params);
+	struct serial_params_s cand[SERIAL_PROBE_PORTS]; // -s auto, probed together once they're all open
+	int nc = 0, k;
+
+	for (int port_number = 0; port_number < SERIAL_PROBE_PORTS; port_number++)
+	{
+		snprintf(s->device, sizeof(s->device) - 1, "/dev/ttyUSB%d", port_number);
+		if (g->debug)
+			fprintf(stderr, "Testing port %s\n", s->device);
+		int r = open_port(g);
+		if (r == PORT_OK)
+		{
+			char temp1[100];
+			memset(temp1,'\0',sizeof(temp1));
+			read(s->fd, &temp1, sizeof(temp1));
+			int bytes_read = 0;
+			fd_set set;
+			struct timeval timeout;
+
+			FD_ZERO(&set);
+			FD_SET(s->fd, &set);
+
+			timeout.tv_sec = 0;
+			timeout.tv_usec = 300000; // 0.3 seconds
+
+			{
+				char temp_char	 = 0;
+				int rv;
+
+				bytes_read = 0;
+				rv = select(s->fd + 1, &set, NULL, NULL, &timeout);
+				if (g->debug)
+					fprintf(stderr, "select result = %d\n", rv);
+				if (rv == -1)
+				{
+					break;
+				}
+				else if (rv == 0)
+				{
+				}
+				else
+					bytes_read = read(s->fd, &temp_char, sizeof(temp_char));
+
+				if (g->debug)
+					fprintf(stderr, "%d bytes read after select\n", bytes_read);
+				if (bytes_read > 0)
+				{
+					/*
+						not our meter!
+					 */
+					break;
+				}
+				else if ((rv == 0) && (bytes_read == 0))
+				{
+					char buf[100];
+
+					if (s->probe)
+					{
+						cand[nc++] = *s;
+						continue;
+					}
+
+					if (g->debug)
+						fprintf(stderr, "Testing port with *IDN? query\n");
+					size_t bytes_written = write(s->fd, "*IDN?\r\n", strlen("*IDN?\r\n"));
+					if (bytes_written > 0)
+					{
+						int bytes_read = serial_line(s->fd, buf, sizeof(buf), 1000);
+						if (bytes_read > 0)
+						{
+							if (g->debug)
+								fprintf(stderr, " %d bytes read, '%s'\n", bytes_read, buf);
+							if (strstr(buf, "DM3058")||strstr(buf, "DM3068"))
+							{
+								snprintf(g->idn, sizeof(g->idn), "%s", buf);
+								if (g->debug)
+									fprintf(stderr, "Port %s selected\n", s->device);
+								return PORT_OK;
+							}
+						}
+					}
+				}
+			}
+
+			close(s->fd);
+		} // port OK
+	}	  // for each port
+
+	if (nc == 0)
+		return PORT_NO_SUCCESS;
+
+	k = serial_probe_ports(g, cand, nc);
+	for (int i = 0; i < nc; i++)
+	{
+		if (i != k)
+			close(cand[i].fd);
+	}
+	if (k < 0)
+		return PORT_NO_SUCCESS;
+
+	*s = cand[k];
+	if (g->debug)
+		fprintf(stderr, "Port %s selected, %d baud\n", s->device, s->baud);
+	return PORT_OK;
+}
+
+/*
+ * proxy_wake()
+ *
+ */
+void proxy_wake(struct proxy_s *p)
+{
+	uint64_t one = 1;
+
+	if (write(p->wake_fd, &one, sizeof(one)) < 0)
+	{
+		// counter saturated, the thread is already due to wake
+	}
+}
+
+/*
+ * proxy_done()
+ *
+ * Main loop side, the meter answered a proxy transaction (or
+ * didn't, ok = 0)
+ *
+ */
+void proxy_done(struct proxy_s *p, int tx, const char *reply, int ok)
+{
+	pthread_mutex_lock(&(p->lock));
+	if (p->done_n < PROXY_TX_MAX)
+	{
+		struct proxy_done_s *d = &(p->done[p->done_n++]);
+
+		d->tx = tx;
+		d->ok = ok;
+		snprintf(d->reply, sizeof(d->reply), "%s", reply ? reply : "");
+	}
+	pthread_mutex_unlock(&(p->lock));
+	proxy_wake(p);
+}
+
+/*
+ * proxy_poll()
+ *
+ * Main loop side, queue the transactions the proxy thread handed
+ * over as user commands; cmd_flush() sends them
+ *
+ */
+void proxy_poll(struct glb *g)
+{
+	struct proxy_s *p = g->proxy;
+	struct cmdq_s *q = &(g->cmdq);
+
+	if (!__atomic_load_n(&(p->ops_n), __ATOMIC_RELAXED))
+		return;
+
+	/*
+	 * Room is left for a poll, so the in flight FIFO never has to
+	 * forget a proxy command; the rest wait their turn here
+	 *
+	 */
+	pthread_mutex_lock(&(p->lock));
+	while ((p->ops_n > 0) && (q->user_n < CMD_USER_MAX) && (q->n + q->user_n < CMD_INFLIGHT_MAX - 1))
+	{
+		struct cmd_s *c = &(q->user[q->user_n++]);
+
+		memset(c, 0, sizeof(*c));
+		c->user = CMD_USER_PROXY;
+		c->proxy = p->ops[0];
+		c->t_ns = now_ns();
+		memmove(p->ops, p->ops + 1, --(p->ops_n) * sizeof(p->ops[0]));
+	}
+	pthread_mutex_unlock(&(p->lock));
+}
+
+/*
+ * proxy_send()
+ *
+ * As web_send(), without a cap; a client reading slowly only holds
+ * up its own answers
+ *
+ */
+int proxy_send(struct proxy_s *p, struct proxy_client_s *c, const char *d, size_t len)
+{
+	ssize_t sz = 0;
+
+	if (c->out_len == 0)
+	{
+		sz = send(c->fd, d, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sz < 0)
+		{
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+				return -1;
+			sz = 0;
+		}
+		if ((size_t)sz == len)
+			return 0;
+	}
+
+	char *o = (char *)realloc(c->out, c->out_len + (len - sz));
+	if (!o)
+		return -1;
+	c->out = o;
+	memcpy(c->out + c->out_len, d + sz, len - sz);
+	c->out_len += len - sz;
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.ptr = c;
+	epoll_ctl(p->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+
+	return 0;
+}
+
+/*
+ * proxy_report()
+ *
+ * One client's queue depth and wait times
+ *
+ */
+void proxy_report(struct proxy_client_s *c)
+{
+	if (glbs->quiet || (c->requests == 0))
+		return;
+
+	fprintf(stderr, "Proxy %s: %lu requests, %lu coalesced, queue depth %d at most, wait %.1f ms average, %.1f ms at most\n",
+			c->name, (unsigned long)c->requests, (unsigned long)c->coalesced, c->depth_max,
+			c->wait_sum_ns / 1e6 / c->requests, c->wait_max_ns / 1e6);
+}
+
+void proxy_close(struct proxy_s *p, struct proxy_client_s *c)
+{
+	int gen = c->gen + 1;
+
+	proxy_report(c);
+	epoll_ctl(p->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	free(c->out);
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+	c->gen = gen; // answers still coming for the old client are dropped
+}
+
+/*
+ * proxy_finish()
+ *
+ * The client's head request is answered, reply is NULL for a
+ * setting or a query the meter didn't answer
+ *
+ */
+int proxy_finish(struct proxy_s *p, struct proxy_client_s *c, const char *reply, int coalesced)
+{
+	struct proxy_req_s *r = &(c->q[c->q_head]);
+	uint64_t wait = now_ns() - r->t_ns;
+
+	c->requests++;
+	c->coalesced += coalesced;
+	c->wait_sum_ns += wait;
+	if (wait > c->wait_max_ns)
+		c->wait_max_ns = wait;
+
+	c->q_head = (c->q_head + 1) % PROXY_QUEUE_MAX;
+	c->q_n--;
+	c->busy = 0;
+
+	if (reply)
+	{
+		char line[PROXY_CMD_MAX + 2];
+		int sz = snprintf(line, sizeof(line), "%s\n", reply);
+
+		return proxy_send(p, c, line, sz);
+	}
+
+	return 0;
+}
+
+/*
+ * proxy_next()
+ *
+ * Start the client's next request: join an identical query that's
+ * on its way or answer it from one just answered, or else hand it
+ * to the main loop as a new transaction
+ *
+ */
+int proxy_next(struct proxy_s *p, struct proxy_client_s *c)
+{
+	while (!c->busy && (c->q_n > 0))
+	{
+		struct proxy_req_s *r = &(c->q[c->q_head]);
+		int query = strchr(r->cmd, '?') != NULL;
+		int k = c - p->clients;
+		int t, free_t = -1, oldest_t = -1;
+		uint64_t now = now_ns();
+
+		for (t = 0; t < PROXY_TX_MAX; t++)
+		{
+			struct proxy_tx_s *x = &(p->tx[t]);
+
+			if (x->state == PROXY_TX_FREE)
+			{
+				if (free_t < 0)
+					free_t = t;
+				continue;
+			}
+			if (!query)
+			{
+				x->valid_until = 0; // a setting, nothing answered or asked before it is current
+				x->superseded = 1;
+				continue;
+			}
+			if (x->query && !x->superseded && (strcmp(x->cmd, r->cmd) == 0))
+				break;
+			if ((x->state == PROXY_TX_DONE) && ((oldest_t < 0) || (x->t_ns < p->tx[oldest_t].t_ns)))
+				oldest_t = t;
+		}
+
+		if ((t < PROXY_TX_MAX) && (p->tx[t].state == PROXY_TX_QUEUED))
+		{
+			p->tx[t].waiters |= 1U << k;
+			p->tx[t].joined |= 1U << k;
+			p->tx[t].gen[k] = c->gen;
+			c->busy = 1;
+			p->coalesced++;
+			return 0;
+		}
+		if ((t < PROXY_TX_MAX) && (now < p->tx[t].valid_until) && !(p->tx[t].served & (1U << k)))
+		{
+			p->tx[t].served |= 1U << k;
+			p->coalesced++;
+			if (proxy_finish(p, c, p->tx[t].ok ? p->tx[t].reply : NULL, 1) != 0)
+				return -1;
+			continue;
+		}
+
+		if (t < PROXY_TX_MAX)
+			free_t = t; // same query, too old to use, reuse its slot
+		if (free_t < 0)
+			free_t = oldest_t;
+		if (free_t < 0)
+			return 0; // every slot on its way to the meter, try again when one's done
+
+		struct proxy_tx_s *x = &(p->tx[free_t]);
+
+		memset(x, 0, sizeof(*x));
+		x->state = PROXY_TX_QUEUED;
+		snprintf(x->cmd, sizeof(x->cmd), "%s", r->cmd);
+		x->query = query;
+		x->waiters = 1U << k;
+		x->gen[k] = c->gen;
+		x->t_ns = now;
+		c->busy = 1;
+		p->transactions++;
+
+		pthread_mutex_lock(&(p->lock));
+		p->ops[p->ops_n++] = free_t; // can't overflow, one per slot
+		pthread_mutex_unlock(&(p->lock));
+	}
+
+	return 0;
+}
+
+/*
+ * proxy_input()
+ *
+ * Complete lines from a client onto its queue
+ *
+ */
+int proxy_input(struct proxy_s *p, struct proxy_client_s *c)
+{
+	char *nl;
+
+	while ((nl = (char *)memchr(c->in, '\n', c->in_len)))
+	{
+		size_t n = nl - c->in + 1;
+		size_t l = n - 1;
+
+		while ((l > 0) && ((c->in[l - 1] == '\r') || (c->in[l - 1] == ' ')))
+			l--;
+		if ((l > 0) && (l < PROXY_CMD_MAX))
+		{
+			if (c->q_n < PROXY_QUEUE_MAX)
+			{
+				struct proxy_req_s *r = &(c->q[(c->q_head + c->q_n++) % PROXY_QUEUE_MAX]);
+
+				memcpy(r->cmd, c->in, l);
+				r->cmd[l] = '\0';
+				r->t_ns = now_ns();
+				if (c->q_n > c->depth_max)
+					c->depth_max = c->q_n;
+			}
+			else
+			{
+				c->dropped++;
+			}
+		}
+		memmove(c->in, c->in + n, c->in_len - n);
+		c->in_len -= n;
+	}
+
+	if (c->in_len == sizeof(c->in))
+		return -1; // no line end in sight, not SCPI
+
+	return proxy_next(p, c);
+}
+
+/*
+ * proxy_collect()
+ *
+ * Answers from the main loop to everyone waiting on them
+ *
+ */
+void proxy_collect(struct proxy_s *p)
+{
+	struct proxy_done_s done[PROXY_TX_MAX];
+	int n;
+
+	pthread_mutex_lock(&(p->lock));
+	n = p->done_n;
+	memcpy(done, p->done, n * sizeof(done[0]));
+	p->done_n = 0;
+	pthread_mutex_unlock(&(p->lock));
+
+	for (int i = 0; i < n; i++)
+	{
+		struct proxy_tx_s *x = &(p->tx[done[i].tx]);
+		uint64_t now = now_ns();
+
+		x->ok = done[i].ok;
+		snprintf(x->reply, sizeof(x->reply), "%s", done[i].reply);
+		x->state = PROXY_TX_DONE;
+		x->valid_until = (x->query && x->ok && !x->superseded) ? now + (now - x->t_ns) : 0;
+
+		for (int k = 0; k < PROXY_MAX_CLIENTS; k++)
+		{
+			struct proxy_client_s *c = &(p->clients[k]);
+
+			if (!(x->waiters & (1U << k)) || (c->fd < 0) || (c->gen != x->gen[k]) || !c->busy)
+				continue;
+			x->served |= 1U << k;
+			if (proxy_finish(p, c, (x->query && x->ok) ? x->reply : NULL, (x->joined >> k) & 1) != 0)
+				proxy_close(p, c);
+		}
+		x->waiters = x->joined = 0;
+		x->t_ns = now; // age for slot reuse from the answer
+	}
+
+	for (int k = 0; k < PROXY_MAX_CLIENTS; k++)
+	{
+		struct proxy_client_s *c = &(p->clients[k]);
+
+		if ((c->fd >= 0) && (proxy_next(p, c) != 0))
+			proxy_close(p, c);
+	}
+}
+
+/*
+ * proxy_thread()
+ *
+ * Owns the listening socket and every client
+ *
+ */
+void *proxy_thread(void *arg)
+{
+	struct proxy_s *p = (struct proxy_s *)arg;
+	struct epoll_event events[PROXY_MAX_CLIENTS + 2];
+	int quit = 0;
+
+	while (!quit)
+	{
+		int n = epoll_wait(p->epoll_fd, events, PROXY_MAX_CLIENTS + 2, -1);
+
+		for (int i = 0; i < n; i++)
+		{
+			if (events[i].data.ptr == &(p->listen_fd))
+			{
+				struct sockaddr_in sa;
+				socklen_t sl = sizeof(sa);
+				int fd = accept4(p->listen_fd, (struct sockaddr *)&sa, &sl, SOCK_NONBLOCK | SOCK_CLOEXEC);
+				int k;
+
+				if (fd < 0)
+					continue;
+				for (k = 0; k < PROXY_MAX_CLIENTS; k++)
+					if (p->clients[k].fd < 0)
+						break;
+				if (k == PROXY_MAX_CLIENTS)
+				{
+					close(fd);
+					continue;
+				}
+
+				struct proxy_client_s *c = &(p->clients[k]);
+				struct epoll_event cev;
+				int one = 1;
+
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+				c->fd = fd;
+				snprintf(c->name, sizeof(c->name), "127.0.0.1:%d", ntohs(sa.sin_port));
+				cev.events = EPOLLIN;
+				cev.data.ptr = c;
+				epoll_ctl(p->epoll_fd, EPOLL_CTL_ADD, fd, &cev);
+			}
+			else if (events[i].data.ptr == &(p->wake_fd))
+			{
+				uint64_t count;
+
+				if (read(p->wake_fd, &count, sizeof(count)) < 0)
+					continue;
+				proxy_collect(p);
+				pthread_mutex_lock(&(p->lock));
+				quit = p->quit;
+				pthread_mutex_unlock(&(p->lock));
+			}
+			else
+			{
+				struct proxy_client_s *c = (struct proxy_client_s *)events[i].data.ptr;
+
+				if (events[i].events & (EPOLLHUP | EPOLLERR))
+				{
+					proxy_close(p, c);
+					continue;
+				}
+
+				if (events[i].events & EPOLLOUT)
+				{
+					ssize_t sz = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+					if ((sz < 0) && (errno != EAGAIN))
+					{
+						proxy_close(p, c);
+						continue;
+					}
+					if (sz > 0)
+					{
+						memmove(c->out, c->out + sz, c->out_len - sz);
+						c->out_len -= sz;
+					}
+					if (c->out_len == 0)
+					{
+						struct epoll_event cev;
+						cev.events = EPOLLIN;
+						cev.data.ptr = c;
+						epoll_ctl(p->epoll_fd, EPOLL_CTL_MOD, c->fd, &cev);
+					}
+				}
+
+				if (events[i].events & EPOLLIN)
+				{
+					ssize_t sz = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+					if (sz <= 0)
+					{
+						if ((sz == 0) || (errno != EAGAIN))
+							proxy_close(p, c);
+						continue;
+					}
+					c->in_len += sz;
+					if (proxy_input(p, c) != 0)
+						proxy_close(p, c);
+				}
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * proxy_start()
+ *
+ * Listen on 127.0.0.1:<port> and start the thread
+ *
+ */
+int proxy_start(struct proxy_s *p)
+{
+	struct sockaddr_in sa;
+	struct epoll_event ev;
+	int one = 1;
+
+	for (int k = 0; k < PROXY_MAX_CLIENTS; k++)
+		p->clients[k].fd = -1;
+
+	p->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (p->listen_fd < 0)
+		return -1;
+	setsockopt(p->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(p->port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((bind(p->listen_fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) || (listen(p->listen_fd, 16) != 0))
+	{
+		fprintf(stderr, "%s:%d: Unable to listen on 127.0.0.1:%d (%s)\n", FL, p->port, strerror(errno));
+		close(p->listen_fd);
+		return -1;
+	}
+
+	pthread_mutex_init(&(p->lock), NULL);
+	p->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	p->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &(p->listen_fd);
+	epoll_ctl(p->epoll_fd, EPOLL_CTL_ADD, p->listen_fd, &ev);
+	ev.data.ptr = &(p->wake_fd);
+	epoll_ctl(p->epoll_fd, EPOLL_CTL_ADD, p->wake_fd, &ev);
+
+	if (pthread_create(&(p->thread), NULL, proxy_thread, p) != 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * proxy_stop()
+ *
+ * Clients still connected report as they stand
+ *
+ */
+void proxy_stop(struct proxy_s *p)
+{
+	uint64_t one = 1;
+
+	// the thread owns the clients, stop it before reading them
+	pthread_mutex_lock(&(p->lock));
+	p->quit = 1;
+	pthread_mutex_unlock(&(p->lock));
+	if (write(p->wake_fd, &one, sizeof(one)) != sizeof(one))
+		return;
+	pthread_join(p->thread, NULL);
+
+	for (int k = 0; k < PROXY_MAX_CLIENTS; k++)
+	{
+		if (p->clients[k].fd >= 0)
+			proxy_report(&(p->clients[k]));
+	}
+	if (!glbs->quiet)
+		fprintf(stderr, "Proxy: %lu meter transactions, %lu requests coalesced\n", (unsigned long)p->transactions,
+				(unsigned long)p->coalesced);
+}
+
+/*
+ * cmd_reply()
+ *
+ * A reply line arrived, match it to the oldest command in flight.
+ * Returns 1 if it's the answer the polling state machine is waiting
+ * for, 0 if it's to be dropped.
+ *
+ */
+int cmd_reply(struct glb *g)
+{
+	struct cmdq_s *q = &(g->cmdq);
+	struct cmd_s *c;
+
+	if (q->n == 0)
+	{
+		q->stale_replies++; // nothing asked for it, eg junk after a resync
+		return 0;
+	}
+
+	c = &(q->inflight[q->head]);
+	q->head = (q->head + 1) % CMD_INFLIGHT_MAX;
+	q->n--;
+
+	if (c->user == CMD_USER_PROXY)
+	{
+		proxy_done(g->proxy, c->proxy, g->read_buffer, 1);
+		return 0;
+	}
+
+	if (c->user || c->stale)
+	{
+		if (g->debug)
+			fprintf(stderr, "%s:%d: Dropped reply to %s command #%lu\n", FL, c->user ? "user" : "stale", (unsigned long)c->seq);
+		if (c->stale)
+			q->stale_replies++;
+		return 0;
+	}
+
+	q->retries = 0;
+	q->reply_write_ns = c->t_ns;
+	q->reply_rx_ns = g->rx_ns;
+
+	return 1;
+}
+
+/*
+ * data_read()
+ *
+ * Never blocks for longer than the oldest command's deadline (or a
+ * UI tick with a window to keep responsive).  Takes whatever has
+ * arrived in one read, each complete line is matched to its command
+ * by cmd_reply() and the state machine only moves on for the poll
+ * it's waiting on.  Returns 1 when it did.
+ *
+ */
+int data_read(glb *g)
+{
+	struct cmdq_s *q = &(g->cmdq);
+	int waited = 0;
+
+	if (g->rx_taken)
+	{
+		// dealt with by now, the next line starts afresh
+		g->rx_taken = 0;
+		g->bp = g->read_buffer;
+		*(g->bp) = '\0';
+		g->bytes_remaining = READ_BUF_SIZE;
+	}
+
+	while (1)
+	{
+		while (g->rx_pos < g->rx_len)
+		{
+			char c = g->rx[g->rx_pos++];
+
+			if (c == '\n')
+			{
+				*(g->bp) = '\0';
+				if (cmd_reply(g))
+				{
+					g->read_state++; // switch to next read state
+					g->rx_taken = 1;
+					return 1;
+				}
+
+				// not ours, the line starts again
+				g->bp = g->read_buffer;
+				*(g->bp) = '\0';
+				g->bytes_remaining = READ_BUF_SIZE;
+				continue;
+			}
+
+			if ((c != '\r') && (g->bytes_remaining > 1))
+			{
+				if (g->debug)
+					fprintf(stderr, "%c", c);
+				*(g->bp) = c;
+				(g->bp)++;
+				*(g->bp) = '\0';
+				g->bytes_remaining--;
+			}
+		}
+		g->rx_pos = g->rx_len = 0;
+
+		ssize_t sz = read(g->serial_params.fd, g->rx, sizeof(g->rx));
+		if (sz > 0)
+		{
+			g->rx_ns = now_ns();
+			g->rx_len = sz;
+			continue;
+		}
+
+		if (waited || (q->n == 0))
+			return 0;
+
+		/*
+		 * Nothing yet, sleep in poll() until there's something to
+		 * read or the oldest command runs out of time
+		 *
+		 */
+		struct pollfd pfd;
+		uint64_t now = now_ns(), deadline = q->inflight[q->head].deadline_ns;
+		int ms = deadline > now ? (deadline - now) / 1000000ULL + 1 : 0;
+
+		if (!g->headless && (ms > CMD_UI_TICK_MS))
+			ms = CMD_UI_TICK_MS;
+		pfd.fd = g->serial_params.fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, ms) <= 0)
+			return 0;
+		waited = 1;
+	}
+}
+
+/*
+ * data_write()
+ *		const char *d : pointer to data to write/send
+ *		ssize_t s : number of bytes to send
+ *
+ */
+int data_write(glb *g, const char *d, ssize_t s)
+{
+	ssize_t sz;
+
+	if (g->debug)
+		fprintf(stderr, "%s:%d: Sending '%s' [%ld bytes]\n", FL, d, s);
+	sz = write(g->serial_params.fd, d, s);
+	if (sz < 0)
+	{
+		g->error_flag = true;
+		fprintf(stdout, "Error sending serial data: %s\n", strerror(errno));
+	}
+
+	return sz;
+}
+
+/*
+ * cmd_counters()
+ *
+ * Timeout and resync counts, also published with -S
+ *
+ */
+void cmd_counters(struct glb *g)
+{
+	if (!g->shm)
+		return;
+	__atomic_store_n(&(g->shm->timeouts), (uint32_t)g->cmdq.timeouts, __ATOMIC_RELAXED);
+	__atomic_store_n(&(g->shm->resyncs), (uint32_t)g->cmdq.resyncs, __ATOMIC_RELAXED);
+}
+
+/*
+ * cmd_track()
+ *
+ */
+void cmd_track(struct glb *g, struct cmd_s *c)
+{
+	struct cmdq_s *q = &(g->cmdq);
+
+	if (q->n >= CMD_INFLIGHT_MAX)
+	{
+		// can't happen unless replies stopped coming, forget the oldest
+		q->head = (q->head + 1) % CMD_INFLIGHT_MAX;
+		q->n--;
+		q->expired++;
+	}
+	q->inflight[(q->head + q->n) % CMD_INFLIGHT_MAX] = *c;
+	q->n++;
+}
+
+/*
+ * poll_write()
+ *
+ * Send a polling command, its reply goes to the state machine
+ *
+ */
+int poll_write(struct glb *g, const char *cmd)
+{
+	struct cmd_s c;
+
+	memset(&c, 0, sizeof(c));
+	c.seq = ++(g->cmdq.seq);
+	c.t_ns = now_ns();
+	c.deadline_ns = c.t_ns + g->cmdq.timeout_ns;
+	cmd_track(g, &c);
+	g->cmdq.poll_cmd = cmd;
+
+	return data_write(g, cmd, strlen(cmd));
+}
+
+/*
+ * cmd_abandon()
+ *
+ * Whatever polling is in flight will be dropped when it's answered,
+ * and the state machine starts a fresh poll
+ *
+ */
+void cmd_abandon(struct glb *g)
+{
+	struct cmdq_s *q = &(g->cmdq);
+
+	for (int i = 0; i < q->n; i++)
+		q->inflight[(q->head + i) % CMD_INFLIGHT_MAX].stale = 1;
+
+	g->read_state = READSTATE_NONE;
+	g->bp = g->read_buffer;
+	*(g->bp) = '\0';
+	g->bytes_remaining = READ_BUF_SIZE;
+}
+
+/*
+ * cmd_user()
+ *
+ * Queue a mode switch from a hotkey.  Never touches the port, so
+ * it can't wait on anything; cmd_flush() sends it.
+ *
+ */
+void cmd_user(struct glb *g, int mode_index)
+{
+	struct cmdq_s *q = &(g->cmdq);
+	struct cmd_s *c;
+
+	if (q->user_n >= CMD_USER_MAX)
+		return;
+
+	c = &(q->user[q->user_n++]);
+	memset(c, 0, sizeof(*c));
+	c->user = CMD_USER_MODE;
+	c->mode_index = mode_index;
+	c->t_ns = now_ns();
+
+	q->hotkey_ns = c->t_ns;
+	q->hotkey_mode = mode_index;
+}
+
+/*
+ * cmd_range()
+ *
+ * Queue a range setting, sent with the user commands
+ *
+ */
+void cmd_range(struct glb *g, int mode_index, int code)
+{
+	struct cmdq_s *q = &(g->cmdq);
+	struct cmd_s *c;
+
+	if (q->user_n >= CMD_USER_MAX)
+		return;
+
+	c = &(q->user[q->user_n++]);
+	memset(c, 0, sizeof(*c));
+	c->user = CMD_USER_RANGE;
+	c->mode_index = mode_index;
+	c->range = code;
+	c->t_ns = now_ns();
+}
+
+/*
+ * range_codes()
+ *
+ * Number of range codes a mode has, 0 if it can't be ranged
+ *
+ */
+int range_codes(int mode_index)
+{
+	int n = 0;
+
+	if ((mode_index < 0) || (mode_index >= MMODES_MAX) || (strcmp(mmodes[mode_index].range, SKIP) == 0))
+		return 0;
+	while ((n < 8) && (range_fullscale[mode_index][n] > 0))
+		n++;
+
+	return n;
+}
+
+/*
+ * range_command()
+ *
+ * The setting for a range is the mode's query without the '?',
+ * eg :MEAS:VOLT:DC 2; :MEAS AUTO goes back to autoranging
+ *
+ */
+void range_command(char *buf, size_t size, int mode_index, int code)
+{
+	const char *q = mmodes[mode_index].query;
+	int n = strcspn(q, "?");
+
+	if (code == RANGE_AUTO)
+		snprintf(buf, size, ":MEAS AUTO\r\n");
+	else
+		snprintf(buf, size, "%.*s %d\r\n", n, q, code);
+}
+
+/*
+ * range_set()
+ *
+ * Lock the current mode to a range code, or RANGE_AUTO to unlock
+ *
+ */
+void range_set(struct glb *g, int code)
+{
+	struct rangelock_s *r = &(g->rangelock);
+	int mi = g->mode_index;
+	int n = range_codes(mi);
+
+	if (g->replay)
+		return;
+
+	if (code == RANGE_AUTO)
+	{
+		if (!r->locked)
+			return;
+		r->locked = 0;
+		cmd_range(g, r->mode_index, RANGE_AUTO);
+		if (!g->quiet)
+			fprintf(stderr, "Range: auto\n");
+		return;
+	}
+
+	if (n == 0)
+	{
+		if (!g->quiet)
+			fprintf(stderr, "Range: %s has no ranges to lock\n", mmodes[mi].scpi);
+		return;
+	}
+	if (code < 0)
+		code = 0;
+	if (code >= n)
+		code = n - 1;
+
+	r->locked = 1;
+	r->mode_index = mi;
+	r->code = code;
+	r->unverified = RANGE_VERIFY; // read it back on the next reading rather than assume it took
+	r->sets++;
+	cmd_range(g, mi, code);
+	if (!g->quiet)
+		fprintf(stderr, "Range: %s locked at code %d\n", mmodes[mi].scpi, code);
+}
+
+/*
+ * range_step()
+ *
+ * Up or down a range from the locked one, or from wherever
+ * autorange is now, locking it
+ *
+ */
+void range_step(struct glb *g, int dir)
+{
+	struct rangelock_s *r = &(g->rangelock);
+	int from = (r->locked && (r->mode_index == g->mode_index)) ? r->code : g->range_index;
+
+	if (from < 0)
+		return;
+	range_set(g, from + dir);
+}
+
+/*
+ * range_toggle()
+ *
+ * Lock the range autorange is on now, or go back to auto
+ *
+ */
+void range_toggle(struct glb *g)
+{
+	if (g->rangelock.locked)
+		range_set(g, RANGE_AUTO);
+	else if (g->range_index >= 0)
+		range_set(g, g->range_index);
+	else
+		g->rangelock.pending = RANGE_HOLD; // no range read yet
+}
+
+/*
+ * range_skip()
+ *
+ * Locked in the mode just read, the range query can be left out.
+ * Fills in the range from the lock and returns 1 if so.
+ *
+ */
+int range_skip(struct glb *g)
+{
+	struct rangelock_s *r = &(g->rangelock);
+
+	if (!r->locked || (r->mode_index != g->mode_index) || (r->unverified >= RANGE_VERIFY))
+		return 0;
+
+	r->unverified++;
+	r->skipped++;
+	g->range_index = r->code;
+	snprintf(g->range, sizeof(g->range), "%d", r->code);
+
+	return 1;
+}
+
+/*
+ * range_check()
+ *
+ * A range was read back from the meter.  Applies a pending -r, drops
+ * the lock if the mode changed and puts the range back if it moved.
+ *
+ */
+void range_check(struct glb *g)
+{
+	struct rangelock_s *r = &(g->rangelock);
+
+	r->unverified = 0;
+
+	if (r->pending != RANGE_AUTO)
+	{
+		int code = r->pending == RANGE_HOLD ? g->range_index : r->pending;
+
+		r->pending = RANGE_AUTO;
+		range_set(g, code);
+		return;
+	}
+
+	if (!r->locked)
+		return;
+
+	if (r->mode_index != g->mode_index)
+	{
+		r->locked = 0;
+		if (!g->quiet)
+			fprintf(stderr, "Range: mode changed to %s, back to auto\n", mmodes[g->mode_index].scpi);
+		return;
+	}
+
+	if (g->range_index != r->code)
+	{
+		r->restored++;
+		if (g->debug)
+			fprintf(stderr, "%s:%d: Range moved to %d, restoring %d\n", FL, g->range_index, r->code);
+		cmd_range(g, r->mode_index, r->code);
+	}
+}
+
+/*
+ * rate_due()
+ *
+ * The mode changed since its reading rate was last read, returns
+ * the query to send or NULL
+ *
+ */
+const char *rate_due(struct glb *g)
+{
+	static char buf[32];
+
+	if ((g->rate.known_mode == g->mode_index) || !rate_scpi[g->mode_index])
+		return NULL;
+
+	snprintf(buf, sizeof(buf), "%s?\r\n", rate_scpi[g->mode_index]);
+
+	return buf;
+}
+
+/*
+ * rate_apply()
+ *
+ * Queue the mode's reading rate setting, returns 1 if one was
+ * needed
+ *
+ */
+int rate_apply(struct glb *g, char rate)
+{
+	struct cmdq_s *q = &(g->cmdq);
+	struct cmd_s *c;
+
+	if (!rate || (rate == g->rate.active) || (q->user_n >= CMD_USER_MAX))
+		return 0;
+
+	c = &(q->user[q->user_n++]);
+	memset(c, 0, sizeof(*c));
+	c->user = CMD_USER_RATE;
+	c->mode_index = g->mode_index;
+	c->rate = rate;
+	c->t_ns = now_ns();
+
+	g->rate.known_mode = -1; // read it back rather than assume it took
+	g->rate.sets++;
+	if (!g->quiet)
+		fprintf(stderr, "Rate: %s %c\n", mmodes[g->mode_index].scpi, rate);
+
+	return 1;
+}
+
+/*
+ * rate_reply()
+ *
+ * The mode's reading rate was read back, set the one asked for if
+ * it's different, up to RATE_TRIES times.  Returns 1 if a setting
+ * was queued.
+ *
+ */
+int rate_reply(struct glb *g)
+{
+	char r = g->read_buffer[0];
+	char want = g->rate.want[g->mode_index];
+
+	if ((r >= 'a') && (r <= 'z'))
+		r = r - 'a' + 'A';
+	g->rate.known_mode = g->mode_index;
+	g->rate.active = (r && strchr(RATES, r)) ? r : 0;
+
+	if (!want || (want == g->rate.active))
+	{
+		g->rate.tries = 0;
+		return 0;
+	}
+	if (g->rate.tries >= RATE_TRIES)
+	{
+		if (!g->quiet)
+			fprintf(stderr, "Rate: %s stayed at %c, giving up on %c\n", mmodes[g->mode_index].scpi, g->rate.active ? g->rate.active : '?', want);
+		g->rate.want[g->mode_index] = 0;
+		g->rate.tries = 0;
+		return 0;
+	}
+	g->rate.tries++;
+
+	return rate_apply(g, want);
+}
+
+/*
+ * rate_cycle()
+ *
+ * Next reading rate for the current mode, slow, medium, fast, slow..
+ *
+ */
+void rate_cycle(struct glb *g)
+{
+	int mi = g->mode_index;
+	const char *p;
+
+	if (g->replay || (g->rate.known_mode != mi) || !rate_scpi[mi])
+		return;
+
+	p = g->rate.active ? strchr(RATES, g->rate.active) : NULL;
+	g->rate.want[mi] = (p && p[1]) ? p[1] : RATES[0];
+	rate_apply(g, g->rate.want[mi]);
+}
+
+/*
+ * rate_count()
+ *
+ * Readings per second in the current mode and setting, over one
+ * second windows so the display follows a change quickly
+ *
+ */
+void rate_count(struct glb *g, struct sample_s *s)
+{
+	struct rate_s *r = &(g->rate);
+	const char *p;
+
+	if ((s->mode_index != r->meas_mode) || (s->rate != r->meas_rate))
+	{
+		r->meas_mode = s->mode_index;
+		r->meas_rate = s->rate;
+		r->meas_t0 = s->t_ns;
+		r->meas_n = 0;
+		r->sps = 0;
+		return;
+	}
+
+	r->meas_n++;
+	if (s->t_ns - r->meas_t0 < 1000000000ULL)
+		return;
+
+	r->sps = r->meas_n * 1e9 / (s->t_ns - r->meas_t0);
+	if (s->rate && (p = strchr(RATES, s->rate)))
+	{
+		r->n[s->mode_index][p - RATES] += r->meas_n;
+		r->ns[s->mode_index][p - RATES] += s->t_ns - r->meas_t0;
+	}
+	r->meas_t0 = s->t_ns;
+	r->meas_n = 0;
+}
+
+/*
+ * acq_estimate()
+ *
+ * Time the reading in read_buffer was taken, from its value query's
+ * round trip, see struct acq_s
+ *
+ */
+void acq_estimate(struct glb *g)
+{
+	struct acq_s *a = &(g->acq);
+	uint64_t byte_ns = g->serial_params.baud ? 10000000000ULL / g->serial_params.baud : 0; // 8n1
+	uint64_t t = 0, s, e;
+	const char *p;
+
+	if ((g->rate.known_mode == g->mode_index) && g->rate.active && (p = strchr(RATES, g->rate.active)))
+		t = acq_integ_ns[p - RATES];
+
+	a->write_ns = g->cmdq.reply_write_ns;
+	a->reply_ns = g->cmdq.reply_rx_ns;
+	s = a->write_ns + strlen(mmodes[g->mode_index].query) * byte_ns;
+	e = a->reply_ns - (strlen(g->read_buffer) + 2) * byte_ns;
+	if (e < s)
+		e = s;
+
+	a->t_ns = (s + e) / 2 - t;
+	a->unc_ns = (e - s) / 2 + t / 2;
+
+	g->acq_n++;
+	g->acq_rtt_ns += a->reply_ns - a->write_ns;
+	g->acq_unc_ns += a->unc_ns;
+}
+
+/*
+ * integ_volts()
+ *
+ * Voltage to go with a current reading, 0 if there isn't one
+ *
+ */
+int integ_volts(struct integ_s *n, struct sample_s *s, double *v)
+{
+	struct dm3058e_shm_sample vs;
+
+	if (!n->shm_name)
+	{
+		*v = n->volts;
+		return n->volts != 0.0;
+	}
+
+	if (!n->vshm)
+	{
+		// the other instance may not be up yet, look for it once a second
+		if (s->t_ns < n->vshm_retry_ns)
+			return 0;
+		n->vshm_retry_ns = s->t_ns + 1000000000ULL;
+		n->vshm = dm3058e_shm_open(n->shm_name);
+		if (!n->vshm)
+			return 0;
+	}
+
+	if ((dm3058e_shm_latest(n->vshm, &vs) != 0) || (strcmp(vs.mode_name, "DCV") != 0))
+		return 0;
+	if (fabs(vs.value) >= INTEG_OVERLOAD)
+		return 0; // O.L on the other meter, no voltage rather than a huge one
+	if ((vs.t_mono_ns + INTEG_VOLTS_AGE_NS < s->t_ns) || (vs.t_mono_ns > s->t_ns + INTEG_VOLTS_AGE_NS))
+		return 0;
+	*v = vs.value;
+
+	return 1;
+}
+
+/*
+ * integ_sample()
+ *
+ * Fold a reading into the A.h and W.h totals, see struct integ_s
+ *
+ */
+void integ_sample(struct glb *g, struct sample_s *s)
+{
+	struct integ_s *n = g->integ;
+	uint64_t t_ns = s->acq.t_ns ? s->acq.t_ns : s->t_ns; // when it was taken, if known
+	double a = s->v, v = 0.0, w;
+	int w_ok;
+
+	s->gap = 0;
+	if ((s->mode_index != MMODES_CURR_DC) || (fabs(a) >= INTEG_OVERLOAD))
+	{
+		n->left = n->have_last;
+		s->ah = n->as / 3600.0;
+		s->wh = n->ws / 3600.0;
+		return;
+	}
+
+	w_ok = integ_volts(n, s, &v);
+	w = a * v;
+
+	if (n->have_last)
+	{
+		double dt = (t_ns > n->last_ns) ? (t_ns - n->last_ns) / 1e9 : 0.0;
+		int stretched = (g->cmdq.timeouts != n->last_timeouts) && ((n->dt_avg == 0.0) || (dt > 2.0 * n->dt_avg));
+
+		if (n->left || stretched || (g->cmdq.resyncs != n->last_resyncs) || (dt <= 0.0) || (dt * 1e9 > n->gap_ns))
+		{
+			n->gaps++;
+			n->gap_s += dt;
+			s->gap = 1;
+		}
+		else
+		{
+			n->dt_avg = (n->dt_avg == 0.0) ? dt : n->dt_avg + (dt - n->dt_avg) / 16.0;
+			n->as += (n->last_a + a) * 0.5 * dt;
+			n->a_s += dt;
+			if (w_ok && n->last_w_ok)
+			{
+				n->ws += (n->last_w + w) * 0.5 * dt;
+				n->w_s += dt;
+			}
+		}
+	}
+
+	n->have_last = 1;
+	n->left = 0;
+	n->last_ns = t_ns;
+	n->last_timeouts = g->cmdq.timeouts;
+	n->last_resyncs = g->cmdq.resyncs;
+	n->last_a = a;
+	n->last_w = w;
+	n->last_w_ok = w_ok;
+
+	s->ah = n->as / 3600.0;
+	s->wh = n->ws / 3600.0;
+}
+
+/*
+ * integ_text()
+ *
+ * The totals for the second display line, eg ", 12.345 mAh 41.2 mWh"
+ *
+ */
+void integ_text(struct integ_s *n, char *d, size_t size)
+{
+	double ah = n->as / 3600.0, wh = n->ws / 3600.0;
+	int l;
+
+	if (fabs(ah) < 1.0)
+		l = snprintf(d, size, ", %.3f mAh", ah * 1000.0);
+	else
+		l = snprintf(d, size, ", %.4f Ah", ah);
+
+	if ((n->w_s > 0) && (l > 0) && ((size_t)l < size))
+	{
+		if (fabs(wh) < 1.0)
+			l += snprintf(d + l, size - l, " %.3f mWh", wh * 1000.0);
+		else
+			l += snprintf(d + l, size - l, " %.4f Wh", wh);
+	}
+
+	if (n->gaps && (l > 0) && ((size_t)l < size))
+		snprintf(d + l, size - l, " (%lu gap%s)", (unsigned long)n->gaps, n->gaps == 1 ? "" : "s");
+}
+
+/*
+ * cmd_flush()
+ *
+ * Send queued user commands, ahead of any polling
+ *
+ */
+void cmd_flush(struct glb *g)
+{
+	struct cmdq_s *q = &(g->cmdq);
+
+	if (q->user_n == 0)
+		return;
+
+	/*
+	 * Proxy lines just join the queue, their replies are told apart
+	 * from the polling's by order; anything the hotkeys send changes
+	 * what the polling in flight would return
+	 *
+	 */
+	for (int i = 0; i < q->user_n; i++)
+	{
+		if (q->user[i].user != CMD_USER_PROXY)
+		{
+			cmd_abandon(g);
+			break;
+		}
+	}
+
+	for (int i = 0; i < q->user_n; i++)
+	{
+		struct cmd_s *c = &(q->user[i]);
+		const char *cmd = mmodes[c->mode_index].query;
+
+		if (c->user == CMD_USER_PROXY)
+		{
+			struct proxy_tx_s *x = &(g->proxy->tx[c->proxy]);
+
+			c->seq = ++(q->seq);
+			data_write(g, x->cmd, strlen(x->cmd));
+			data_write(g, "\r\n", 2);
+			if (!x->query)
+			{
+				proxy_done(g->proxy, c->proxy, NULL, 1);
+				continue;
+			}
+			c->deadline_ns = now_ns() + q->timeout_ns;
+			cmd_track(g, c);
+			continue;
+		}
+
+		if ((c->user == CMD_USER_RANGE) || (c->user == CMD_USER_RATE))
+		{
+			char buf[64];
+
+			// settings aren't answered, nothing to wait for
+			if (c->user == CMD_USER_RANGE)
+				range_command(buf, sizeof(buf), c->mode_index, c->range);
+			else
+				snprintf(buf, sizeof(buf), "%s %c\r\n", rate_scpi[c->mode_index], c->rate);
+			data_write(g, buf, strlen(buf));
+			c->seq = ++(q->seq);
+			continue;
+		}
+
+		c->seq = ++(q->seq);
+		c->deadline_ns = now_ns() + q->timeout_ns;
+		cmd_track(g, c);
+		data_write(g, cmd, strlen(cmd));
+	}
+	q->user_n = 0;
+}
+
+/*
+ * cmd_resync()
+ *
+ * The meter stopped answering, or answers out of step: drop
+ * everything in flight and anything half received, clear its status
+ * with *CLS, and give stray replies time to arrive and be flushed
+ * before polling again
+ *
+ */
+void cmd_resync(struct glb *g)
+{
+	struct cmdq_s *q = &(g->cmdq);
+
+	if (!g->quiet)
+		fprintf(stderr, "%s:%d: No reply from the meter, resyncing\n", FL);
+
+	tcflush(g->serial_params.fd, TCIOFLUSH);
+	data_write(g, "*CLS\r\n", 6);
+
+	for (int i = 0; i < q->n; i++)
+	{
+		struct cmd_s *c = &(q->inflight[(q->head + i) % CMD_INFLIGHT_MAX]);
+		if (c->user == CMD_USER_PROXY)
+			proxy_done(g->proxy, c->proxy, NULL, 0);
+	}
+	q->head = q->n = 0;
+	q->retries = 0;
+	q->resyncs++;
+	q->resync_until = now_ns() + CMD_RESYNC_NS;
+	g->rx_len = g->rx_pos = 0;
+	g->bp = g->read_buffer;
+	*(g->bp) = '\0';
+	g->bytes_remaining = READ_BUF_SIZE;
+	g->read_state = READSTATE_RESYNC;
+	cmd_counters(g);
+}
+
+/*
+ * cmd_forget()
+ *
+ * An expired command's reply may still turn up late and would be
+ * taken for the next command's.  With nothing else in flight the
+ * input is flushed so it can't be; otherwise there's no telling the
+ * replies apart and only a resync gets back in step.  1 if it
+ * resynced.
+ *
+ */
+int cmd_forget(struct glb *g)
+{
+	if (g->cmdq.n > 0)
+	{
+		cmd_resync(g);
+		return 1;
+	}
+
+	tcflush(g->serial_params.fd, TCIFLUSH);
+	g->rx_len = g->rx_pos = 0;
+
+	return 0;
+}
+
+/*
+ * cmd_expire()
+ *
+ * Check the oldest command's deadline.  A user command or stale
+ * poll is forgotten, see cmd_forget(), the poll in progress puts
+ * the state machine in READSTATE_TIMEOUT.
+ *
+ */
+void cmd_expire(struct glb *g)
+{
+	struct cmdq_s *q = &(g->cmdq);
+	uint64_t now = now_ns();
+
+	while ((q->n > 0) && (now >= q->inflight[q->head].deadline_ns))
+	{
+		struct cmd_s *c = &(q->inflight[q->head]);
+		int live = !c->user && !c->stale;
+
+		/*
+		 * Replies come in order, so a slow one is still matched
+		 * to its command while the entry stays put.  Give it one
+		 * more deadline before taking it as lost; a resent poll
+		 * doesn't get one, a resync follows it anyway.
+		 *
+		 */
+		if (!c->late && !(live && q->retries))
+		{
+			c->late = 1;
+			c->deadline_ns = now + q->timeout_ns;
+			if (live)
+			{
+				q->timeouts++;
+				cmd_counters(g);
+			}
+			if (g->debug)
+				fprintf(stderr, "%s:%d: Reply to command #%lu is late\n", FL, (unsigned long)c->seq);
+			break;
+		}
+
+		if (g->debug)
+			fprintf(stderr, "%s:%d: No reply to command #%lu\n", FL, (unsigned long)c->seq);
+		q->head = (q->head + 1) % CMD_INFLIGHT_MAX;
+		q->n--;
+
+		if (c->user == CMD_USER_PROXY)
+			proxy_done(g->proxy, c->proxy, NULL, 0);
+
+		if (live)
+		{
+			if (q->retries)
+				q->timeouts++; // a first try was counted when it went late
+			q->timeout_state = g->read_state;
+			g->read_state = READSTATE_TIMEOUT;
+			cmd_counters(g);
+			break;
+		}
+		q->expired++;
+		if (cmd_forget(g))
+			break;
+	}
+}
+
+/*
+ * cmd_hotkey_reading()
+ *
+ * First reading in the mode a hotkey asked for, log how long it took
+ *
+ */
+void cmd_hotkey_reading(struct glb *g, struct sample_s *s)
+{
+	struct cmdq_s *q = &(g->cmdq);
+	uint64_t d = s->t_ns - q->hotkey_ns;
+
+	q->hotkey_ns = 0;
+	q->hotkey_n++;
+	q->hotkey_sum_ns += d;
+	if (d > q->hotkey_max_ns)
+		q->hotkey_max_ns = d;
+
+	if (!g->quiet)
+		fprintf(stderr, "Hotkey %s: first reading %.1f ms after the key\n", mmodes[s->mode_index].scpi, d / 1e6);
+}
+
+/*
+ * sample_json()
+ *
+ * The JSON form of a reading, shared by the headless stream and
+ * the web view.  Returns the length written, without a newline.
+ *
+ */
+int sample_json(char *buf, size_t size, struct sample_s *s, const char *range, const char *display)
+{
+	int sz;
+
+	sz = snprintf(buf, size, "{\"t\":%ld.%06ld,\"value\":%.10g,\"mode\":\"%s\",\"range\":\"%s\",\"display\":\"%s\"}",
+				  (long)s->wall.tv_sec, s->wall.tv_nsec / 1000, s->v, mmodes[s->mode_index].scpi, range, display);
+	if (sz >= (int)size)
+		sz = size - 1;
+
+	return sz;
+}
+
+/*
+ * stream_sample()
+ *
+ * Headless output, one line per reading on stdout.  The range
+ * is the human label set by the formatter, eg "20V"
+ *
+ */
+int stream_sample(struct glb *g, struct sample_s *s)
+{
+	char line[SSIZE];
+	int sz;
+
+	if (g->headless == HEADLESS_JSON)
+	{
+		sz = sample_json(line, sizeof(line) - 1, s, g->range, g->value);
+		line[sz++] = '\n';
+	}
+	else
+	{
+		sz = snprintf(line, sizeof(line), "%ld.%06ld\t%.10g\t%s\t%s\t%s\n",
+					  (long)s->wall.tv_sec, s->wall.tv_nsec / 1000, s->v, mmodes[s->mode_index].scpi, g->range, g->value);
+	}
+
+	if (sz >= (int)sizeof(line))
+		sz = sizeof(line) - 1;
+
+	/*
+	 * One write per reading so whatever is on the other end of
+	 * the pipe sees it immediately, no stdio buffering
+	 *
+	 */
+	if (write(STDOUT_FILENO, line, sz) < 0)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+const char WEB_PAGE[] =
+	"<!DOCTYPE html><html><head><meta charset=\"utf-8\"><title>DM3058E</title>"
+	"<style>body{background:#000;color:#0c0;font-family:monospace;margin:2em}"
+	"#v{font-size:12vw}#r{font-size:4vw;color:#cc0}</style></head><body>"
+	"<div id=\"v\">---</div><div id=\"r\">waiting for data</div><script>"
+	"var es=new EventSource('/events');"
+	"es.onmessage=function(e){var d=JSON.parse(e.data);"
+	"document.getElementById('v').textContent=d.display;"
+	"document.getElementById('r').textContent=d.mode+', '+d.range;};"
+	"es.onerror=function(){document.getElementById('r').textContent='disconnected';};"
+	"</script></body></html>";
+
+/*
+ * web_send()
+ *
+ * Non-blocking send to one client, anything the socket won't
+ * take is queued and flushed on EPOLLOUT.  Returns -1 if the
+ * client should be dropped.
+ *
+ */
+int web_send(struct web_s *w, struct web_client_s *c, const char *d, size_t len)
+{
+	ssize_t sz = 0;
+
+	if (c->out_len == 0)
+	{
+		sz = send(c->fd, d, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sz < 0)
+		{
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+				return -1;
+			sz = 0;
+		}
+		if ((size_t)sz == len)
+			return 0;
+	}
+
+	if (c->out_len + (len - sz) > WEB_CLIENT_BACKLOG)
+		return -1; // viewer can't keep up, cut it loose
+
+	char *p = (char *)realloc(c->out, c->out_len + (len - sz));
+	if (!p)
+		return -1;
+	c->out = p;
+	memcpy(c->out + c->out_len, d + sz, len - sz);
+	c->out_len += len - sz;
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.ptr = c;
+	epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+
+	return 0;
+}
+
+void web_close(struct web_s *w, struct web_client_s *c)
+{
+	epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	free(c->out);
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+}
+
+/*
+ * web_slot_event()
+ *
+ * Format one ring slot as an SSE event.  Returns 0 if the slot
+ * was overwritten while we were reading it.
+ *
+ */
+int web_slot_event(struct web_s *w, uint64_t seq, char *buf, size_t size)
+{
+	struct web_slot_s *slot = &(w->ring[seq & (WEB_RING_SIZE - 1)]);
+	struct web_slot_s copy;
+	int sz;
+
+	if (__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) != seq + 1)
+		return 0;
+	memcpy(&copy, slot, sizeof(copy));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&(slot->seq), __ATOMIC_RELAXED) != seq + 1)
+		return 0;
+
+	memcpy(buf, "data: ", 6);
+	sz = 6 + sample_json(buf + 6, size - 8, &(copy.s), copy.range, copy.display);
+	buf[sz++] = '\n';
+	buf[sz++] = '\n';
+
+	return sz;
+}
+
+/*
+ * web_request()
+ *
+ * Once a full request header is in, serve the page, start the
+ * event stream or 404.
+ *
+ */
+int web_request(struct web_s *w, struct web_client_s *c)
+{
+	char hdr[256];
+	int sz;
+
+	if (strncmp(c->req, "GET /events ", 12) == 0)
+	{
+		const char sse_hdr[] = "HTTP/1.1 200 OK\r\n"
+							   "Content-Type: text/event-stream\r\n"
+							   "Cache-Control: no-cache\r\n"
+							   "Connection: keep-alive\r\n"
+							   "\r\n";
+		char ev[SSIZE];
+
+		c->sse = 1;
+		if (web_send(w, c, sse_hdr, sizeof(sse_hdr) - 1) != 0)
+			return -1;
+
+		// latest broadcast reading straight away so the page isn't blank, anything newer is still to be broadcast
+		if (w->sent && ((sz = web_slot_event(w, w->sent - 1, ev, sizeof(ev))) > 0))
+			return web_send(w, c, ev, sz);
+		return 0;
+	}
+
+	if (strncmp(c->req, "GET / ", 6) == 0)
+	{
+		sz = snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\n"
+										"Content-Type: text/html; charset=utf-8\r\n"
+										"Content-Length: %ld\r\n"
+										"Connection: close\r\n"
+										"\r\n",
+					  (long)(sizeof(WEB_PAGE) - 1));
+		web_send(w, c, hdr, sz);
+		web_send(w, c, WEB_PAGE, sizeof(WEB_PAGE) - 1);
+	}
+	else
+	{
+		const char nf[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+		web_send(w, c, nf, sizeof(nf) - 1);
+	}
+
+	return c->out_len ? 0 : -1; // close once the page is out
+}
+
+/*
+ * web_thread()
+ *
+ * The one thread that does all the HTTP work
+ *
+ */
+void *web_thread(void *arg)
+{
+	struct web_s *w = (struct web_s *)arg;
+	struct epoll_event events[WEB_MAX_CLIENTS + 2];
+	char ev[SSIZE];
+
+	while (1)
+	{
+		int n = epoll_wait(w->epoll_fd, events, WEB_MAX_CLIENTS + 2, -1);
+
+		for (int i = 0; i < n; i++)
+		{
+			if (events[i].data.ptr == &(w->listen_fd))
+			{
+				int fd = accept4(w->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+				int k;
+
+				if (fd < 0)
+					continue;
+				for (k = 0; k < WEB_MAX_CLIENTS; k++)
+					if (w->clients[k].fd < 0)
+						break;
+				if (k == WEB_MAX_CLIENTS)
+				{
+					close(fd);
+					continue;
+				}
+
+				struct web_client_s *c = &(w->clients[k]);
+				struct epoll_event cev;
+				int one = 1;
+
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+				c->fd = fd;
+				cev.events = EPOLLIN;
+				cev.data.ptr = c;
+				epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &cev);
+			}
+			else if (events[i].data.ptr == &(w->event_fd))
+			{
+				uint64_t count;
+				uint64_t head;
+
+				if (read(w->event_fd, &count, sizeof(count)) < 0)
+					continue;
+
+				/*
+				 * Format each new sample once and hand the same
+				 * bytes to every subscriber.  If we fell a whole
+				 * ring behind, skip to what's still there.
+				 *
+				 */
+				head = __atomic_load_n(&(w->head), __ATOMIC_ACQUIRE);
+				if (head - w->sent > WEB_RING_SIZE)
+					w->sent = head - WEB_RING_SIZE;
+
+				for (; w->sent < head; w->sent++)
+				{
+					int sz = web_slot_event(w, w->sent, ev, sizeof(ev));
+					if (sz <= 0)
+						continue;
+					for (int k = 0; k < WEB_MAX_CLIENTS; k++)
+					{
+						struct web_client_s *c = &(w->clients[k]);
+						if ((c->fd >= 0) && c->sse && (web_send(w, c, ev, sz) != 0))
+							web_close(w, c);
+					}
+				}
+			}
+			else
+			{
+				struct web_client_s *c = (struct web_client_s *)events[i].data.ptr;
+
+				if (events[i].events & (EPOLLHUP | EPOLLERR))
+				{
+					web_close(w, c);
+					continue;
+				}
+
+				if (events[i].events & EPOLLOUT)
+				{
+					ssize_t sz = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+					if ((sz < 0) && (errno != EAGAIN))
+					{
+						web_close(w, c);
+						continue;
+					}
+					if (sz > 0)
+					{
+						memmove(c->out, c->out + sz, c->out_len - sz);
+						c->out_len -= sz;
+					}
+					if (c->out_len == 0)
+					{
+						if (!c->sse)
+						{
+							web_close(w, c); // page done
+							continue;
+						}
+						struct epoll_event cev;
+						cev.events = EPOLLIN;
+						cev.data.ptr = c;
+						epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, c->fd, &cev);
+					}
+				}
+
+				if (events[i].events & EPOLLIN)
+				{
+					ssize_t sz = recv(c->fd, c->req + c->req_len, sizeof(c->req) - 1 - c->req_len, 0);
+					if (sz <= 0)
+					{
+						if ((sz == 0) || (errno != EAGAIN))
+							web_close(w, c);
+						continue;
+					}
+					if (c->sse)
+						continue; // nothing more expected from a subscriber
+
+					c->req_len += sz;
+					c->req[c->req_len] = '\0';
+					if (strstr(c->req, "\r\n\r\n") || (c->req_len == sizeof(c->req) - 1))
+					{
+						if (web_request(w, c) != 0)
+							web_close(w, c);
+					}
+				}
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * web_start()
+ *
+ * Bind to 127.0.0.1:<port> and start the server thread
+ *
+ */
+int web_start(struct web_s *w)
+{
+	struct sockaddr_in sa;
+	struct epoll_event ev;
+	int one = 1;
+
+	for (int k = 0; k < WEB_MAX_CLIENTS; k++)
+		w->clients[k].fd = -1;
+
+	w->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (w->listen_fd < 0)
+		return -1;
+	setsockopt(w->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(w->port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((bind(w->listen_fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) || (listen(w->listen_fd, 16) != 0))
+	{
+		fprintf(stderr, "%s:%d: Unable to listen on 127.0.0.1:%d (%s)\n", FL, w->port, strerror(errno));
+		close(w->listen_fd);
+		return -1;
+	}
+
+	w->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &(w->listen_fd);
+	epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->listen_fd, &ev);
+	ev.data.ptr = &(w->event_fd);
+	epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->event_fd, &ev);
+
+	if (pthread_create(&(w->thread), NULL, web_thread, w) != 0)
+		return -1;
+	pthread_detach(w->thread);
+
+	return 0;
+}
+
+/*
+ * web_publish()
+ *
+ * Acquisition side; copy into the ring and wake the server
+ *
+ */
+void web_publish(struct web_s *w, struct sample_s *s, const char *range, const char *display)
+{
+	uint64_t seq = w->head;
+	struct web_slot_s *slot = &(w->ring[seq & (WEB_RING_SIZE - 1)]);
+	uint64_t one = 1;
+
+	__atomic_store_n(&(slot->seq), 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->s = *s;
+	snprintf(slot->range, sizeof(slot->range), "%s", range);
+	snprintf(slot->display, sizeof(slot->display), "%s", display);
+	__atomic_store_n(&(slot->seq), seq + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&(w->head), seq + 1, __ATOMIC_RELEASE);
+
+	if (write(w->event_fd, &one, sizeof(one)) < 0)
+	{
+		// counter saturated, the thread is already due to wake
+	}
+}
+
+/*
+ * logger_write()
+ *
+ * Write a whole buffer out, coping with short writes
+ *
+ */
+int logger_write(struct logger_s *l, const char *d, size_t len)
+{
+	while (len)
+	{
+		ssize_t sz = write(l->fd, d, len);
+		if (sz < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "%s:%d: Error writing log '%s' (%s)\n", FL, l->path, strerror(errno));
+			return -1;
+		}
+		d += sz;
+		len -= sz;
+	}
+
+	return 0;
+}
+
+/*
+ * logger_segment_name()
+ *
+ * <stem>-YYYYmmdd-HHMMSS<ext> for a segment starting at wall, with
+ * a counter added if that name is already taken
+ *
+ */
+void logger_segment_name(struct logger_s *l, struct timespec *wall, char *out, size_t size)
+{
+	const char *slash = strrchr(l->path, '/');
+	const char *dot = strrchr(l->path, '.');
+	char stamp[32];
+	struct tm tm;
+	int stem;
+
+	if (!dot || (slash && dot < slash))
+		dot = l->path + strlen(l->path);
+	stem = dot - l->path;
+
+	localtime_r(&(wall->tv_sec), &tm);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+
+	snprintf(out, size, "%.*s-%s%s", stem, l->path, stamp, dot);
+	for (int n = 1; (access(out, F_OK) == 0) && (n < 1000); n++)
+		snprintf(out, size, "%.*s-%s-%d%s", stem, l->path, stamp, n, dot);
+}
+
+/*
+ * logger_pyramid_open()
+ *
+ * Start the pyramid files for a capture, <capture>.p1 and up
+ *
+ */
+void logger_pyramid_open(struct logger_s *l, const char *capture)
+{
+	struct pyramid_header_s h;
+	char name[PATH_MAX + 8];
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, PYRAMID_MAGIC, 8);
+	h.version = PYRAMID_VERSION;
+	h.factor = PYRAMID_FACTOR;
+	h.entry_size = sizeof(struct pyramid_entry_s);
+
+	for (int i = 0; i < PYRAMID_LEVELS; i++)
+	{
+		snprintf(name, sizeof(name), "%s.p%d", capture, i + 1);
+		l->pyr_fd[i] = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (l->pyr_fd[i] < 0)
+		{
+			fprintf(stderr, "%s:%d: Unable to open pyramid '%s' (%s)\n", FL, name, strerror(errno));
+			continue;
+		}
+		h.level = i + 1;
+		if (write(l->pyr_fd[i], &h, sizeof(h)) != sizeof(h))
+		{
+			close(l->pyr_fd[i]);
+			l->pyr_fd[i] = -1;
+		}
+	}
+}
+
+/*
+ * logger_pyramid_close()
+ *
+ */
+void logger_pyramid_close(struct logger_s *l)
+{
+	if (l->format != LOG_FORMAT_CAPTURE)
+		return;
+
+	for (int i = 0; i < PYRAMID_LEVELS; i++)
+	{
+		if (l->pyr_fd[i] >= 0)
+			close(l->pyr_fd[i]);
+		l->pyr_fd[i] = -1;
+	}
+}
+
+/*
+ * logger_pyramid_write()
+ *
+ * Writer side, sort a run of closed entries out to their level files
+ *
+ */
+void logger_pyramid_write(struct logger_s *l, struct pyramid_out_s *out, size_t n)
+{
+	for (int i = 0; i < PYRAMID_LEVELS; i++)
+	{
+		size_t k = 0;
+
+		for (size_t j = 0; j < n; j++)
+		{
+			if (out[j].level == i + 1)
+				l->pyr_scratch[k++] = out[j].e;
+		}
+		if (k && (l->pyr_fd[i] >= 0) && (write(l->pyr_fd[i], l->pyr_scratch, k * sizeof(struct pyramid_entry_s)) < 0))
+			fprintf(stderr, "%s:%d: Error writing pyramid level %d (%s)\n", FL, i + 1, strerror(errno));
+	}
+}
+
+/*
+ * logger_open()
+ *
+ * Open the plain log for appending, or a new segment as .part
+ *
+ */
+int logger_open(struct logger_s *l, struct timespec *wall)
+{
+	char part[PATH_MAX + 8];
+
+	if (!l->segmented)
+	{
+		l->fd = open(l->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if (l->fd < 0)
+			fprintf(stderr, "%s:%d: Unable to open log '%s' (%s)\n", FL, l->path, strerror(errno));
+	}
+	else
+	{
+		logger_segment_name(l, wall, l->seg_path, sizeof(l->seg_path));
+		snprintf(part, sizeof(part), "%s.part", l->seg_path);
+		l->fd = open(part, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (l->fd < 0)
+			fprintf(stderr, "%s:%d: Unable to open log segment '%s' (%s)\n", FL, part, strerror(errno));
+		l->seg_written = 0;
+	}
+
+	if ((l->fd >= 0) && (l->format == LOG_FORMAT_CAPTURE))
+		logger_pyramid_open(l, l->segmented ? l->seg_path : l->path);
+
+	return l->fd;
+}
+
+/*
+ * compress_segment()
+ *
+ * gzip one finished segment to <name>.gz, again going through a
+ * .part name, then drop the original
+ *
+ */
+void compress_segment(struct log_segment_s *seg)
+{
+	char gz[PATH_MAX + 8], part[PATH_MAX + 16];
+	char *buf;
+	uint64_t t0 = now_ns();
+	struct stat st;
+	gzFile z;
+	ssize_t sz;
+	int fd, err = 0;
+
+	snprintf(gz, sizeof(gz), "%s.gz", seg->path);
+	snprintf(part, sizeof(part), "%s.gz.part", seg->path);
+
+	fd = open(seg->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		fprintf(stderr, "%s:%d: Unable to open segment '%s' (%s)\n", FL, seg->path, strerror(errno));
+		return;
+	}
+	z = gzopen(part, "wb6");
+	buf = (char *)malloc(LOG_ZCHUNK);
+	if (!z || !buf)
+	{
+		fprintf(stderr, "%s:%d: Unable to create '%s'\n", FL, part);
+		if (z)
+			gzclose(z);
+		free(buf);
+		close(fd);
+		return;
+	}
+
+	while ((sz = read(fd, buf, LOG_ZCHUNK)) > 0)
+	{
+		if (gzwrite(z, buf, sz) != sz)
+		{
+			err = 1;
+			break;
+		}
+	}
+	if (sz < 0)
+		err = 1;
+	if (gzclose(z) != Z_OK)
+		err = 1;
+	free(buf);
+	close(fd);
+
+	if (err || (stat(part, &st) != 0) || (rename(part, gz) != 0))
+	{
+		fprintf(stderr, "%s:%d: Compressing '%s' failed, keeping it uncompressed\n", FL, seg->path);
+		unlink(part);
+		return;
+	}
+	unlink(seg->path);
+
+	fprintf(stderr, "Segment %s: %lu samples, %lu bytes -> %lu bytes (%.1f%%), compressed in %.1f ms\n", gz,
+			(unsigned long)seg->samples, (unsigned long)seg->bytes, (unsigned long)st.st_size,
+			seg->bytes ? 100.0 * st.st_size / seg->bytes : 0.0, (now_ns() - t0) / 1e6);
+}
+
+/*
+ * compress_thread()
+ *
+ * Works through the queue of finished segments at idle priority,
+ * so it only gets the CPU nothing else wants
+ *
+ */
+void *compress_thread(void *arg)
+{
+	struct logger_s *l = (struct logger_s *)arg;
+	struct sched_param sp;
+
+	sp.sched_priority = 0;
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp);
+
+	pthread_mutex_lock(&(l->zlock));
+	while (1)
+	{
+		struct log_segment_s *seg = l->zhead;
+
+		if (!seg)
+		{
+			if (l->zquit)
+				break;
+			pthread_cond_wait(&(l->zwake), &(l->zlock));
+			continue;
+		}
+		l->zhead = seg->next;
+		if (!l->zhead)
+			l->ztail = NULL;
+		pthread_mutex_unlock(&(l->zlock));
+
+		compress_segment(seg);
+		free(seg);
+
+		pthread_mutex_lock(&(l->zlock));
+	}
+	pthread_mutex_unlock(&(l->zlock));
+
+	return NULL;
+}
+
+/*
+ * logger_close_segment()
+ *
+ * Close the open segment, give it its final name and queue it
+ * for compression
+ *
+ */
+void logger_close_segment(struct logger_s *l, uint64_t samples)
+{
+	char part[PATH_MAX + 8];
+	struct log_segment_s *seg;
+
+	if (l->fsync_ms != LOG_FSYNC_NEVER)
+		fdatasync(l->fd);
+	close(l->fd);
+	l->fd = -1;
+	logger_pyramid_close(l);
+
+	snprintf(part, sizeof(part), "%s.part", l->seg_path);
+	if (rename(part, l->seg_path) != 0)
+	{
+		fprintf(stderr, "%s:%d: Unable to rename '%s' (%s)\n", FL, part, strerror(errno));
+		return;
+	}
+	l->segments++;
+
+	if (!l->compress)
+	{
+		fprintf(stderr, "Segment %s: %lu samples, %lu bytes\n", l->seg_path, (unsigned long)samples, (unsigned long)l->seg_written);
+		return;
+	}
+
+	seg = (struct log_segment_s *)calloc(1, sizeof(struct log_segment_s));
+	if (!seg)
+		return;
+	snprintf(seg->path, sizeof(seg->path), "%s", l->seg_path);
+	seg->samples = samples;
+	seg->bytes = l->seg_written;
+
+	pthread_mutex_lock(&(l->zlock));
+	if (l->ztail)
+		l->ztail->next = seg;
+	else
+		l->zhead = seg;
+	l->ztail = seg;
+	pthread_cond_signal(&(l->zwake));
+	pthread_mutex_unlock(&(l->zlock));
+}
+
+/*
+ * logger_thread()
+ *
+ * Takes the filled buffer every LOG_FLUSH_MS (or sooner when the
+ * producer fills one), writes it and applies the fsync policy.
+ * A cut in the buffer means the segment ends there.
+ *
+ */
+void *logger_thread(void *arg)
+{
+	struct logger_s *l = (struct logger_s *)arg;
+
+	pthread_mutex_lock(&(l->lock));
+	while (1)
+	{
+		struct timespec ts, cut_wall;
+		uint64_t cut_samples;
+		ssize_t cut, pcut;
+		size_t off = 0, poff = 0;
+		int b;
+
+		if (!l->quit && (l->len[l->active] < LOG_BUF_SIZE / 2))
+		{
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += LOG_FLUSH_MS * 1000000L;
+			if (ts.tv_nsec >= 1000000000L)
+			{
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&(l->wake), &(l->lock), &ts);
+		}
+
+		if ((l->len[l->active] == 0) && (l->plen[l->active] == 0))
+		{
+			if (l->quit)
+				break;
+			continue;
+		}
+
+		// swap, the producer carries on into the empty buffer
+		b = l->active;
+		l->active ^= 1;
+		l->writing = 1;
+		cut = l->cut[b];
+		cut_samples = l->cut_samples[b];
+		cut_wall = l->cut_wall[b];
+		pcut = l->pcut[b];
+		pthread_mutex_unlock(&(l->lock));
+
+		if (cut >= 0)
+		{
+			logger_write(l, l->buf[b], cut);
+			l->seg_written += cut;
+			if (pcut >= 0)
+			{
+				logger_pyramid_write(l, l->pbuf[b], pcut);
+				poff = pcut;
+			}
+			logger_close_segment(l, cut_samples);
+			logger_open(l, &cut_wall);
+			off = cut;
+		}
+		logger_write(l, l->buf[b] + off, l->len[b] - off);
+		if (l->plen[b] > poff)
+			logger_pyramid_write(l, l->pbuf[b] + poff, l->plen[b] - poff);
+		l->seg_written += l->len[b] - off;
+		l->bytes += l->len[b];
+		l->flushes++;
+
+		if (l->fsync_ms != LOG_FSYNC_NEVER)
+		{
+			uint64_t now = now_ns();
+			if ((l->fsync_ms == LOG_FSYNC_EVERY_FLUSH) || (now - l->last_sync_ns >= (uint64_t)l->fsync_ms * 1000000ULL))
+			{
+				fdatasync(l->fd);
+				l->last_sync_ns = now;
+			}
+		}
+
+		pthread_mutex_lock(&(l->lock));
+		l->len[b] = 0;
+		l->cut[b] = -1;
+		l->plen[b] = 0;
+		l->pcut[b] = -1;
+		l->writing = 0;
+		pthread_cond_signal(&(l->space));
+	}
+	pthread_mutex_unlock(&(l->lock));
+
+	return NULL;
+}
+
+/*
+ * sample_time_ns()
+ *
+ * When a reading was taken, as well as that's known, else when it
+ * came in
+ *
+ */
+uint64_t sample_time_ns(const struct sample_s *s)
+{
+	return s->acq.t_ns ? s->acq.t_ns : s->t_ns;
+}
+
+/*
+ * capture_header()
+ *
+ * Fill in the header of a new binary capture, timed from its first
+ * sample
+ *
+ */
+void capture_header(struct logger_s *l, struct capture_header_s *h, const struct sample_s *s)
+{
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, CAPTURE_MAGIC, 8);
+	h->version = CAPTURE_VERSION;
+	h->header_size = sizeof(*h);
+	h->record_size = sizeof(struct capture_record_s);
+	h->block_records = CAPTURE_BLOCK_RECORDS;
+
+	l->start_mono_ns = sample_time_ns(s);
+	l->last_t_us = 0;
+	h->start_wall_ns = (int64_t)s->wall.tv_sec * 1000000000LL + s->wall.tv_nsec - (int64_t)(s->t_ns - l->start_mono_ns);
+	h->start_mono_ns = l->start_mono_ns;
+	if (s->acq.t_ns)
+		h->flags |= CAPTURE_HDR_ACQ_TIME;
+
+	snprintf(h->idn, sizeof(h->idn), "%s", l->idn ? l->idn : "");
+	h->mode_count = MMODES_MAX + 1;
+	for (int i = 0; i <= MMODES_MAX; i++)
+	{
+		snprintf(h->modes[i].scpi, sizeof(h->modes[i].scpi), "%.7s", mmodes[i].scpi);
+		snprintf(h->modes[i].units, sizeof(h->modes[i].units), "%.7s", mmodes[i].units);
+	}
+}
+
+/*
+ * capture_row()
+ *
+ * Binary form of a sample: a record, preceded by the sync record
+ * when it starts a new block.  If the gap since the last sample
+ * doesn't fit the 32 bit delta the current block is padded out
+ * with filler so the sample starts a fresh block, so row must
+ * hold CAPTURE_ROW_MAX bytes.
+ *
+ */
+#define CAPTURE_ROW_MAX (sizeof(struct capture_sync_s) + (CAPTURE_BLOCK_RECORDS + 1) * sizeof(struct capture_record_s))
+
+int capture_row(struct logger_s *l, struct sample_s *s, char *row)
+{
+	struct capture_record_s rec;
+	uint64_t t = sample_time_ns(s);
+	uint64_t t_us = t > l->start_mono_ns ? (t - l->start_mono_ns) / 1000ULL : 0;
+	int sz = 0;
+
+	// a slower rate's estimate can land before the last reading's
+	if (t_us < l->last_t_us)
+		t_us = l->last_t_us;
+
+	if ((l->block_fill < CAPTURE_BLOCK_RECORDS) && (t_us - l->last_t_us > UINT32_MAX))
+	{
+		memset(&rec, 0, sizeof(rec));
+		rec.flags = CAPTURE_FLAG_FILLER;
+		while (l->block_fill < CAPTURE_BLOCK_RECORDS)
+		{
+			memcpy(row + sz, &rec, sizeof(rec));
+			sz += sizeof(rec);
+			l->block_fill++;
+		}
+	}
+
+	memset(&rec, 0, sizeof(rec));
+	if (l->block_fill >= CAPTURE_BLOCK_RECORDS)
+	{
+		struct capture_sync_s sync;
+
+		sync.t_us = t_us;
+		sync.index = l->seg_samples; // records start again at 0 in each segment
+		memcpy(row + sz, &sync, sizeof(sync));
+		sz += sizeof(sync);
+		l->block_fill = 0;
+	}
+	else
+	{
+		rec.dt_us = (uint32_t)(t_us - l->last_t_us);
+	}
+
+	rec.mode = s->mode_index;
+	rec.range = s->range_index;
+	rec.flags = capture_rate_flags(s->rate) | (s->gap ? CAPTURE_FLAG_GAP : 0);
+	rec.value = s->v;
+	memcpy(row + sz, &rec, sizeof(rec));
+	sz += sizeof(rec);
+
+	l->block_fill++;
+	l->last_t_us = t_us;
+
+	return sz;
+}
+
+/*
+ * logger_header()
+ *
+ * Header for a new file or segment, returns its size
+ *
+ */
+int logger_header(struct logger_s *l, char *d, struct sample_s *s)
+{
+	if (l->format == LOG_FORMAT_CAPTURE)
+	{
+		capture_header(l, (struct capture_header_s *)d, s);
+		l->block_fill = CAPTURE_BLOCK_RECORDS; // first sample opens block 0
+		return sizeof(struct capture_header_s);
+	}
+
+	int n = snprintf(d, LOG_BUF_SIZE, "t_mono%cvalue%cmode%crange%crate%ct_write%ct_reply%ct_acq%ct_acq_unc",
+					 l->sep, l->sep, l->sep, l->sep, l->sep, l->sep, l->sep, l->sep);
+
+	if (l->integ)
+		n += snprintf(d + n, LOG_BUF_SIZE - n, "%cah%cwh%cgap", l->sep, l->sep, l->sep);
+	d[n++] = '\n';
+
+	return n;
+}
+
+/*
+ * logger_start()
+ *
+ * Open the log for appending and start the writer.  A header
+ * row goes in only if the file is new/empty.
+ *
+ */
+int logger_start(struct logger_s *l)
+{
+	size_t n = strlen(l->path);
+	struct timespec wall;
+	struct stat st;
+
+	l->format = LOG_FORMAT_CSV;
+	l->sep = ',';
+	if ((n > 4) && (strcmp(l->path + n - 4, ".tsv") == 0))
+	{
+		l->format = LOG_FORMAT_TSV;
+		l->sep = '\t';
+	}
+	else if ((n > 4) && (strcmp(l->path + n - 4, ".dmc") == 0))
+	{
+		l->format = LOG_FORMAT_CAPTURE;
+	}
+
+	/*
+	 * The block layout and time base of a capture belong to one
+	 * session, so a capture is never appended to
+	 *
+	 */
+	if ((l->format == LOG_FORMAT_CAPTURE) && !l->segmented && (stat(l->path, &st) == 0) && (st.st_size != 0))
+	{
+		fprintf(stderr, "%s:%d: Capture '%s' already exists, not overwriting\n", FL, l->path);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &wall);
+	l->cut[0] = l->cut[1] = -1;
+	l->pcut[0] = l->pcut[1] = -1;
+	for (int i = 0; i < PYRAMID_LEVELS; i++)
+		l->pyr_fd[i] = -1;
+
+	if (logger_open(l, &wall) < 0)
+		return -1;
+
+	l->buf[0] = (char *)malloc(LOG_BUF_SIZE);
+	l->buf[1] = (char *)malloc(LOG_BUF_SIZE);
+	if (!l->buf[0] || !l->buf[1])
+		return -1;
+	if (l->format == LOG_FORMAT_CAPTURE)
+	{
+		l->pbuf[0] = (struct pyramid_out_s *)malloc(LOG_PYR_MAX * sizeof(struct pyramid_out_s));
+		l->pbuf[1] = (struct pyramid_out_s *)malloc(LOG_PYR_MAX * sizeof(struct pyramid_out_s));
+		l->pyr_scratch = (struct pyramid_entry_s *)malloc(LOG_PYR_MAX * sizeof(struct pyramid_entry_s));
+		if (!l->pbuf[0] || !l->pbuf[1] || !l->pyr_scratch)
+			return -1;
+	}
+
+	if (fstat(l->fd, &st) != 0)
+		return -1;
+	l->need_header = (st.st_size == 0);
+
+	pthread_mutex_init(&(l->lock), NULL);
+	pthread_cond_init(&(l->wake), NULL);
+	pthread_cond_init(&(l->space), NULL);
+
+	if (l->compress)
+	{
+		pthread_mutex_init(&(l->zlock), NULL);
+		pthread_cond_init(&(l->zwake), NULL);
+		if (pthread_create(&(l->zthread), NULL, compress_thread, l) != 0)
+			return -1;
+	}
+
+	return pthread_create(&(l->thread), NULL, logger_thread, l);
+}
+
+/*
+ * logger_pyramid_emit()
+ *
+ * pyramid_emit_fn, queues a closed entry for the writer.  Called
+ * with the lock held and room for it already made.
+ *
+ */
+void logger_pyramid_emit(void *ctx, int level, const struct pyramid_entry_s *e)
+{
+	struct logger_s *l = (struct logger_s *)ctx;
+	struct pyramid_out_s *o = &(l->pbuf[l->active][l->plen[l->active]++]);
+
+	o->level = level;
+	o->e = *e;
+}
+
+/*
+ * logger_wait_space()
+ *
+ * Both buffers full; wait for the writer, never drop.  Also makes
+ * sure there's room for a sample's worth of pyramid entries.
+ *
+ */
+void logger_wait_space(struct logger_s *l, size_t sz)
+{
+	while ((l->len[l->active] + sz > LOG_BUF_SIZE)
+			|| ((l->format == LOG_FORMAT_CAPTURE) && (l->plen[l->active] + 2 * PYRAMID_LEVELS > LOG_PYR_MAX)))
+	{
+		l->stalls++;
+		pthread_cond_signal(&(l->wake));
+		pthread_cond_wait(&(l->space), &(l->lock));
+	}
+}
+
+/*
+ * logger_sample()
+ *
+ * Acquisition side, format one row into the active buffer.  The
+ * value is printed with %.17g so it round-trips exactly.  When a
+ * segment is due to end the new header goes in here and the
+ * writer is told where the cut is.
+ *
+ */
+void logger_sample(struct logger_s *l, struct sample_s *s)
+{
+	char row[CAPTURE_ROW_MAX];
+	int sz;
+
+	pthread_mutex_lock(&(l->lock));
+	if (l->need_header)
+	{
+		// timed from the first sample, which for a replay isn't now
+		l->len[l->active] = logger_header(l, l->buf[l->active], s);
+		l->seg_bytes = l->len[l->active];
+		if (l->rotate_secs > 0)
+			l->next_rotate = (s->wall.tv_sec / l->rotate_secs + 1) * l->rotate_secs;
+		l->need_header = 0;
+	}
+	else if (l->segmented && (l->seg_samples > 0)
+			&& (((l->rotate_bytes > 0) && (l->seg_bytes >= l->rotate_bytes))
+				|| ((l->rotate_secs > 0) && (s->wall.tv_sec >= l->next_rotate))))
+	{
+		logger_wait_space(l, CAPTURE_HEADER_SIZE + CAPTURE_ROW_MAX);
+
+		// one cut per buffer; a second one waits for the next sample
+		if (l->cut[l->active] < 0)
+		{
+			if (l->format == LOG_FORMAT_CAPTURE)
+			{
+				pyramid_flush(&(l->pyr), logger_pyramid_emit, l);
+				l->pcut[l->active] = l->plen[l->active];
+			}
+			l->cut[l->active] = l->len[l->active];
+			l->cut_samples[l->active] = l->seg_samples;
+			l->cut_wall[l->active] = s->wall;
+			l->len[l->active] += logger_header(l, l->buf[l->active] + l->len[l->active], s);
+			l->seg_bytes = l->len[l->active] - l->cut[l->active];
+			l->seg_samples = 0;
+			if (l->rotate_secs > 0)
+				l->next_rotate = (s->wall.tv_sec / l->rotate_secs + 1) * l->rotate_secs;
+		}
+	}
+
+	if (l->format == LOG_FORMAT_CAPTURE)
+	{
+		sz = capture_row(l, s, row);
+	}
+	else
+	{
+		char rate[2] = {s->rate, '\0'}; // empty if unknown
+
+		sz = snprintf(row, sizeof(row), "%lu.%09lu%c%.17g%c%s%c%d%c%s",
+					  (unsigned long)(s->t_ns / 1000000000ULL), (unsigned long)(s->t_ns % 1000000000ULL), l->sep,
+					  s->v, l->sep, mmodes[s->mode_index].scpi, l->sep, s->range_index, l->sep, rate);
+		if (s->acq.t_ns)
+			sz += snprintf(row + sz, sizeof(row) - sz, "%c%lu.%09lu%c%lu.%09lu%c%lu.%09lu%c%.6f",
+						   l->sep, (unsigned long)(s->acq.write_ns / 1000000000ULL), (unsigned long)(s->acq.write_ns % 1000000000ULL),
+						   l->sep, (unsigned long)(s->acq.reply_ns / 1000000000ULL), (unsigned long)(s->acq.reply_ns % 1000000000ULL),
+						   l->sep, (unsigned long)(s->acq.t_ns / 1000000000ULL), (unsigned long)(s->acq.t_ns % 1000000000ULL),
+						   l->sep, s->acq.unc_ns / 1e9);
+		else
+			sz += snprintf(row + sz, sizeof(row) - sz, "%c%c%c%c", l->sep, l->sep, l->sep, l->sep); // replay, not known
+		if (l->integ)
+			sz += snprintf(row + sz, sizeof(row) - sz, "%c%.12g%c%.12g%c%d", l->sep, s->ah, l->sep, s->wh, l->sep, s->gap);
+		row[sz++] = '\n';
+	}
+
+	logger_wait_space(l, sz);
+	memcpy(l->buf[l->active] + l->len[l->active], row, sz);
+	if (l->format == LOG_FORMAT_CAPTURE)
+		pyramid_add(&(l->pyr), l->last_t_us, s->v, s->mode_index, logger_pyramid_emit, l);
+	l->len[l->active] += sz;
+	l->samples++;
+	l->seg_samples++;
+	l->seg_bytes += sz;
+	if ((l->len[l->active] >= LOG_BUF_SIZE / 2) && !l->writing)
+		pthread_cond_signal(&(l->wake));
+	pthread_mutex_unlock(&(l->lock));
+}
+
+/*
+ * logger_stop()
+ *
+ * Flush everything that's buffered and close the file, then let
+ * the compressor finish the queue
+ *
+ */
+void logger_stop(struct logger_s *l)
+{
+	pthread_mutex_lock(&(l->lock));
+	if (l->format == LOG_FORMAT_CAPTURE)
+	{
+		logger_wait_space(l, 0);
+		pyramid_flush(&(l->pyr), logger_pyramid_emit, l);
+	}
+	l->quit = 1;
+	pthread_cond_signal(&(l->wake));
+	pthread_mutex_unlock(&(l->lock));
+	pthread_join(l->thread, NULL);
+
+	if (l->segmented)
+	{
+		logger_close_segment(l, l->seg_samples);
+	}
+	else
+	{
+		if (l->fsync_ms != LOG_FSYNC_NEVER)
+			fdatasync(l->fd);
+		close(l->fd);
+		logger_pyramid_close(l);
+	}
+
+	if (l->compress)
+	{
+		pthread_mutex_lock(&(l->zlock));
+		l->zquit = 1;
+		pthread_cond_signal(&(l->zwake));
+		pthread_mutex_unlock(&(l->zlock));
+		pthread_join(l->zthread, NULL);
+	}
+
+	fprintf(stderr, "Log %s: %lu samples, %lu bytes, %lu writes, %lu stalls", l->path,
+			(unsigned long)l->samples, (unsigned long)l->bytes, (unsigned long)l->flushes, (unsigned long)l->stalls);
+	if (l->segmented)
+		fprintf(stderr, ", %lu segments", (unsigned long)l->segments);
+	fprintf(stderr, "\n");
+}
+
+/*
+ * replay_mode_index()
+ *
+ */
+int replay_mode_index(const char *scpi)
+{
+	for (int mi = 0; mi <= MMODES_MAX; mi++)
+	{
+		if (strcmp(scpi, mmodes[mi].scpi) == 0)
+			return mi;
+	}
+
+	return -1;
+}
+
+/*
+ * replay_csv_row()
+ *
+ * Parse the row at off, 1 if it's a reading, 0 for anything else
+ * (header, junk) and -1 at the end of the file.  *next is set to
+ * the start of the following row.
+ *
+ */
+int replay_csv_row(struct replay_s *r, size_t off, size_t *next, uint64_t *t_ns, double *v, int *mode, int *range)
+{
+	const char *p = r->map + off;
+	const char *nl;
+	char row[256];
+	char *f[4], *e;
+	size_t n;
+
+	if (off >= r->size)
+		return -1;
+
+	nl = (const char *)memchr(p, '\n', r->size - off);
+	n = nl ? (size_t)(nl - p) : r->size - off;
+	*next = off + n + (nl ? 1 : 0);
+	if ((n == 0) || (n >= sizeof(row)) || (*p < '0') || (*p > '9'))
+		return 0;
+
+	memcpy(row, p, n);
+	row[n] = '\0';
+	f[0] = strtok(row, ",\t\r");
+	for (int k = 1; k < 4; k++)
+		f[k] = strtok(NULL, ",\t\r");
+	if (!f[3] || ((*mode = replay_mode_index(f[2])) < 0))
+		return 0;
+
+	*t_ns = (uint64_t)strtoull(f[0], &e, 10) * 1000000000ULL;
+	if (*e == '.')
+	{
+		char frac[10] = "000000000";
+		size_t fl = strspn(e + 1, "0123456789");
+		memcpy(frac, e + 1, fl < 9 ? fl : 9);
+		*t_ns += strtoull(frac, NULL, 10);
+	}
+	*v = strtod(f[1], NULL);
+	*range = atoi(f[3]);
+
+	return 1;
+}
+
+/*
+ * replay_load()
+ *
+ * Fill in the reading at the cursor, skipping anything that
+ * isn't one.  r->have is 0 once the end of the file is reached.
+ *
+ */
+void replay_load(struct replay_s *r)
+{
+	r->have = 0;
+
+	if (r->format == LOG_FORMAT_CAPTURE)
+	{
+		while (r->block < r->cv.blocks)
+		{
+			const struct capture_record_s *rec = capture_block_records(&(r->cv), r->block);
+
+			if ((r->rec >= capture_block_count(&(r->cv), r->block)) || (rec[r->rec].flags & CAPTURE_FLAG_FILLER))
+			{
+				r->block++;
+				r->rec = 0;
+				continue;
+			}
+			rec += r->rec;
+			if (r->rec == 0)
+				r->t_us = capture_block_sync(&(r->cv), r->block)->t_us;
+			r->t_us += rec->dt_us;
+			r->v = rec->value;
+			r->range_index = rec->range;
+			r->mode_index = rec->mode < r->cv.hdr->mode_count ? replay_mode_index(r->cv.hdr->modes[rec->mode].scpi) : -1;
+			if (r->mode_index < 0)
+			{
+				r->rec++;
+				continue;
+			}
+			r->have = 1;
+			return;
+		}
+	}
+	else
+	{
+		size_t next;
+		uint64_t t_ns;
+		int k;
+
+		while ((k = replay_csv_row(r, r->off, &next, &t_ns, &(r->v), &(r->mode_index), &(r->range_index))) >= 0)
+		{
+			if (k == 1)
+			{
+				if (!r->first_ns)
+					r->first_ns = t_ns;
+				r->t_us = t_ns > r->first_ns ? (t_ns - r->first_ns) / 1000ULL : 0;
+				r->have = 1;
+				return;
+			}
+			r->off = next;
+		}
+	}
+}
+
+/*
+ * replay_advance()
+ *
+ * Step the cursor past the current reading
+ *
+ */
+void replay_advance(struct replay_s *r)
+{
+	if (r->format == LOG_FORMAT_CAPTURE)
+	{
+		r->rec++;
+	}
+	else
+	{
+		size_t next;
+		uint64_t t_ns;
+		double v;
+		int mode, range;
+
+		replay_csv_row(r, r->off, &next, &t_ns, &v, &mode, &range);
+		r->off = next;
+	}
+	replay_load(r);
+}
+
+/*
+ * replay_anchor()
+ *
+ * Make the reading at the cursor due now
+ *
+ */
+void replay_anchor(struct replay_s *r)
+{
+	r->anchor_t_us = r->t_us;
+	r->anchor_ns = now_ns();
+}
+
+/*
+ * replay_seek()
+ *
+ * Jump to the first reading at or after t_us, via the capture
+ * sync records or the sparse CSV index, then step forward
+ *
+ */
+void replay_seek(struct replay_s *r, uint64_t t_us)
+{
+	if (r->format == LOG_FORMAT_CAPTURE)
+	{
+		r->block = r->cv.blocks ? capture_find_block(&(r->cv), t_us) : 0;
+		r->rec = 0;
+	}
+	else
+	{
+		size_t lo = 0, hi = r->index_n;
+
+		while (hi - lo > 1)
+		{
+			size_t mid = lo + (hi - lo) / 2;
+			if (r->index_t[mid] <= t_us)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		r->off = r->index_n ? r->index_off[lo] : 0;
+	}
+
+	replay_load(r);
+	while (r->have && (r->t_us < t_us))
+		replay_advance(r);
+	replay_anchor(r);
+}
+
+/*
+ * replay_open()
+ *
+ */
+int replay_open(struct glb *g)
+{
+	struct replay_s *r = g->replay;
+	size_t n = strlen(r->path);
+	struct timespec ts;
+	struct stat st;
+	int fd;
+
+	fd = open(r->path, O_RDONLY | O_CLOEXEC);
+	if ((fd < 0) || (fstat(fd, &st) != 0) || (st.st_size == 0))
+	{
+		fprintf(stderr, "%s:%d: Unable to open replay log '%s' (%s)\n", FL, r->path, fd < 0 ? strerror(errno) : "empty");
+		return -1;
+	}
+	r->size = st.st_size;
+	r->map = (const char *)mmap(NULL, r->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (r->map == MAP_FAILED)
+	{
+		fprintf(stderr, "%s:%d: Unable to map '%s' (%s)\n", FL, r->path, strerror(errno));
+		return -1;
+	}
+
+	if ((n > 4) && (strcmp(r->path + n - 4, ".dmc") == 0))
+	{
+		r->format = LOG_FORMAT_CAPTURE;
+		if (capture_view(&(r->cv), r->map, r->size) != 0)
+		{
+			fprintf(stderr, "%s:%d: '%s' is not a capture\n", FL, r->path);
+			return -1;
+		}
+		r->first_ns = r->cv.hdr->start_mono_ns;
+		r->wall0_ns = r->cv.hdr->start_wall_ns;
+		snprintf(g->idn, sizeof(g->idn), "%.*s", (int)sizeof(r->cv.hdr->idn), r->cv.hdr->idn);
+	}
+	else
+	{
+		size_t cap = 0;
+		uint64_t rows = 0;
+
+		r->format = LOG_FORMAT_CSV;
+
+		// the log only has monotonic time, put it on today's clock
+		clock_gettime(CLOCK_REALTIME, &ts);
+		r->wall0_ns = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+		madvise((void *)r->map, r->size, MADV_SEQUENTIAL);
+		for (replay_load(r); r->have; replay_advance(r), rows++)
+		{
+			if (rows % REPLAY_INDEX_STRIDE)
+				continue;
+			if (r->index_n == cap)
+			{
+				cap = cap ? cap * 2 : 64;
+				r->index_off = (size_t *)realloc(r->index_off, cap * sizeof(size_t));
+				r->index_t = (uint64_t *)realloc(r->index_t, cap * sizeof(uint64_t));
+				if (!r->index_off || !r->index_t)
+					return -1;
+			}
+			r->index_off[r->index_n] = r->off;
+			r->index_t[r->index_n] = r->t_us;
+			r->index_n++;
+		}
+		madvise((void *)r->map, r->size, MADV_RANDOM);
+	}
+
+	replay_seek(r, (uint64_t)(r->from_s * 1e6));
+	if (!r->have)
+	{
+		fprintf(stderr, "%s:%d: No readings in '%s'\n", FL, r->path);
+		return -1;
+	}
+	r->bench_ns = now_ns();
+
+	return 0;
+}
+
+/*
+ * replay_step()
+ *
+ * Main loop side.  Once the reading at the cursor is due it's
+ * copied into g as if it had just come off the serial port and the
+ * state goes to READSTATE_FINISHED_ALL, returns -1 at the end.
+ *
+ */
+int replay_step(struct glb *g)
+{
+	struct replay_s *r = g->replay;
+	uint64_t now, due;
+
+	g->read_state = READSTATE_REPLAY;
+
+	if (!r->have)
+	{
+		if (r->bench_ns)
+		{
+			double secs = (now_ns() - r->bench_ns) / 1e9;
+			fprintf(stderr, "Replay %s: %lu readings in %.3f s, %.0f readings/s\n", r->path,
+					(unsigned long)r->count, secs, secs > 0 ? r->count / secs : 0.0);
+			r->bench_ns = 0;
+		}
+		if (!g->headless)
+			usleep(20000);
+		return -1;
+	}
+
+	now = now_ns();
+	if (r->speed > 0)
+	{
+		due = r->anchor_ns + (uint64_t)((r->t_us - r->anchor_t_us) * 1000.0 / r->speed);
+		if (now < due)
+		{
+			// short naps so keys and window events stay responsive
+			usleep((due - now) / 1000ULL < 20000 ? (due - now) / 1000ULL : 20000);
+			return 0;
+		}
+	}
+
+	g->mode_index = r->mode_index;
+	g->v = r->v;
+	g->range_index = r->range_index;
+	if (r->range_index < 0)
+		g->range[0] = '\0';
+	else
+		snprintf(g->range, sizeof(g->range), "%d", r->range_index);
+	g->sample.t_ns = r->first_ns + r->t_us * 1000ULL;
+	g->sample.wall.tv_sec = (r->wall0_ns + (int64_t)r->t_us * 1000LL) / 1000000000LL;
+	g->sample.wall.tv_nsec = (r->wall0_ns + (int64_t)r->t_us * 1000LL) % 1000000000LL;
+	g->read_state = READSTATE_FINISHED_ALL;
+	r->count++;
+
+	replay_advance(r);
+
+	return 1;
+}
+
+/*
+ * replay_key()
+ *
+ * Seek / speed keys while replaying, returns non-zero if the key
+ * was used
+ *
+ */
+int replay_key(struct replay_s *r, int seek_s, int speed_shift)
+{
+	if (seek_s)
+	{
+		int64_t t = (int64_t)r->t_us + (int64_t)seek_s * 1000000LL;
+
+		replay_seek(r, t > 0 ? t : 0);
+		if (!r->bench_ns)
+			r->bench_ns = now_ns();
+		return 1;
+	}
+
+	if (speed_shift && (r->speed > 0))
+	{
+		r->speed = speed_shift > 0 ? r->speed * 2 : r->speed / 2;
+		replay_anchor(r);
+		fprintf(stderr, "Replay speed %gx\n", r->speed);
+		return 1;
+	}
+
+	return 0;
+}
+
+#if USE_SDL
+/*
+ * bargraph_layout()
+ *
+ * Work out every rectangle of the bar strip once, for the given
+ * area.  Called once at startup; the window isn't resizable, its size
+ * is fixed by the font metrics or -wx/-wy.
+ *
+ */
+void bargraph_layout(struct bargraph_s *b, int x, int y, int w, int h)
+{
+	int i;
+
+	b->area = {x, y, w, h};
+
+	// outline as four thin rectangles so it goes out in the same batch as the ticks
+	b->decor[0] = {x, y, w, 1};
+	b->decor[1] = {x, y + h - 1, w, 1};
+	b->decor[2] = {x, y, 1, h};
+	b->decor[3] = {x + w - 1, y, 1, h};
+	for (i = 0; i < BARGRAPH_TICKS; i++)
+	{
+		b->decor[4 + i] = {x + (w * (i + 1)) / (BARGRAPH_TICKS + 1), y + h / 2, 1, h / 2};
+	}
+
+	b->fill = {x + 2, y + 2, 0, h - 4};
+	b->peaks[0] = {x, y, 2, h};
+	b->peaks[1] = {x, y, 2, h};
+}
+
+/*
+ * bargraph_update()
+ *
+ * Feed one sample into the bar; only recomputes the fill width
+ * and peak marker positions.  Returns non-zero if the bar needs
+ * to be redrawn.
+ *
+ */
+int bargraph_update(struct bargraph_s *b, struct sample_s *s)
+{
+	double f;
+	int inner = b->area.w - 4;
+	int was_visible = b->visible;
+	SDL_Rect fill = b->fill, lo = b->peaks[0], hi = b->peaks[1];
+
+	if ((s->mode_index != b->mode_index) || (s->range_index != b->range_index))
+	{
+		b->mode_index = s->mode_index;
+		b->range_index = s->range_index;
+		b->fullscale = 0;
+		if ((s->mode_index >= 0) && (s->mode_index <= MMODES_MAX))
+		{
+			int ri = s->range_index < 0 ? 0 : s->range_index;
+			if (ri < 8)
+				b->fullscale = range_fullscale[s->mode_index][ri];
+		}
+		b->visible = (b->fullscale > 0);
+		b->peak_t = 0; // new scale, old peaks are meaningless
+	}
+
+	if (!b->visible)
+		return was_visible;
+
+	f = s->v / b->fullscale;
+	if (f < 0)
+		f = -f;
+	if (f > 1.0)
+		f = 1.0; // over range, pin the bar
+
+	if ((b->peak_t == 0) || (s->t_ns - b->peak_t > b->hold_ns))
+	{
+		b->peak_lo = b->peak_hi = f;
+		b->peak_t = s->t_ns;
+	}
+	else
+	{
+		if (f < b->peak_lo)
+			b->peak_lo = f;
+		if (f > b->peak_hi)
+			b->peak_hi = f;
+	}
+
+	b->fill.w = (int)(f * inner);
+	b->peaks[0].x = b->area.x + 2 + (int)(b->peak_lo * inner) - 1;
+	b->peaks[1].x = b->area.x + 2 + (int)(b->peak_hi * inner) - 1;
+
+	// only worth a new frame if a pixel actually moves
+	return (!was_visible || (fill.w != b->fill.w) || (lo.x != b->peaks[0].x) || (hi.x != b->peaks[1].x));
+}
+
+/*
+ * bargraph_draw()
+ *
+ * Frame outline and ticks in one batch, then a single fill for
+ * the bar and one batch for the two markers
+ *
+ */
+void bargraph_draw(struct glb *g, SDL_Renderer *renderer)
+{
+	struct bargraph_s *b = &(g->bar);
+
+	if (!b->enabled || !b->visible)
+		return;
+
+	SDL_SetRenderDrawColor(renderer, g->font_color_sec.r / 2, g->font_color_sec.g / 2, g->font_color_sec.b / 2, 255);
+	SDL_RenderFillRects(renderer, b->decor, 4 + BARGRAPH_TICKS);
+
+	SDL_SetRenderDrawColor(renderer, g->font_color_pri.r, g->font_color_pri.g, g->font_color_pri.b, 255);
+	SDL_RenderFillRect(renderer, &(b->fill));
+
+	SDL_SetRenderDrawColor(renderer, g->font_color_sec.r, g->font_color_sec.g, g->font_color_sec.b, 255);
+	SDL_RenderFillRects(renderer, b->peaks, 2);
+
+	SDL_SetRenderDrawColor(renderer, g->background_color.r, g->background_color.g, g->background_color.b, 255);
+}
+#endif
+
+#if USE_SDL && USE_X11
+/*
+ * overlay_setup()
+ *
+ * Make the (borderless, on top) overlay window click-through by
+ * giving it an empty input shape, and apply the opacity.
+ *
+ */
+int overlay_setup(struct glb *g, SDL_Window *window)
+{
+	SDL_SysWMinfo wm;
+
+	SDL_VERSION(&wm.version);
+	if (!SDL_GetWindowWMInfo(window, &wm) || (wm.subsystem != SDL_SYSWM_X11))
+	{
+		fprintf(stderr, "%s:%d: overlay needs an X11 window, shape not applied\n", FL);
+		return -1;
+	}
+
+	XShapeCombineRectangles(wm.info.x11.display, wm.info.x11.window, ShapeInput, 0, 0, NULL, 0, ShapeSet, Unsorted);
+	if (g->overlay_opacity < 1.0)
+		SDL_SetWindowOpacity(window, g->overlay_opacity);
+	XFlush(wm.info.x11.display);
+
+	return 0;
+}
+
+/*
+ * overlay_shape()
+ *
+ * Cut the window down to the glyph pixels of the rendered text
+ * (plus the bar strip) so everything else shows what's underneath.
+ * Built from the alpha of the TTF surfaces, so it is only called
+ * when the text is re-rendered, never per frame.
+ *
+ */
+void overlay_shape(struct glb *g, SDL_Window *window, SDL_Surface **surfaces, SDL_Rect *dst, int n)
+{
+	SDL_SysWMinfo wm;
+	int bpl = (g->window_width + 7) / 8;
+	char *bits;
+
+	SDL_VERSION(&wm.version);
+	if (!SDL_GetWindowWMInfo(window, &wm) || (wm.subsystem != SDL_SYSWM_X11))
+		return;
+
+	bits = (char *)calloc(bpl * g->window_height, 1);
+	if (!bits)
+		return;
+
+	for (int i = 0; i < n; i++)
+	{
+		SDL_Surface *sf = surfaces[i];
+
+		if (!sf)
+			continue;
+
+		// TTF_RenderUTF8_Blended() surfaces are ARGB8888, alpha in the top byte
+		SDL_LockSurface(sf);
+		for (int y = 0; y < sf->h; y++)
+		{
+			int wy = dst[i].y + y;
+			uint32_t *row = (uint32_t *)((uint8_t *)sf->pixels + y * sf->pitch);
+
+			if ((wy < 0) || (wy >= g->window_height))
+				continue;
+			for (int x = 0; x < sf->w; x++)
+			{
+				int wx = dst[i].x + x;
+
+				if ((wx >= 0) && (wx < g->window_width) && ((row[x] >> 24) > 0x40))
+					bits[wy * bpl + wx / 8] |= 1 << (wx & 7);
+			}
+		}
+		SDL_UnlockSurface(sf);
+	}
+
+	if (g->bar.enabled && g->bar.visible)
+	{
+		SDL_Rect *a = &(g->bar.area);
+		for (int y = a->y; (y < a->y + a->h) && (y < g->window_height); y++)
+			for (int x = a->x; (x < a->x + a->w) && (x < g->window_width); x++)
+				bits[y * bpl + x / 8] |= 1 << (x & 7);
+	}
+
+	Pixmap pm = XCreateBitmapFromData(wm.info.x11.display, wm.info.x11.window, bits, g->window_width, g->window_height);
+	XShapeCombineMask(wm.info.x11.display, wm.info.x11.window, ShapeBounding, 0, 0, pm, ShapeSet);
+	XFreePixmap(wm.info.x11.display, pm);
+	XFlush(wm.info.x11.display);
+	free(bits);
+}
+#endif
+
+/*
+ * format_reading()
+ *
+ * Turn the raw value and range code into the display text, the
+ * g->value and g->range strings
+ *
+ */
+void format_reading(struct glb *g)
+{
+	switch (g->mode_index)
+	{
+	case MMODES_VOLT_DC:
+		if (strcmp(g->range, "0") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 07.3f mV DC", g->v * 1000.0);
+			snprintf(g->range, sizeof(g->range), "200mV");
+		}
+		else if (strcmp(g->range, "1") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 07.5f V DC", g->v);
+			snprintf(g->range, sizeof(g->range), "2V");
+		}
+		else if (strcmp(g->range, "2") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 07.4f V DC", g->v);
+			snprintf(g->range, sizeof(g->range), "20V");
+		}
+		else if (strcmp(g->range, "3") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 07.3f V DC", g->v);
+			snprintf(g->range, sizeof(g->range), "200V");
+		}
+		else if (strcmp(g->range, "4") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 07.2f V DC", g->v);
+			snprintf(g->range, sizeof(g->range), "1000V");
+		}
+		break;
+
+	case MMODES_VOLT_AC:
+		if (strcmp(g->range, "0") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 07.3f mV AC", g->v * 1000.0);
+			snprintf(g->range, sizeof(g->range), "200mV");
+		}
+		else if (strcmp(g->range, "1") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 07.5f V AC", g->v);
+			snprintf(g->range, sizeof(g->range), "2V");
+		}
+		else if (strcmp(g->range, "2") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 07.4f V AC", g->v);
+			snprintf(g->range, sizeof(g->range), "20V");
+		}
+		else if (strcmp(g->range, "3") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 07.3f V AC", g->v);
+			snprintf(g->range, sizeof(g->range), "200V");
+		}
+		else if (strcmp(g->range, "4") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 07.2f V AC", g->v);
+			snprintf(g->range, sizeof(g->range), "750V");
+		}
+		break;
+
+	case MMODES_CURR_DC:
+		if (strcmp(g->range, "0") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 07.2f uA DC", g->v * 1000.0);
+			snprintf(g->range, sizeof(g->range), "20uA");
+		}
+		else if (strcmp(g->range, "1") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 07.4f mA DC", g->v);
+			snprintf(g->range, sizeof(g->range), "2mA");
+		}
+		else if (strcmp(g->range, "2") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 07.4f mA DC", g->v);
+			snprintf(g->range, sizeof(g->range), "20mA");
+		}
+		else if (strcmp(g->range, "3") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 07.2f mA DC", g->v);
+			snprintf(g->range, sizeof(g->range), "200mA");
+		}
+		else if (strcmp(g->range, "4") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 07.1f A DC", g->v);
+			snprintf(g->range, sizeof(g->range), "2A");
+		}
+		else if (strcmp(g->range, "5") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 07.1f A DC", g->v);
+			snprintf(g->range, sizeof(g->range), "10A");
+		}
+		break;
+	case MMODES_CURR_AC:
+		if (strcmp(g->range, "0") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 07.2f mA AC", g->v * 1000.0);
+			snprintf(g->range, sizeof(g->range), "20mA");
+		}
+		else if (strcmp(g->range, "1") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 07.4f mA AC", g->v);
+			snprintf(g->range, sizeof(g->range), "200mA");
+		}
+		else if (strcmp(g->range, "2") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 07.4f A AC", g->v);
+			snprintf(g->range, sizeof(g->range), "2A");
+		}
+		else if (strcmp(g->range, "3") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 07.2f A AC", g->v);
+			snprintf(g->range, sizeof(g->range), "10A");
+		}
+		break;
+
+	case MMODES_RES:
+	case MMODES_FRES:
+		if (strcmp(g->range, "0") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "%06.3f %s", g->v, oo);
+			snprintf(g->range, sizeof(g->range), "200%s", oo);
+		}
+		else if (strcmp(g->range, "1") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "%06.5f k%s", g->v / 1000, oo);
+			snprintf(g->range, sizeof(g->range), "2K%s", oo);
+		}
+		else if (strcmp(g->range, "2") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "%06.4f k%s", g->v / 1000, oo);
+			snprintf(g->range, sizeof(g->range), "20K%s", oo);
+		}
+		else if (strcmp(g->range, "3") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "%06.3f k%s", g->v / 1000, oo);
+			snprintf(g->range, sizeof(g->range), "200K%s", oo);
+		}
+		else if (strcmp(g->range, "4") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "%06.5f M%s", g->v / 1000000, oo);
+			snprintf(g->range, sizeof(g->range), "1M%s", oo);
+		}
+		else if (strcmp(g->range, "5") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "%06.4f M%s", g->v / 1000000, oo);
+			snprintf(g->range, sizeof(g->range), "10M%s", oo);
+		}
+		else if (strcmp(g->range, "6") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "%06.3f M%s", g->v / 1000000, oo);
+			snprintf(g->range, sizeof(g->range), "100M%s", oo);
+		}
+
+		if (g->v >= 9000000000000000.000000)
+			snprintf(g->value, sizeof(g->value), "O.L");
+		break;
+
+	case MMODES_CAP:
+		if (strcmp(g->range, "0") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 6.3f nF", g->v * 1E+9);
+			snprintf(g->range, sizeof(g->range), "2nF");
+		}
+		else if (strcmp(g->range, "1") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 06.2f nF", g->v * 1E+9);
+			snprintf(g->range, sizeof(g->range), "20nF");
+		}
+		else if (strcmp(g->range, "2") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 06.1f nF", g->v * 1E+9);
+			snprintf(g->range, sizeof(g->range), "200nF");
+		}
+		else if (strcmp(g->range, "3") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 06.3f %sF", g->v * 1E+6, uu);
+			snprintf(g->range, sizeof(g->range), "2%sF", uu);
+		}
+		else if (strcmp(g->range, "4") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 06.2f %sF", g->v * 1E+6, uu);
+			snprintf(g->range, sizeof(g->range), "200%sF", uu);
+		}
+		else if (strcmp(g->range, "5") == 0)
+		{
+			snprintf(g->value, sizeof(g->value), "% 06.3f %sF", g->v * 1E+6, uu);
+			snprintf(g->range, sizeof(g->range), "100000%sF", uu);
+		}
+		if (g->v >= 51000000000000)
+			snprintf(g->value, sizeof(g->value), "O.L");
+		break;
+
+	case MMODES_CONT:
+	{
+		if (g->v > g->cont_threshold)
+		{
+			if (g->v > 1000)
+				g->v = 999.9;
+			snprintf(g->value, sizeof(g->value), "OPEN [%05.1f%s]", g->v, oo);
+		}
+		else
+		{
+			snprintf(g->value, sizeof(g->value), "SHRT [%05.1f%s]", g->v, oo);
+		}
+		snprintf(g->range, sizeof(g->range), "Threshold: %d%s", g->cont_threshold, oo);
+	}
+	break;
+
+	case MMODES_DIOD:
+	{
+		if (g->v > 9.999)
+		{
+			snprintf(g->value, sizeof(g->value), "OL / OPEN");
+		}
+		else
+		{
+			snprintf(g->value, sizeof(g->value), "%06.4f V", g->v);
+		}
+		snprintf(g->range, sizeof(g->range), "None");
+	}
+	break;
+	}
+}
+
+/*
+ * math_reading()
+ *
+ * format_reading() with the -M math of the mode applied to the raw
+ * value first.  g->v stays raw for the logs, only the display text
+ * changes.  A null on its own keeps the meter's range formatting,
+ * anything that changes the units is shown as is.
+ *
+ */
+void math_reading(struct glb *g)
+{
+	struct hostmath_s *m = &(g->math[g->mode_index]);
+	double raw = g->v, v = g->v;
+
+	if (!hostmath_active(m))
+	{
+		format_reading(g);
+		return;
+	}
+
+	if (m->rel_pending)
+	{
+		m->null = raw;
+		m->rel = 1;
+		m->rel_pending = 0;
+	}
+
+	hostmath_block(m, &v, 1);
+	g->v = v;
+	format_reading(g);
+	g->v = raw;
+
+	// O.L and OPEN stand as they are
+	if (!hostmath_linear(m) && (g->value[0] != 'O'))
+	{
+		if (m->db)
+			snprintf(g->value, sizeof(g->value), "% 07.3f %s", v, hostmath_units(m));
+		else
+			snprintf(g->value, sizeof(g->value), "% .6g %s", v, hostmath_units(m) ? hostmath_units(m) : mmodes[g->mode_index].units);
+	}
+}
+
+/*
+ * math_null()
+ *
+ * z key; null the current mode at the next reading, or drop the
+ * null if it already has one
+ *
+ */
+void math_null(struct glb *g)
+{
+	struct hostmath_s *m;
+
+	if ((g->mode_index < 0) || (g->mode_index > MMODES_MAX) || (g->mode_index == MMODES_CONT))
+		return;
+	m = &(g->math[g->mode_index]);
+
+	if (m->rel || m->rel_pending)
+	{
+		m->rel = m->rel_pending = 0;
+		fprintf(stderr, "REL off, %s\n", mmodes[g->mode_index].scpi);
+	}
+	else
+	{
+		m->rel_pending = 1;
+	}
+}
+
+/*
+ * shm_start()
+ *
+ * Create the -S segment, see dm3058e-shm.h
+ *
+ */
+int shm_start(struct glb *g)
+{
+	struct dm3058e_shm *shm;
+	uint32_t slots = DM3058E_SHM_RING_SLOTS;
+	int fd;
+
+	if (g->shm_slots)
+	{
+		for (slots = 16; (slots < g->shm_slots) && (slots < (1U << 24)); slots <<= 1)
+			;
+	}
+	g->shm_size = sizeof(struct dm3058e_shm) + (size_t)slots * sizeof(struct dm3058e_shm_slot);
+
+	fd = shm_open(g->shm_name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		fprintf(stderr, "%s:%d: Unable to create shared memory '%s' (%s)\n", FL, g->shm_name, strerror(errno));
+		return -1;
+	}
+	if (ftruncate(fd, g->shm_size) != 0)
+	{
+		fprintf(stderr, "%s:%d: Unable to size shared memory '%s' (%s)\n", FL, g->shm_name, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	shm = (struct dm3058e_shm *)mmap(NULL, g->shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED)
+		return -1;
+
+	// a leftover segment from an earlier run starts again from nothing
+	__atomic_store_n(&(shm->magic), 0, __ATOMIC_RELEASE);
+	memset((uint8_t *)shm + sizeof(shm->magic), 0, g->shm_size - sizeof(shm->magic));
+	shm->size = g->shm_size;
+	shm->ring_size = slots;
+	shm->ring_offset = sizeof(struct dm3058e_shm);
+	shm->version = DM3058E_SHM_VERSION;
+	shm->producer_pid = getpid();
+	__atomic_store_n(&(shm->magic), DM3058E_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	g->shm = shm;
+
+	return 0;
+}
+
+/*
+ * shm_sample()
+ *
+ */
+void shm_sample(struct glb *g, struct sample_s *s, uint64_t seq, struct dm3058e_shm_sample *d)
+{
+	d->seq = seq;
+	d->t_mono_ns = s->t_ns;
+	d->t_wall_ns = (int64_t)s->wall.tv_sec * 1000000000LL + s->wall.tv_nsec;
+	d->value = s->v;
+	d->mode = s->mode_index;
+	d->range = s->range_index;
+	snprintf(d->mode_name, sizeof(d->mode_name), "%.7s", mmodes[s->mode_index].scpi);
+	snprintf(d->units, sizeof(d->units), "%.7s", mmodes[s->mode_index].units);
+	snprintf(d->range_text, sizeof(d->range_text), "%.15s", g->range);
+	snprintf(d->display, sizeof(d->display), "%.31s", g->value);
+}
+
+/*
+ * shm_publish()
+ *
+ * Ring slot first: the slot is marked incomplete, filled, stamped
+ * with its sample number and only then does head move on.  Then a
+ * seqlock write of the latest sample; seq goes odd, the sample is
+ * copied in, seq goes even again.  Never blocks.
+ *
+ */
+void shm_publish(struct glb *g, struct sample_s *s)
+{
+	struct dm3058e_shm *shm = g->shm;
+	uint64_t n = shm->head;
+	struct dm3058e_shm_slot *slot = (struct dm3058e_shm_slot *)dm3058e_shm_slot(shm, n);
+	uint64_t seq = shm->seq;
+
+	__atomic_store_n(&(slot->seq), 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	shm_sample(g, s, n + 1, &(slot->s));
+	__atomic_store_n(&(slot->seq), n + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&(shm->head), n + 1, __ATOMIC_RELEASE);
+
+	__atomic_store_n(&(shm->seq), seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	shm->latest = slot->s;
+	__atomic_store_n(&(shm->seq), seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * shm_stop()
+ *
+ * Readers that still have it mapped see producer_pid go to 0
+ *
+ */
+void shm_stop(struct glb *g)
+{
+	__atomic_store_n(&(g->shm->producer_pid), 0, __ATOMIC_RELEASE);
+	munmap(g->shm, g->shm_size);
+	shm_unlink(g->shm_name);
+	g->shm = NULL;
+}
+
+/*
+ * output_file_write()
+ *
+ * Legacy -o handshake for FlexBV; the consumer deletes the file
+ * when it has read it and we only write a new one once it's gone.
+ * Kept as an adapter on the sample stream, -S is the low latency
+ * way to get the same data.
+ *
+ */
+void output_file_write(struct glb *g)
+{
+	char tfn[PATH_MAX + 8];
+	FILE *f;
+
+	if (fileExists(g->output_file))
+		return;
+
+	snprintf(tfn, sizeof(tfn), "%s.tmp", g->output_file);
+	f = fopen(tfn, "w");
+	if (f)
+	{
+		fprintf(f, "%s\t%s", g->value, mmodes[g->mode_index].logmode);
+		fclose(f);
+		chmod(tfn, S_IROTH | S_IWOTH | S_IRUSR | S_IWUSR);
+		rename(tfn, g->output_file);
+	}
+}
+
+/*
+ * Set by SIGUSR1, checked by pretrig_sample()
+ *
+ */
+volatile sig_atomic_t pretrig_signal = 0;
+
+void handle_pretrig_signal(int sig)
+{
+	pretrig_signal = 1;
+}
+
+/*
+ * pretrig_dump()
+ *
+ * Dump thread, copy one span out of the live ring and write it as a
+ * capture.  Returns 0 if it was written.
+ *
+ */
+int pretrig_dump(struct pretrig_s *p, struct pretrig_job_s *job)
+{
+	struct logger_s cl;
+	struct capture_header_s h;
+	struct sample_s *span;
+	char path[PATH_MAX], part[PATH_MAX + 8], stamp[32], *row;
+	uint64_t n, first = job->first, head;
+	struct tm tm;
+	FILE *f;
+
+	n = job->end - first;
+	span = (struct sample_s *)malloc(n * sizeof(struct sample_s));
+	row = (char *)malloc(CAPTURE_ROW_MAX);
+	if (!span || !row)
+	{
+		free(span);
+		free(row);
+		return -1;
+	}
+	for (uint64_t i = 0; i < n; i++)
+		span[i] = p->ring[(first + i) & (p->size - 1)];
+
+	// everything copied has to still be there now, else the producer lapped us mid copy;
+	// at head == first + size it was already writing slot first
+	head = __atomic_load_n(&(p->head), __ATOMIC_ACQUIRE);
+	if (head - first >= p->size)
+	{
+		fprintf(stderr, "%s:%d: Pre-trigger dump '%s' overwritten before it could be saved\n", FL, job->reason);
+		free(span);
+		free(row);
+		return -1;
+	}
+
+	// a window in seconds starts at the first reading inside it
+	uint64_t skip = 0;
+	if (p->pre.ns)
+	{
+		uint64_t t_trig = span[job->trigger - first].t_ns;
+		while ((skip < job->trigger - first) && (t_trig - span[skip].t_ns > p->pre.ns))
+			skip++;
+	}
+
+	localtime_r(&(span[job->trigger - first].wall.tv_sec), &tm);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+	snprintf(path, sizeof(path), "%s-%s.%03ld.dmc", p->prefix, stamp, span[job->trigger - first].wall.tv_nsec / 1000000L);
+	snprintf(part, sizeof(part), "%s.part", path);
+
+	f = fopen(part, "w");
+	if (!f)
+	{
+		fprintf(stderr, "%s:%d: Unable to create '%s' (%s)\n", FL, part, strerror(errno));
+		free(span);
+		free(row);
+		return -1;
+	}
+
+	memset(&cl, 0, sizeof(cl));
+	cl.idn = p->idn;
+	cl.block_fill = CAPTURE_BLOCK_RECORDS;
+	capture_header(&cl, &h, &(span[skip]));
+	fwrite(&h, sizeof(h), 1, f);
+
+	for (uint64_t i = skip; i < n; i++)
+	{
+		int sz = capture_row(&cl, &(span[i]), row);
+
+		if (first + i == job->trigger)
+			((struct capture_record_s *)(row + sz - sizeof(struct capture_record_s)))->flags |= CAPTURE_FLAG_TRIGGER;
+		fwrite(row, sz, 1, f);
+		cl.samples++;
+		cl.seg_samples++;
+	}
+
+	if ((fclose(f) != 0) || (rename(part, path) != 0))
+	{
+		fprintf(stderr, "%s:%d: Unable to write '%s' (%s)\n", FL, path, strerror(errno));
+		unlink(part);
+		free(span);
+		free(row);
+		return -1;
+	}
+
+	fprintf(stderr, "Pre-trigger capture %s: %lu readings, %lu before the trigger (%s)\n", path,
+			(unsigned long)(n - skip), (unsigned long)(job->trigger - first - skip), job->reason);
+
+	free(span);
+	free(row);
+
+	return 0;
+}
+
+/*
+ * pretrig_thread()
+ *
+ */
+void *pretrig_thread(void *arg)
+{
+	struct pretrig_s *p = (struct pretrig_s *)arg;
+	struct pretrig_job_s job;
+
+	pthread_mutex_lock(&(p->lock));
+	while (1)
+	{
+		if (p->jtail == p->jhead)
+		{
+			if (p->quit)
+				break;
+			pthread_cond_wait(&(p->wake), &(p->lock));
+			continue;
+		}
+		job = p->jobs[p->jtail % PRETRIG_JOBS];
+		p->jtail++;
+		pthread_mutex_unlock(&(p->lock));
+
+		int r = pretrig_dump(p, &job);
+
+		// lost is bumped by pretrig_queue() too
+		pthread_mutex_lock(&(p->lock));
+		if (r == 0)
+			p->dumps++;
+		else
+			p->lost++;
+	}
+	pthread_mutex_unlock(&(p->lock));
+
+	return NULL;
+}
+
+/*
+ * pretrig_start()
+ *
+ * Size the ring from the windows and start the dump thread
+ *
+ */
+int pretrig_start(struct pretrig_s *p)
+{
+	uint64_t want;
+
+	p->pre_cap = p->pre.count ? p->pre.count : p->pre.ns / 1000000000ULL * PRETRIG_RATE_MAX + PRETRIG_RATE_MAX;
+	p->post_cap = p->post.count ? p->post.count : p->post.ns / 1000000000ULL * PRETRIG_RATE_MAX + PRETRIG_RATE_MAX;
+
+	// a quarter again as slack for the dump thread to copy in
+	want = p->pre_cap + p->post_cap + 1;
+	want += want / 4 + 64;
+	for (p->size = 64; p->size < want; p->size <<= 1)
+		;
+
+	p->ring = (struct sample_s *)calloc(p->size, sizeof(struct sample_s));
+	if (!p->ring)
+	{
+		fprintf(stderr, "%s:%d: Unable to allocate the pre-trigger ring, %lu readings\n", FL, (unsigned long)p->size);
+		return -1;
+	}
+
+	pthread_mutex_init(&(p->lock), NULL);
+	pthread_cond_init(&(p->wake), NULL);
+	if (pthread_create(&(p->thread), NULL, pretrig_thread, p) != 0)
+	{
+		fprintf(stderr, "%s:%d: Unable to start the pre-trigger dump thread\n", FL);
+		return -1;
+	}
+
+	signal(SIGUSR1, handle_pretrig_signal);
+
+	if (glbs->debug)
+		fprintf(stderr, "%s:%d: Pre-trigger ring %lu readings, %lu KB\n", FL, (unsigned long)p->size, (unsigned long)(p->size * sizeof(struct sample_s) / 1024));
+
+	return 0;
+}
+
+/*
+ * pretrig_fire()
+ *
+ * Trigger at the latest reading.  While the post window of an
+ * earlier trigger is still filling, the new one is already inside
+ * that capture and is only counted.
+ *
+ */
+void pretrig_fire(struct pretrig_s *p, const char *reason)
+{
+	if (p->head == 0)
+		return;
+
+	if (p->armed)
+	{
+		p->ignored++;
+		return;
+	}
+
+	p->armed = 1;
+	p->trig_seq = p->head - 1;
+	p->trig_ns = p->ring[p->trig_seq & (p->size - 1)].t_ns;
+	snprintf(p->reason, sizeof(p->reason), "%s", reason);
+	p->fired++;
+}
+
+/*
+ * pretrig_queue()
+ *
+ * Hand the span around the armed trigger to the dump thread
+ *
+ */
+void pretrig_queue(struct pretrig_s *p)
+{
+	struct pretrig_job_s *job;
+
+	p->armed = 0;
+
+	pthread_mutex_lock(&(p->lock));
+	if (p->jhead - p->jtail >= PRETRIG_JOBS)
+	{
+		p->lost++;
+		fprintf(stderr, "%s:%d: Pre-trigger dump queue full, '%s' dropped\n", FL, p->reason);
+	}
+	else
+	{
+		job = &(p->jobs[p->jhead % PRETRIG_JOBS]);
+		job->trigger = p->trig_seq;
+		job->first = p->trig_seq > p->pre_cap ? p->trig_seq - p->pre_cap : 0;
+		job->end = p->head;
+		snprintf(job->reason, sizeof(job->reason), "%s", p->reason);
+		p->jhead++;
+		pthread_cond_signal(&(p->wake));
+	}
+	pthread_mutex_unlock(&(p->lock));
+}
+
+/*
+ * pretrig_sample()
+ *
+ * Store a reading, check the mode change and signal triggers and
+ * whether an armed trigger's post window is complete
+ *
+ */
+void pretrig_sample(struct pretrig_s *p, struct sample_s *s)
+{
+	p->ring[p->head & (p->size - 1)] = *s;
+	__atomic_store_n(&(p->head), p->head + 1, __ATOMIC_RELEASE);
+
+	if (pretrig_signal)
+	{
+		pretrig_signal = 0;
+		pretrig_fire(p, "signal");
+	}
+	if (p->on_mode && (s->mode_index != p->last_mode) && (p->last_mode >= 0))
+		pretrig_fire(p, "mode change");
+	p->last_mode = s->mode_index;
+
+	if (!p->armed)
+		return;
+
+	uint64_t after = p->head - 1 - p->trig_seq;
+	if ((after >= p->post_cap) || (p->post.count ? (after >= p->post.count) : (s->t_ns - p->trig_ns >= p->post.ns)))
+		pretrig_queue(p);
+}
+
+/*
+ * pretrig_stop()
+ *
+ * A trigger still collecting its post window is saved with what
+ * it has
+ *
+ */
+void pretrig_stop(struct pretrig_s *p)
+{
+	if (p->armed)
+		pretrig_queue(p);
+
+	pthread_mutex_lock(&(p->lock));
+	p->quit = 1;
+	pthread_cond_signal(&(p->wake));
+	pthread_mutex_unlock(&(p->lock));
+	pthread_join(p->thread, NULL);
+
+	if (p->fired)
+		fprintf(stderr, "Pre-trigger: %lu triggers, %lu captures written, %lu lost, %lu triggers inside an earlier capture\n",
+				(unsigned long)p->fired, (unsigned long)p->dumps, (unsigned long)p->lost, (unsigned long)p->ignored);
+	free(p->ring);
+}
+
+/*
+ * alarm_latency()
+ *
+ */
+void alarm_latency(struct alarm_lat_s *l, uint64_t t0_ns)
+{
+	uint64_t d = now_ns() - t0_ns;
+
+	if ((l->n == 0) || (d < l->min_ns))
+		l->min_ns = d;
+	if (d > l->max_ns)
+		l->max_ns = d;
+	l->sum_ns += d;
+	l->n++;
+}
+
+/*
+ * alarm_connect()
+ *
+ * (Re)connect the -Ae event socket, events are dropped while there
+ * is nothing listening
+ *
+ */
+int alarm_connect(struct alarms_s *a)
+{
+	struct sockaddr_un sa;
+
+	if (a->event_fd >= 0)
+		close(a->event_fd);
+
+	a->event_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (a->event_fd < 0)
+		return -1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", a->event_path);
+	if (connect(a->event_fd, (struct sockaddr *)&sa, sizeof(sa)) != 0)
+	{
+		close(a->event_fd);
+		a->event_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * alarm_action()
+ *
+ * Alarm thread, carry out one trip or clear.  The command runs
+ * first since it's the one likely to be doing the protecting.
+ *
+ */
+void alarm_action(struct alarms_s *a, struct alarm_event_s *ev, int *children)
+{
+	struct alarm_rule_s *r = &(a->rules[ev->rule]);
+	char line[SSIZE];
+	int sz;
+
+	if ((r->actions & ALARM_ACT_EXEC) && ev->tripped)
+	{
+		char value[32];
+		char *argv[] = {(char *)"sh", (char *)"-c", r->exec, (char *)"dm3058e-alarm", value, mmodes[r->mode_index].scpi, NULL};
+		pid_t pid;
+
+		snprintf(value, sizeof(value), "%.10g", ev->v);
+		if (posix_spawn(&pid, "/bin/sh", NULL, NULL, argv, environ) == 0)
+		{
+			alarm_latency(&(a->lat[ALARM_LAT_EXEC]), ev->t0_ns);
+			(*children)++;
+		}
+		else
+			fprintf(stderr, "%s:%d: Alarm '%s': unable to run '%s' (%s)\n", FL, r->spec, r->exec, strerror(errno));
+	}
+
+	if (r->actions & ALARM_ACT_EVENT)
+	{
+		sz = snprintf(line, sizeof(line), "{\"t\":%ld.%06ld,\"event\":\"alarm\",\"state\":\"%s\",\"rule\":\"%s\",\"mode\":\"%s\",\"value\":%.10g,\"latency_us\":%.1f}\n",
+					  (long)ev->wall.tv_sec, ev->wall.tv_nsec / 1000, ev->tripped ? "trip" : "clear", r->spec,
+					  mmodes[r->mode_index].scpi, ev->v, (now_ns() - ev->t0_ns) / 1000.0);
+		if (sz >= (int)sizeof(line))
+			sz = sizeof(line) - 1;
+
+		if (!a->event_path)
+		{
+			if (write(STDOUT_FILENO, line, sz) == sz)
+				alarm_latency(&(a->lat[ALARM_LAT_EVENT]), ev->t0_ns);
+		}
+		else if (((a->event_fd >= 0) || (alarm_connect(a) == 0)) && (send(a->event_fd, line, sz, MSG_NOSIGNAL) == sz))
+		{
+			alarm_latency(&(a->lat[ALARM_LAT_EVENT]), ev->t0_ns);
+		}
+		else if ((alarm_connect(a) == 0) && (send(a->event_fd, line, sz, MSG_NOSIGNAL) == sz))
+		{
+			// listener restarted since the last event
+			alarm_latency(&(a->lat[ALARM_LAT_EVENT]), ev->t0_ns);
+		}
+	}
+}
+
+/*
+ * alarm_thread()
+ *
+ * Drains the event queue, and reaps the commands it started
+ *
+ */
+void *alarm_thread(void *arg)
+{
+	struct alarms_s *a = (struct alarms_s *)arg;
+	struct alarm_event_s ev;
+	int children = 0;
+
+	pthread_mutex_lock(&(a->lock));
+	while (1)
+	{
+		while ((children > 0) && (waitpid(-1, NULL, WNOHANG) > 0))
+			children--;
+
+		if (a->tail == a->head)
+		{
+			if (a->quit)
+				break;
+			if (children > 0)
+			{
+				struct timespec ts;
+
+				clock_gettime(CLOCK_REALTIME, &ts);
+				ts.tv_nsec += 100000000;
+				if (ts.tv_nsec >= 1000000000)
+				{
+					ts.tv_sec++;
+					ts.tv_nsec -= 1000000000;
+				}
+				pthread_cond_timedwait(&(a->wake), &(a->lock), &ts);
+			}
+			else
+				pthread_cond_wait(&(a->wake), &(a->lock));
+			continue;
+		}
+
+		ev = a->queue[a->tail % ALARM_QUEUE];
+		a->tail++;
+		pthread_mutex_unlock(&(a->lock));
+
+		alarm_action(a, &ev, &children);
+
+		pthread_mutex_lock(&(a->lock));
+	}
+	pthread_mutex_unlock(&(a->lock));
+
+	return NULL;
+}
+
+/*
+ * alarm_start()
+ *
+ * Link the rules to their modes and start the alarm thread
+ *
+ */
+int alarm_start(struct alarms_s *a)
+{
+	for (int i = a->count - 1; i >= 0; i--)
+	{
+		a->rules[i].next = a->by_mode[a->rules[i].mode_index];
+		a->by_mode[a->rules[i].mode_index] = &(a->rules[i]);
+	}
+
+	if (a->event_path && (alarm_connect(a) != 0))
+		fprintf(stderr, "%s:%d: Alarm event socket '%s' not listening yet (%s)\n", FL, a->event_path, strerror(errno));
+
+	pthread_mutex_init(&(a->lock), NULL);
+	pthread_cond_init(&(a->wake), NULL);
+	if (pthread_create(&(a->thread), NULL, alarm_thread, a) != 0)
+	{
+		fprintf(stderr, "%s:%d: Unable to start the alarm thread\n", FL);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * alarm_change()
+ *
+ * A rule tripped or cleared; the flash is done here, the rest is
+ * queued for the alarm thread.  If the queue is full the event is
+ * counted and dropped rather than waited for.
+ *
+ */
+void alarm_change(struct glb *g, struct alarm_rule_s *r, struct sample_s *s, int tripped)
+{
+	struct alarms_s *a = g->alarms;
+	struct alarm_event_s *ev;
+	uint64_t t0 = g->replay ? now_ns() : s->t_ns; // replayed readings carry their recorded time
+
+	r->active = tripped;
+	r->pending = 0;
+	if (tripped)
+		r->trips++;
+
+	if ((r->actions & ALARM_ACT_CAPTURE) && tripped && g->pretrig)
+		pretrig_fire(g->pretrig, r->spec);
+
+	if (r->actions & ALARM_ACT_FLASH)
+	{
+		if (tripped)
+		{
+			if (a->flashing++ == 0)
+				a->flash_start_ns = now_ns();
+			a->flash_t0_ns = t0;
+		}
+		else
+			a->flashing--;
+	}
+
+	if (!(r->actions & (ALARM_ACT_EVENT | ALARM_ACT_EXEC)))
+		return;
+
+	pthread_mutex_lock(&(a->lock));
+	if (a->head - a->tail >= ALARM_QUEUE)
+		a->dropped++;
+	else
+	{
+		ev = &(a->queue[a->head % ALARM_QUEUE]);
+		ev->rule = r - a->rules;
+		ev->tripped = tripped;
+		ev->v = s->v;
+		ev->t0_ns = t0;
+		ev->wall = s->wall;
+		a->head++;
+		pthread_cond_signal(&(a->wake));
+	}
+	pthread_mutex_unlock(&(a->lock));
+}
+
+/*
+ * alarm_sample()
+ *
+ * Check a reading against the rules for its mode.  Beyond the limit
+ * for the hold time trips a rule, it clears once the reading is back
+ * inside by more than the hysteresis.  Switching the meter to another
+ * mode clears that mode's rules.
+ *
+ */
+void alarm_sample(struct glb *g, struct sample_s *s)
+{
+	struct alarms_s *a = g->alarms;
+	struct alarm_rule_s *r;
+	double v = s->v;
+
+	if (s->mode_index != a->last_mode)
+	{
+		if (a->last_mode >= 0)
+		{
+			for (r = a->by_mode[a->last_mode]; r; r = r->next)
+			{
+				r->pending = 0;
+				if (r->active)
+					alarm_change(g, r, s, 0);
+			}
+		}
+		a->last_mode = s->mode_index;
+	}
+
+	for (r = a->by_mode[s->mode_index]; r; r = r->next)
+	{
+		int beyond, back;
+
+		switch (r->kind)
+		{
+		case ALARM_ABOVE:
+			beyond = v > r->lo;
+			back = v < r->lo - r->hyst;
+			break;
+		case ALARM_BELOW:
+			beyond = v < r->lo;
+			back = v > r->lo + r->hyst;
+			break;
+		default:
+			beyond = (v < r->lo) || (v > r->hi);
+			back = (v > r->lo + r->hyst) && (v < r->hi - r->hyst);
+			break;
+		}
+
+		if (r->active)
+		{
+			if (back)
+				alarm_change(g, r, s, 0);
+			continue;
+		}
+
+		if (!beyond)
+		{
+			r->pending = 0;
+			continue;
+		}
+		if (!r->pending)
+		{
+			r->pending = 1;
+			r->pending_ns = s->t_ns;
+		}
+		if (s->t_ns - r->pending_ns >= r->hold_ns)
+			alarm_change(g, r, s, 1);
+	}
+}
+
+/*
+ * alarm_flash()
+ *
+ * Whether the OSD should be showing the alarm colour right now,
+ * the first half period starts at the trip
+ *
+ */
+int alarm_flash(struct alarms_s *a, uint64_t now)
+{
+	if (!a->flashing)
+		return 0;
+
+	return ((now - a->flash_start_ns) / ALARM_FLASH_NS) % 2 == 0;
+}
+
+/*
+ * alarm_stop()
+ *
+ * Let the thread finish what's queued, then report the trips and
+ * the latencies
+ *
+ */
+void alarm_stop(struct alarms_s *a)
+{
+	const char *lat_name[3] = {"flash", "event", "exec"};
+
+	pthread_mutex_lock(&(a->lock));
+	a->quit = 1;
+	pthread_cond_signal(&(a->wake));
+	pthread_mutex_unlock(&(a->lock));
+	pthread_join(a->thread, NULL);
+
+	if (a->event_fd >= 0)
+		close(a->event_fd);
+
+	for (int i = 0; i < a->count; i++)
+	{
+		if (a->rules[i].trips)
+			fprintf(stderr, "Alarm %s: %lu trips\n", a->rules[i].spec, (unsigned long)a->rules[i].trips);
+	}
+	for (int i = 0; i < 3; i++)
+	{
+		struct alarm_lat_s *l = &(a->lat[i]);
+
+		if (l->n)
+			fprintf(stderr, "Alarm %s latency, reading to action: %lu, min %.3f ms, mean %.3f ms, max %.3f ms\n", lat_name[i],
+					(unsigned long)l->n, l->min_ns / 1e6, l->sum_ns / 1e6 / l->n, l->max_ns / 1e6);
+	}
+	if (a->dropped)
+		fprintf(stderr, "Alarm: %lu events dropped, queue full\n", (unsigned long)a->dropped);
+}
+
+/*
+ * json_ws()
+ *
+ */
+const char *json_ws(const char *p, const char *end)
+{
+	while ((p < end) && ((*p == ' ') || (*p == '\t') || (*p == '\r') || (*p == '\n')))
+		p++;
+
+	return p;
+}
+
+/*
+ * json_skip()
+ *
+ * Past the end of the JSON value at p, NULL if it's cut short.  Only
+ * as much of JSON as the RPC requests need: strings, containers and
+ * anything else up to the next delimiter.
+ *
+ */
+const char *json_skip(const char *p, const char *end)
+{
+	int depth = 0;
+
+	p = json_ws(p, end);
+	if ((p < end) && (*p != '"') && (*p != '{') && (*p != '['))
+	{
+		while ((p < end) && !strchr(",}] \t\r\n", *p))
+			p++;
+		return p;
+	}
+
+	while (p < end)
+	{
+		if (*p == '"')
+		{
+			for (p++; (p < end) && (*p != '"'); p++)
+			{
+				if (*p == '\\')
+					p++;
+			}
+		}
+		else if ((*p == '{') || (*p == '['))
+		{
+			depth++;
+		}
+		else if ((*p == '}') || (*p == ']'))
+		{
+			depth--;
+		}
+		if (p >= end)
+			break;
+		p++;
+		if (depth == 0)
+			return p;
+	}
+
+	return NULL;
+}
+
+/*
+ * json_member()
+ *
+ * Value of a member of the object at obj, NULL if it's not there
+ *
+ */
+const char *json_member(const char *obj, const char *end, const char *key)
+{
+	const char *p;
+	size_t kl = strlen(key);
+
+	if (!obj)
+		return NULL; // eg no params
+	p = json_ws(obj, end);
+	if ((p >= end) || (*p != '{'))
+		return NULL;
+	p++;
+
+	while (1)
+	{
+		const char *k, *v;
+
+		p = json_ws(p, end);
+		if ((p >= end) || (*p != '"'))
+			return NULL;
+		k = p + 1;
+		p = json_skip(p, end);
+		if (!p)
+			return NULL;
+		p = json_ws(p, end);
+		if ((p >= end) || (*p != ':'))
+			return NULL;
+		v = json_ws(p + 1, end);
+		if (((size_t)(p - k) >= kl + 1) && (memcmp(k, key, kl) == 0) && (k[kl] == '"'))
+			return v;
+		p = json_skip(v, end);
+		if (!p)
+			return NULL;
+		p = json_ws(p, end);
+		if ((p >= end) || (*p != ','))
+			return NULL;
+		p++;
+	}
+}
+
+/*
+ * json_string()
+ *
+ * Copy out a string value, 0 if it was one
+ *
+ */
+int json_string(const char *v, const char *end, char *out, size_t size)
+{
+	size_t n = 0;
+
+	if (!v || (v >= end) || (*v != '"'))
+		return -1;
+
+	for (v++; (v < end) && (*v != '"'); v++)
+	{
+		if ((*v == '\\') && (v + 1 < end))
+			v++;
+		if (n + 1 < size)
+			out[n++] = *v;
+	}
+	out[n] = '\0';
+
+	return 0;
+}
+
+/*
+ * json_escape()
+ *
+ * The reverse of json_string(), for text from the user going into
+ * a JSON string; quotes, backslashes and control characters are
+ * escaped.  Truncates to fit
+ *
+ */
+char *json_escape(const char *v, char *out, size_t size)
+{
+	size_t n = 0;
+
+	for (; *v; v++)
+	{
+		unsigned char c = (unsigned char)*v;
+		char esc[8];
+		size_t len;
+
+		if ((c == '"') || (c == '\\'))
+			len = snprintf(esc, sizeof(esc), "\\%c", c);
+		else if (c < 0x20)
+			len = snprintf(esc, sizeof(esc), "\\u%04x", c);
+		else
+		{
+			esc[0] = c;
+			len = 1;
+		}
+		if (n + len + 1 > size)
+			break;
+		memcpy(out + n, esc, len);
+		n += len;
+	}
+	out[n] = '\0';
+
+	return out;
+}
+
+/*
+ * rpc_append()
+ *
+ * Add to a call's result
+ *
+ */
+void rpc_append(struct rpc_call_s *call, const char *d, size_t len)
+{
+	if (call->out_len + len + 1 > call->out_size)
+	{
+		size_t size = call->out_size ? call->out_size : 256;
+		char *p;
+
+		while (call->out_len + len + 1 > size)
+			size *= 2;
+		p = (char *)realloc(call->out, size);
+		if (!p)
+			return;
+		call->out = p;
+		call->out_size = size;
+	}
+	memcpy(call->out + call->out_len, d, len);
+	call->out_len += len;
+	call->out[call->out_len] = '\0';
+}
+
+/*
+ * rpc_error()
+ *
+ * Replace whatever the call had so far with an error, and finish it
+ *
+ */
+void rpc_error(struct rpc_call_s *call, int code, const char *msg)
+{
+	char buf[256];
+	int sz;
+
+	sz = snprintf(buf, sizeof(buf), "\"error\":{\"code\":%d,\"message\":\"%s\"}", code, msg);
+	call->out_len = 0;
+	rpc_append(call, buf, sz);
+	call->state = RPC_CALL_DONE;
+}
+
+/*
+ * rpc_parse_call()
+ *
+ * One request object of a line or batch into a call.  Bad requests
+ * become calls that are already finished with their error.
+ *
+ */
+void rpc_parse_call(struct rpc_call_s *call, const char *obj, const char *end)
+{
+	const char *v, *params;
+	char method[32], str[16];
+
+	memset(call, 0, sizeof(*call));
+	snprintf(call->id, sizeof(call->id), "null");
+	call->timeout_ms = RPC_READ_TIMEOUT_MS;
+
+	if ((v = json_member(obj, end, "id")))
+	{
+		const char *e = json_skip(v, end);
+		if (e && (e - v < (int)sizeof(call->id)))
+			snprintf(call->id, sizeof(call->id), "%.*s", (int)(e - v), v);
+	}
+
+	if (json_string(json_member(obj, end, "method"), end, method, sizeof(method)) != 0)
+	{
+		rpc_error(call, -32600, "Invalid Request");
+		return;
+	}
+	call->notify = !json_member(obj, end, "id");
+
+	params = json_member(obj, end, "params");
+	if ((v = json_member(params, end, "timeout_ms")))
+		call->timeout_ms = atoi(v);
+
+	if (strcmp(method, "set_function") == 0)
+	{
+		call->method = RPC_SET_FUNCTION;
+		call->mode = -1;
+		if (json_string(json_member(params, end, "mode"), end, str, sizeof(str)) == 0)
+		{
+			for (int i = 0; i < MMODES_MAX; i++)
+				if (strcmp(str, mmodes[i].scpi) == 0)
+					call->mode = i;
+		}
+		if (call->mode < 0)
+			rpc_error(call, -32602, "mode must be one of DCV ACV DCI ACI 2WR CAP CONT 4WR DIODE FREQ");
+	}
+	else if (strcmp(method, "set_range") == 0)
+	{
+		call->method = RPC_SET_RANGE;
+		v = json_member(params, end, "range");
+		if (json_string(v, end, str, sizeof(str)) == 0)
+		{
+			if (strcmp(str, "auto") == 0)
+				call->code = RANGE_AUTO;
+			else if (strcmp(str, "hold") == 0)
+				call->code = RANGE_HOLD;
+			else
+				rpc_error(call, -32602, "range must be a code, auto or hold");
+		}
+		else if (v && (*v >= '0') && (*v <= '9'))
+			call->code = atoi(v);
+		else
+			rpc_error(call, -32602, "range must be a code, auto or hold");
+	}
+	else if (strcmp(method, "set_rate") == 0)
+	{
+		call->method = RPC_SET_RATE;
+		if ((json_string(json_member(params, end, "rate"), end, str, sizeof(str)) == 0) && str[0] && !str[1] && strchr(RATES, str[0]))
+			call->rate = str[0];
+		else
+			rpc_error(call, -32602, "rate must be S, M or F");
+	}
+	else if (strcmp(method, "read") == 0)
+	{
+		call->method = RPC_READ;
+		call->n = 1;
+		if ((v = json_member(params, end, "n")))
+			call->n = atoi(v);
+		if ((call->n < 1) || (call->n > RPC_READ_MAX))
+			rpc_error(call, -32602, "n must be 1 to 100000");
+	}
+	else if (strcmp(method, "stats") == 0)
+	{
+		call->method = RPC_STATS;
+		v = json_member(params, end, "reset");
+		call->reset = v && (strncmp(v, "true", 4) == 0);
+	}
+	else if (strcmp(method, "pause") == 0)
+		call->method = RPC_PAUSE;
+	else if (strcmp(method, "resume") == 0)
+		call->method = RPC_RESUME;
+	else if (strcmp(method, "status") == 0)
+		call->method = RPC_STATUS;
+	else
+		rpc_error(call, -32601, "Method not found");
+}
+
+/*
+ * rpc_send()
+ *
+ * As web_send(), but a big read result is allowed to queue
+ *
+ */
+int rpc_send(struct rpc_s *r, struct rpc_client_s *c, const char *d, size_t len)
+{
+	ssize_t sz = 0;
+
+	if (c->out_len == 0)
+	{
+		sz = send(c->fd, d, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sz < 0)
+		{
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+				return -1;
+			sz = 0;
+		}
+		if ((size_t)sz == len)
+			return 0;
+	}
+
+	char *p = (char *)realloc(c->out, c->out_len + (len - sz));
+	if (!p)
+		return -1;
+	c->out = p;
+	memcpy(c->out + c->out_len, d + sz, len - sz);
+	c->out_len += len - sz;
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.ptr = c;
+	epoll_ctl(r->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+
+	return 0;
+}
+
+void rpc_close(struct rpc_s *r, struct rpc_client_s *c)
+{
+	int gen = c->gen + 1;
+
+	epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	free(c->out);
+	for (int i = 0; i < RPC_CALLS_MAX; i++)
+		free(c->calls[i].out);
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+	c->gen = gen; // so main loop answers for the old client are dropped
+}
+
+/*
+ * rpc_respond()
+ *
+ * Every call in the line is done, send the answer: one response, or
+ * an array for a batch.  Notifications (no id) get nothing.
+ *
+ */
+int rpc_respond(struct rpc_s *r, struct rpc_client_s *c)
+{
+	struct rpc_call_s resp;
+	int first = 1, ret = 0;
+
+	memset(&resp, 0, sizeof(resp));
+	if (c->batch)
+		rpc_append(&resp, "[", 1);
+	for (int i = 0; i < c->ncalls; i++)
+	{
+		struct rpc_call_s *call = &(c->calls[i]);
+		char head[128];
+		int sz;
+
+		if (call->notify)
+			continue;
+		sz = snprintf(head, sizeof(head), "%s{\"jsonrpc\":\"2.0\",\"id\":%s,", first ? "" : ",", call->id);
+		rpc_append(&resp, head, sz);
+		rpc_append(&resp, call->out ? call->out : "\"result\":null", call->out ? call->out_len : 14);
+		rpc_append(&resp, "}", 1);
+		first = 0;
+	}
+	if (c->batch)
+		rpc_append(&resp, "]", 1);
+	rpc_append(&resp, "\n", 1);
+
+	if (!first)
+		ret = rpc_send(r, c, resp.out, resp.out_len);
+	free(resp.out);
+
+	for (int i = 0; i < c->ncalls; i++)
+	{
+		free(c->calls[i].out);
+		c->calls[i].out = NULL;
+	}
+	c->ncalls = c->cur = c->batch = 0;
+	c->expect_mode = -1;
+
+	return ret;
+}
+
+/*
+ * rpc_slot()
+ *
+ * Consistent copy of ring slot seq, 0 if it was overwritten
+ *
+ */
+int rpc_slot(struct rpc_s *r, uint64_t seq, struct web_slot_s *copy)
+{
+	struct web_slot_s *slot = &(r->ring[seq & (RPC_RING_SIZE - 1)]);
+
+	if (__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) != seq + 1)
+		return 0;
+	memcpy(copy, slot, sizeof(*copy));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&(slot->seq), __ATOMIC_RELAXED) == seq + 1;
+}
+
+/*
+ * rpc_stats()
+ *
+ * Per mode count, min, max, mean and standard deviation since the
+ * start or the last reset, as a result
+ *
+ */
+void rpc_stats(struct rpc_s *r, struct rpc_call_s *call)
+{
+	char buf[256];
+	int sz, first = 1;
+
+	rpc_append(call, "\"result\":{", 10);
+	for (int i = 0; i <= MMODES_MAX; i++)
+	{
+		struct rpc_stats_s *s = &(r->stats[i]);
+
+		if (s->count == 0)
+			continue;
+		sz = snprintf(buf, sizeof(buf), "%s\"%s\":{\"count\":%lu,\"min\":%.10g,\"max\":%.10g,\"mean\":%.10g,\"sd\":%.10g}",
+					  first ? "" : ",", mmodes[i].scpi, (unsigned long)s->count, s->min, s->max, s->mean,
+					  s->count > 1 ? sqrt(s->m2 / (s->count - 1)) : 0.0);
+		rpc_append(call, buf, sz);
+		first = 0;
+	}
+	rpc_append(call, "}", 1);
+	if (call->reset)
+		memset(r->stats, 0, sizeof(r->stats));
+	call->state = RPC_CALL_DONE;
+}
+
+/*
+ * rpc_feed()
+ *
+ * New readings for a call waiting on them: a read collecting its n,
+ * or a mode switch waiting for the first reading in the new mode
+ *
+ */
+void rpc_feed(struct rpc_s *r, struct rpc_client_s *c, struct rpc_call_s *call)
+{
+	uint64_t head = __atomic_load_n(&(r->head), __ATOMIC_ACQUIRE);
+	struct web_slot_s slot;
+	char buf[SSIZE];
+	int sz;
+
+	if (head - c->next > RPC_RING_SIZE)
+		c->next = head - RPC_RING_SIZE; // lapped, carry on from the oldest
+
+	for (; (c->next < head) && (call->state == RPC_CALL_WAIT); c->next++)
+	{
+		if (!rpc_slot(r, c->next, &slot))
+			continue;
+		if ((c->expect_mode >= 0) && (slot.s.mode_index != c->expect_mode))
+			continue; // the tail of the previous mode
+
+		if (call->method == RPC_SET_FUNCTION)
+		{
+			sz = snprintf(buf, sizeof(buf), "\"result\":{\"mode\":\"%s\",\"ms\":%.1f}", mmodes[call->mode].scpi,
+						  (slot.s.t_ns - call->t_ns) / 1e6);
+			rpc_append(call, buf, sz);
+			call->state = RPC_CALL_DONE;
+			continue;
+		}
+
+		if (call->got)
+			rpc_append(call, ",", 1);
+		sz = sample_json(buf, sizeof(buf), &(slot.s), slot.range, slot.display);
+		rpc_append(call, buf, sz);
+		if (++(call->got) == call->n)
+		{
+			rpc_append(call, "]", 1);
+			call->state = RPC_CALL_DONE;
+		}
+	}
+
+	if ((call->state == RPC_CALL_WAIT) && (now_ns() >= call->deadline_ns))
+	{
+		char msg[64];
+
+		if (call->method == RPC_SET_FUNCTION)
+			snprintf(msg, sizeof(msg), "no reading in the new mode");
+		else
+			snprintf(msg, sizeof(msg), "timeout, %d of %d readings", call->got, call->n);
+		rpc_error(call, -32000, msg);
+	}
+}
+
+/*
+ * rpc_advance()
+ *
+ * Work through a client's calls in order as far as they'll go, and
+ * answer once they're all done
+ *
+ */
+int rpc_advance(struct rpc_s *r, struct rpc_client_s *c)
+{
+	while (c->cur < c->ncalls)
+	{
+		struct rpc_call_s *call = &(c->calls[c->cur]);
+
+		if (call->state == RPC_CALL_NEW)
+		{
+			call->t_ns = now_ns();
+			call->deadline_ns = call->t_ns + (uint64_t)call->timeout_ms * 1000000ULL;
+
+			if (call->method == RPC_READ)
+			{
+				c->next = __atomic_load_n(&(r->head), __ATOMIC_ACQUIRE); // readings from now on
+				call->state = RPC_CALL_WAIT;
+				rpc_append(call, "\"result\":[", 10);
+			}
+			else if (call->method == RPC_STATS)
+			{
+				rpc_stats(r, call);
+			}
+			else
+			{
+				pthread_mutex_lock(&(r->lock));
+				if (r->ops_n < RPC_OPS)
+				{
+					struct rpc_op_s *op = &(r->ops[r->ops_n++]);
+
+					memset(op, 0, sizeof(*op));
+					op->client = c - r->clients;
+					op->gen = c->gen;
+					op->call = c->cur;
+					op->method = call->method;
+					op->mode = call->mode;
+					op->code = call->code;
+					op->rate = call->rate;
+					call->state = RPC_CALL_MAIN;
+				}
+				pthread_mutex_unlock(&(r->lock));
+				if (call->state != RPC_CALL_MAIN)
+					rpc_error(call, -32000, "busy");
+			}
+		}
+
+		if (call->state == RPC_CALL_WAIT)
+			rpc_feed(r, c, call);
+		if (call->state != RPC_CALL_DONE)
+			return 0;
+		c->cur++;
+	}
+
+	return rpc_respond(r, c);
+}
+
+/*
+ * rpc_line()
+ *
+ * A complete request line in, as one call or a batch
+ *
+ */
+void rpc_line(struct rpc_s *r, struct rpc_client_s *c, const char *line, const char *end)
+{
+	const char *p = json_ws(line, end);
+
+	c->ncalls = c->cur = 0;
+	c->expect_mode = -1;
+	c->batch = (p < end) && (*p == '[');
+
+	if (c->batch)
+	{
+		p = json_ws(p + 1, end);
+		while ((p < end) && (*p != ']') && (c->ncalls < RPC_CALLS_MAX))
+		{
+			const char *e = json_skip(p, end);
+			if (!e)
+				break;
+			rpc_parse_call(&(c->calls[c->ncalls++]), p, e);
+			p = json_ws(e, end);
+			if ((p < end) && (*p == ','))
+				p = json_ws(p + 1, end);
+		}
+		r->batches++;
+	}
+	else if ((p < end) && (*p == '{'))
+	{
+		rpc_parse_call(&(c->calls[c->ncalls++]), p, end);
+	}
+
+	if (c->ncalls == 0)
+	{
+		c->batch = 0;
+		rpc_parse_call(&(c->calls[c->ncalls++]), p, p);
+		rpc_error(&(c->calls[0]), -32700, "Parse error");
+	}
+	r->calls += c->ncalls;
+}
+
+/*
+ * rpc_input()
+ *
+ * Take complete lines out of a client's buffer, one plan at a time;
+ * anything after waits until the current plan is answered
+ *
+ */
+int rpc_input(struct rpc_s *r, struct rpc_client_s *c)
+{
+	char *nl;
+
+	while ((c->ncalls == 0) && (nl = (char *)memchr(c->req, '\n', c->req_len)))
+	{
+		size_t n = nl - c->req + 1;
+
+		if (json_ws(c->req, nl) < nl)
+		{
+			rpc_line(r, c, c->req, nl);
+			if (rpc_advance(r, c) != 0)
+				return -1;
+		}
+		memmove(c->req, c->req + n, c->req_len - n);
+		c->req_len -= n;
+	}
+
+	return c->req_len < sizeof(c->req) - 1 ? 0 : -1; // a line that long isn't a request
+}
+
+/*
+ * rpc_collect()
+ *
+ * Main loop answers back to their calls
+ *
+ */
+void rpc_collect(struct rpc_s *r)
+{
+	struct rpc_op_s done[RPC_OPS];
+	int n;
+
+	pthread_mutex_lock(&(r->lock));
+	n = r->done_n;
+	memcpy(done, r->done, n * sizeof(done[0]));
+	r->done_n = 0;
+	pthread_mutex_unlock(&(r->lock));
+
+	for (int i = 0; i < n; i++)
+	{
+		struct rpc_op_s *op = &(done[i]);
+		struct rpc_client_s *c = &(r->clients[op->client]);
+		struct rpc_call_s *call;
+
+		if ((c->fd < 0) || (c->gen != op->gen) || (op->call >= c->ncalls))
+			continue; // went away
+		call = &(c->calls[op->call]);
+		if (call->state != RPC_CALL_MAIN)
+			continue;
+
+		if (op->error)
+		{
+			rpc_error(call, -32000, op->result);
+		}
+		else if (op->method == RPC_SET_FUNCTION)
+		{
+			// done once a reading in the new mode is in
+			c->expect_mode = op->mode;
+			c->next = op->seq;
+			call->state = RPC_CALL_WAIT;
+		}
+		else
+		{
+			rpc_append(call, "\"result\":", 9);
+			rpc_append(call, op->result, strlen(op->result));
+			call->state = RPC_CALL_DONE;
+		}
+	}
+}
+
+/*
+ * rpc_thread()
+ *
+ * Owns the socket and all the clients
+ *
+ */
+void *rpc_thread(void *arg)
+{
+	struct rpc_s *r = (struct rpc_s *)arg;
+	struct epoll_event events[RPC_MAX_CLIENTS + 2];
+
+	int quit = 0;
+
+	r->stats_next = __atomic_load_n(&(r->head), __ATOMIC_ACQUIRE);
+
+	while (!quit)
+	{
+		int n = epoll_wait(r->epoll_fd, events, RPC_MAX_CLIENTS + 2, 100);
+		uint64_t head;
+		struct web_slot_s slot;
+
+		for (int i = 0; i < n; i++)
+		{
+			if (events[i].data.ptr == &(r->listen_fd))
+			{
+				int fd = accept4(r->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+				int k;
+
+				if (fd < 0)
+					continue;
+				for (k = 0; k < RPC_MAX_CLIENTS; k++)
+					if (r->clients[k].fd < 0)
+						break;
+				if (k == RPC_MAX_CLIENTS)
+				{
+					close(fd);
+					continue;
+				}
+
+				struct rpc_client_s *c = &(r->clients[k]);
+				struct epoll_event cev;
+
+				c->fd = fd;
+				c->expect_mode = -1;
+				cev.events = EPOLLIN;
+				cev.data.ptr = c;
+				epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &cev);
+			}
+			else if (events[i].data.ptr == &(r->wake_fd))
+			{
+				uint64_t count;
+
+				if (read(r->wake_fd, &count, sizeof(count)) < 0)
+					continue;
+				pthread_mutex_lock(&(r->lock));
+				quit = r->quit;
+				pthread_mutex_unlock(&(r->lock));
+			}
+			else
+			{
+				struct rpc_client_s *c = (struct rpc_client_s *)events[i].data.ptr;
+
+				if (events[i].events & (EPOLLHUP | EPOLLERR))
+				{
+					rpc_close(r, c);
+					continue;
+				}
+
+				if (events[i].events & EPOLLOUT)
+				{
+					ssize_t sz = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+					if ((sz < 0) && (errno != EAGAIN))
+					{
+						rpc_close(r, c);
+						continue;
+					}
+					if (sz > 0)
+					{
+						memmove(c->out, c->out + sz, c->out_len - sz);
+						c->out_len -= sz;
+					}
+					if (c->out_len == 0)
+					{
+						struct epoll_event cev;
+						cev.events = EPOLLIN;
+						cev.data.ptr = c;
+						epoll_ctl(r->epoll_fd, EPOLL_CTL_MOD, c->fd, &cev);
+					}
+				}
+
+				if (events[i].events & EPOLLIN)
+				{
+					ssize_t sz = recv(c->fd, c->req + c->req_len, sizeof(c->req) - 1 - c->req_len, 0);
+					if (sz <= 0)
+					{
+						if ((sz == 0) || (errno != EAGAIN))
+							rpc_close(r, c);
+						continue;
+					}
+					c->req_len += sz;
+					if (rpc_input(r, c) != 0)
+						rpc_close(r, c);
+				}
+			}
+		}
+
+		/*
+		 * Whatever woke us, readings for the stats and anyone
+		 * waiting on them, answers from the main loop and deadlines
+		 *
+		 */
+		head = __atomic_load_n(&(r->head), __ATOMIC_ACQUIRE);
+		if (head - r->stats_next > RPC_RING_SIZE)
+			r->stats_next = head - RPC_RING_SIZE;
+		for (; r->stats_next < head; r->stats_next++)
+		{
+			struct rpc_stats_s *s;
+			double d;
+
+			if (!rpc_slot(r, r->stats_next, &slot))
+				continue;
+			s = &(r->stats[slot.s.mode_index]);
+			if ((s->count == 0) || (slot.s.v < s->min))
+				s->min = slot.s.v;
+			if ((s->count == 0) || (slot.s.v > s->max))
+				s->max = slot.s.v;
+			s->count++;
+			d = slot.s.v - s->mean;
+			s->mean += d / s->count;
+			s->m2 += d * (slot.s.v - s->mean);
+		}
+
+		rpc_collect(r);
+		for (int k = 0; k < RPC_MAX_CLIENTS; k++)
+		{
+			struct rpc_client_s *c = &(r->clients[k]);
+
+			if ((c->fd >= 0) && (c->ncalls > 0) && ((rpc_advance(r, c) != 0) || (rpc_input(r, c) != 0)))
+				rpc_close(r, c);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * rpc_start()
+ *
+ * Listen on the socket path and start the thread
+ *
+ */
+int rpc_start(struct rpc_s *r)
+{
+	struct sockaddr_un sa;
+	struct epoll_event ev;
+
+	for (int k = 0; k < RPC_MAX_CLIENTS; k++)
+		r->clients[k].fd = -1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (strlen(r->path) >= sizeof(sa.sun_path))
+	{
+		fprintf(stderr, "%s:%d: Socket path '%s' is too long\n", FL, r->path);
+		return -1;
+	}
+	snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", r->path);
+
+	r->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (r->listen_fd < 0)
+		return -1;
+	unlink(r->path); // left behind by a previous run
+	if ((bind(r->listen_fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) || (listen(r->listen_fd, 8) != 0))
+	{
+		fprintf(stderr, "%s:%d: Unable to listen on '%s' (%s)\n", FL, r->path, strerror(errno));
+		close(r->listen_fd);
+		return -1;
+	}
+
+	pthread_mutex_init(&(r->lock), NULL);
+	r->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &(r->listen_fd);
+	epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->listen_fd, &ev);
+	ev.data.ptr = &(r->wake_fd);
+	epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wake_fd, &ev);
+
+	if (pthread_create(&(r->thread), NULL, rpc_thread, r) != 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * rpc_wake()
+ *
+ */
+void rpc_wake(struct rpc_s *r)
+{
+	uint64_t one = 1;
+
+	if (write(r->wake_fd, &one, sizeof(one)) < 0)
+	{
+		// counter saturated, the thread is already due to wake
+	}
+}
+
+/*
+ * rpc_publish()
+ *
+ * Acquisition side, as web_publish()
+ *
+ */
+void rpc_publish(struct rpc_s *r, struct sample_s *s, const char *range, const char *display)
+{
+	uint64_t seq = r->head;
+	struct web_slot_s *slot = &(r->ring[seq & (RPC_RING_SIZE - 1)]);
+
+	__atomic_store_n(&(slot->seq), 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->s = *s;
+	snprintf(slot->range, sizeof(slot->range), "%s", range);
+	snprintf(slot->display, sizeof(slot->display), "%s", display);
+	__atomic_store_n(&(slot->seq), seq + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&(r->head), seq + 1, __ATOMIC_RELEASE);
+
+	rpc_wake(r);
+}
+
+/*
+ * rpc_poll()
+ *
+ * Main loop side, carry out the calls that change the meter or the
+ * polling.  Only ever queues commands, so it never waits on the port.
+ *
+ */
+void rpc_poll(struct glb *g, bool *paused)
+{
+	struct rpc_s *r = g->rpc;
+	struct rpc_op_s ops[RPC_OPS];
+	int n;
+
+	if (!__atomic_load_n(&(r->ops_n), __ATOMIC_RELAXED))
+		return;
+
+	pthread_mutex_lock(&(r->lock));
+	n = r->ops_n;
+	memcpy(ops, r->ops, n * sizeof(ops[0]));
+	r->ops_n = 0;
+	pthread_mutex_unlock(&(r->lock));
+
+	for (int i = 0; i < n; i++)
+	{
+		struct rpc_op_s *op = &(ops[i]);
+		int mi = g->mode_index;
+
+		if (g->replay && (op->method != RPC_PAUSE) && (op->method != RPC_RESUME) && (op->method != RPC_STATUS))
+		{
+			op->error = 1;
+			snprintf(op->result, sizeof(op->result), "replaying a log, there's no meter");
+		}
+		else
+		{
+			switch (op->method)
+			{
+			case RPC_SET_FUNCTION:
+				cmd_user(g, op->mode);
+				break;
+
+			case RPC_SET_RANGE:
+				if (range_codes(mi) == 0)
+				{
+					op->error = 1;
+					snprintf(op->result, sizeof(op->result), "%s has no ranges", mmodes[mi].scpi);
+					break;
+				}
+				if (op->code == RANGE_AUTO)
+					g->rangelock.pending = RANGE_AUTO;
+				if ((op->code == RANGE_HOLD) && (g->range_index < 0))
+				{
+					g->rangelock.pending = RANGE_HOLD; // no range read yet, lock the first one
+					snprintf(op->result, sizeof(op->result), "{\"mode\":\"%s\",\"range\":\"hold\",\"pending\":true}", mmodes[mi].scpi);
+					break;
+				}
+				range_set(g, op->code == RANGE_HOLD ? g->range_index : op->code);
+				if (g->rangelock.locked)
+					snprintf(op->result, sizeof(op->result), "{\"mode\":\"%s\",\"range\":%d}", mmodes[mi].scpi, g->rangelock.code);
+				else
+					snprintf(op->result, sizeof(op->result), "{\"mode\":\"%s\",\"range\":\"auto\"}", mmodes[mi].scpi);
+				break;
+
+			case RPC_SET_RATE:
+				if (!rate_scpi[mi])
+				{
+					op->error = 1;
+					snprintf(op->result, sizeof(op->result), "%s has no reading rate setting", mmodes[mi].scpi);
+					break;
+				}
+				g->rate.want[mi] = op->rate;
+				if (g->rate.known_mode == mi)
+					rate_apply(g, op->rate); // otherwise when the rate is read back
+				snprintf(op->result, sizeof(op->result), "{\"mode\":\"%s\",\"rate\":\"%c\"}", mmodes[mi].scpi, op->rate);
+				break;
+
+			case RPC_PAUSE:
+			case RPC_RESUME:
+				if (*paused != (op->method == RPC_PAUSE))
+				{
+					*paused = op->method == RPC_PAUSE;
+					if (g->replay && !*paused)
+						replay_anchor(g->replay);
+					cmd_abandon(g);
+				}
+				snprintf(op->result, sizeof(op->result), "{\"paused\":%s}", *paused ? "true" : "false");
+				break;
+
+			case RPC_STATUS:
+			{
+				char rate[2] = {g->sample.rate, '\0'};
+
+				snprintf(op->result, sizeof(op->result),
+						 "{\"mode\":\"%s\",\"range\":%d,\"range_locked\":%s,\"rate\":\"%s\",\"readings_per_s\":%.1f,"
+						 "\"paused\":%s,\"timeouts\":%lu,\"resyncs\":%lu}",
+						 mmodes[mi].scpi, g->range_index, g->rangelock.locked ? "true" : "false",
+						 rate, g->rate.sps, *paused ? "true" : "false", (unsigned long)g->cmdq.timeouts, (unsigned long)g->cmdq.resyncs);
+				break;
+			}
+			}
+		}
+		op->seq = __atomic_load_n(&(r->head), __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_lock(&(r->lock));
+	for (int i = 0; (i < n) && (r->done_n < RPC_OPS); i++)
+		r->done[r->done_n++] = ops[i];
+	pthread_mutex_unlock(&(r->lock));
+	rpc_wake(r);
+}
+
+/*
+ * rpc_stop()
+ *
+ */
+void rpc_stop(struct rpc_s *r)
+{
+	uint64_t one = 1;
+
+	unlink(r->path);
+
+	// the thread owns the counters, stop it before reading them
+	pthread_mutex_lock(&(r->lock));
+	r->quit = 1;
+	pthread_mutex_unlock(&(r->lock));
+	if (write(r->wake_fd, &one, sizeof(one)) != sizeof(one))
+		return;
+	pthread_join(r->thread, NULL);
+
+	if (!glbs->quiet)
+		fprintf(stderr, "Control socket %s: %lu calls, %lu batches\n", r->path, (unsigned long)r->calls, (unsigned long)r->batches);
+}
+
+/*
+ * publish_sample()
+ *
+ * Called once for every completed reading, after formatting.
+ * Fills in g->sample and hands it to the enabled outputs.
+ *
+ */
+void publish_sample(struct glb *g)
+{
+	struct sample_s *s = &(g->sample);
+
+	if (!g->replay)
+	{
+		// replay has already put the recorded times in
+		s->t_ns = now_ns();
+		clock_gettime(CLOCK_REALTIME, &(s->wall));
+	}
+	s->v = g->v;
+	s->mode_index = g->mode_index;
+	s->range_index = g->range_index;
+	s->gap = 0;
+	if (g->replay)
+		memset(&(s->acq), 0, sizeof(s->acq));
+	else
+		s->acq = g->acq;
+	if (!g->replay)
+	{
+		s->rate = (g->rate.known_mode == g->mode_index) ? g->rate.active : 0;
+		rate_count(g, s);
+	}
+
+	// replay too, a recorded log integrates from its own timestamps
+	if (g->integ)
+		integ_sample(g, s);
+
+	if (g->cmdq.hotkey_ns && (s->mode_index == g->cmdq.hotkey_mode))
+		cmd_hotkey_reading(g, s);
+
+	// ahead of the alarms, so one tripping on this reading can trigger on it
+	if (g->pretrig)
+		pretrig_sample(g->pretrig, s);
+
+	// then straight to the alarms, protection use wants the shortest path to the action
+	if (g->alarms)
+		alarm_sample(g, s);
+
+	if (g->shm)
+		shm_publish(g, s);
+
+	if (g->output_file)
+		output_file_write(g);
+
+	if (g->logger)
+		logger_sample(g->logger, s);
+
+	if (g->web)
+		web_publish(g->web, s, g->range, g->value);
+
+	if (g->rpc)
+		rpc_publish(g->rpc, s, g->range, g->value);
+
+	if (g->headless)
+	{
+		if (stream_sample(g, s) != 0)
+		{
+			// reader went away, nothing left to do
+			quit_signal = SIGPIPE;
+		}
+	}
+#if USE_SDL
+	else if (g->bar.enabled)
+	{
+		if (bargraph_update(&(g->bar), s))
+			g->frame_dirty = 1;
+	}
+#endif
+}
+
+/*
+ * seq_load()
+ *
+ * Read the step file, see struct sequence_s
+ *
+ */
+int seq_load(struct sequence_s *q)
+{
+	char line[1024];
+	FILE *f;
+	int ln = 0;
+
+	f = fopen(q->path, "r");
+	if (!f)
+	{
+		fprintf(stderr, "%s:%d: Unable to open step file '%s' (%s)\n", FL, q->path, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f))
+	{
+		struct seq_step_s *st;
+		char mode[16], *p, *save;
+		int mi, n;
+
+		ln++;
+		p = line + strspn(line, " \t");
+		if ((*p == '#') || (*p == '\r') || (*p == '\n') || (*p == '\0'))
+			continue;
+
+		if (q->count >= SEQ_STEPS_MAX)
+		{
+			fprintf(stderr, "%s:%d: %s: more than %d steps\n", FL, q->path, SEQ_STEPS_MAX);
+			fclose(f);
+			return -1;
+		}
+		st = &(q->steps[q->count]);
+		memset(st, 0, sizeof(*st));
+		st->samples = 1;
+
+		if (sscanf(p, "%31s %15s %lf %lf %n", st->name, mode, &(st->low), &(st->high), &n) != 4)
+		{
+			fprintf(stderr, "%s:%d: %s:%d: expected <name> <mode> <low> <high>\n", FL, q->path, ln);
+			fclose(f);
+			return -1;
+		}
+		for (mi = 0; mi < MMODES_MAX; mi++)
+		{
+			if (strcasecmp(mode, mmodes[mi].scpi) == 0)
+				break;
+		}
+		if (mi >= MMODES_MAX)
+		{
+			fprintf(stderr, "%s:%d: %s:%d: unknown mode '%s', one of DCV ACV DCI ACI 2WR CAP CONT 4WR DIODE FREQ\n", FL, q->path, ln, mode);
+			fclose(f);
+			return -1;
+		}
+		st->mode_index = mi;
+
+		for (p = strtok_r(p + n, " \t\r\n", &save); p; p = strtok_r(NULL, " \t\r\n", &save))
+		{
+			if (strncmp(p, "samples=", 8) == 0)
+				st->samples = atoi(p + 8);
+			else if (strncmp(p, "settle=", 7) == 0)
+				st->settle_ms = atoi(p + 7);
+			else if (strncmp(p, "stable=", 7) == 0)
+				st->stable = strtod(p + 7, NULL);
+			else
+			{
+				fprintf(stderr, "%s:%d: %s:%d: unknown option '%s'\n", FL, q->path, ln, p);
+				fclose(f);
+				return -1;
+			}
+		}
+		if (st->samples < 1)
+			st->samples = 1;
+		q->count++;
+	}
+	fclose(f);
+
+	if (q->count == 0)
+	{
+		fprintf(stderr, "%s:%d: %s: no steps\n", FL, q->path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * seq_send()
+ *
+ * Queue a query for step i, is_switch marks the one that changes
+ * the function
+ *
+ */
+void seq_send(struct glb *g, struct sequence_s *q, int i, int is_switch)
+{
+	const char *cmd = mmodes[q->steps[i].mode_index].query;
+	struct seq_pending_s *pd = &(q->pipe[(q->pipe_head + q->pipe_len) % SEQ_PIPE_MAX]);
+
+	pd->step = i;
+	pd->is_switch = is_switch;
+	q->pipe_len++;
+	q->queries++;
+
+	if (is_switch)
+		q->steps[i].switch_sent = 1;
+	else
+		q->steps[i].queued++;
+
+	data_write(g, cmd, strlen(cmd));
+}
+
+/*
+ * seq_reply()
+ *
+ * Next reply line from the meter, 0 on success, -1 on a timeout.
+ * Reads whatever has arrived in one go since pipelined replies
+ * tend to come in bursts.
+ *
+ */
+int seq_reply(struct glb *g, struct sequence_s *q, char *out, size_t size)
+{
+	uint64_t deadline = now_ns() + SEQ_REPLY_MS * 1000000ULL;
+
+	while (1)
+	{
+		char *nl = (char *)memchr(q->rx, '\n', q->rx_len);
+		struct pollfd pfd;
+		uint64_t now;
+		ssize_t sz;
+
+		if (nl)
+		{
+			size_t n = nl - q->rx;
+			size_t c = n < size - 1 ? n : size - 1;
+
+			memcpy(out, q->rx, c);
+			out[c] = '\0';
+			if (c && (out[c - 1] == '\r'))
+				out[c - 1] = '\0';
+			memmove(q->rx, nl + 1, q->rx_len - n - 1);
+			q->rx_len -= n + 1;
+			return 0;
+		}
+
+		if (q->rx_len >= sizeof(q->rx) - 1)
+			q->rx_len = 0; // junk without a newline
+
+		now = now_ns();
+		if (now >= deadline)
+			return -1;
+
+		pfd.fd = g->serial_params.fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, (deadline - now) / 1000000ULL + 1) <= 0)
+			continue;
+
+		sz = read(g->serial_params.fd, q->rx + q->rx_len, sizeof(q->rx) - 1 - q->rx_len);
+		if (sz > 0)
+			q->rx_len += sz;
+	}
+}
+
+/*
+ * seq_fill()
+ *
+ * Put as many queries in flight as the pipeline depth allows: the
+ * current step's samples once it has settled, then the next step's
+ * function change.  Returns the ns to wait if the current step is
+ * still settling with nothing in flight, else 0.
+ *
+ */
+uint64_t seq_fill(struct glb *g, struct sequence_s *q, int i)
+{
+	while (q->pipe_len < q->depth)
+	{
+		struct seq_step_s *st = &(q->steps[i]);
+		int immediate = (st->settle_ms == 0) && (st->stable <= 0); // the function change reply is a sample
+		int inflight = st->queued;
+
+		if (!st->switch_sent)
+		{
+			seq_send(g, q, i, 1);
+			continue;
+		}
+
+		if (!st->switched)
+		{
+			if (!immediate)
+				break; // settling starts when the function change is acknowledged
+			inflight++;
+		}
+		else
+		{
+			uint64_t ready = st->t_switch + st->settle_ms * 1000000ULL;
+			uint64_t now = now_ns();
+
+			if (now < ready)
+				return q->pipe_len ? 0 : ready - now;
+
+			// while waiting for readings to agree there's no telling how many are needed
+			if ((st->stable > 0) && !st->settled)
+			{
+				if (st->queued == 0)
+				{
+					seq_send(g, q, i, 0);
+					continue;
+				}
 				break;
+			}
+		}
 
-			default:
-				break;
-			} // switch
+		if (st->accepted + inflight < st->samples)
+		{
+			seq_send(g, q, i, 0);
+			continue;
 		}
+
+		// everything for this step is on its way, start on the next one
+		if ((i + 1 >= q->count) || q->steps[i + 1].switch_sent)
+			break;
+		i++;
 	}
 
 	return 0;
 }
 
 /*
- * open_port()
- *
- * The DM3058E is fixed in the 8n1 parameters but the
- * serial speed can vary between 9600-115200
- *
- * No flow control
+ * seq_accept()
  *
- * Default is 115200
+ */
+void seq_accept(struct seq_step_s *st, double v)
+{
+	if (st->accepted == 0)
+		st->min = st->max = v;
+	if (v < st->min)
+		st->min = v;
+	if (v > st->max)
+		st->max = v;
+	st->sum += v;
+	st->accepted++;
+}
+
+/*
+ * seq_dut()
  *
+ * Run every step against one DUT, then write its result record.
+ * Returns 1 for a pass.
  *
  */
-int open_port(struct glb *g)
+int seq_dut(struct glb *g, struct sequence_s *q, const char *id)
 {
-
-	struct serial_params_s *s = &(g->serial_params);
-	char *p = g->serial_parameters_string;
-	char default_params[] = "115200";
-	int r;
-
-	if (!p)
-		p = default_params;
-
-	if (g->debug)
-		fprintf(stderr, "%s:%d: Attempting to open '%s'\n", FL, s->device);
-	s->fd = open(s->device, O_RDWR | O_NOCTTY | O_NDELAY);
-	if (s->fd < 0)
+	uint64_t t0 = now_ns();
+	struct timespec wall;
+	char reply[READ_BUF_SIZE];
+	char rec[SSIZE * 8];
+	size_t len = 0;
+	int i = 0, pass = 1;
+
+	clock_gettime(CLOCK_REALTIME, &wall);
+	for (int k = 0; k < q->count; k++)
 	{
-		perror(s->device);
+		struct seq_step_s *st = &(q->steps[k]);
+
+		st->switch_sent = st->switched = 0;
+		st->queued = st->accepted = st->settled = 0;
+		st->sum = st->min = st->max = 0;
+		st->error = NULL;
 	}
+	q->pipe_head = q->pipe_len = 0;
 
-	r = flock(s->fd, LOCK_EX | LOCK_NB);
-	if (r == -1)
+	while (i < q->count)
 	{
-		fprintf(stderr, "%s:%d: Unable to set lock on %s, Error '%s'\n", FL, s->device, strerror(errno));
-		return -1;
-	}
+		struct seq_step_s *st = &(q->steps[i]);
+		struct seq_pending_s pd;
+		uint64_t wait;
+		double v;
 
-	fcntl(s->fd, F_SETFL, 0);
-	tcgetattr(s->fd, &(s->oldtp)); // save current serial port settings
-	tcgetattr(s->fd, &(s->newtp)); // save current serial port settings in to what will be our new settings
-	cfmakeraw(&(s->newtp));
+		wait = seq_fill(g, q, i);
+		if (wait)
+		{
+			usleep(wait / 1000ULL);
+			continue;
+		}
 
-	s->newtp.c_cflag = CS8 | CLOCAL | CREAD;
+		if (seq_reply(g, q, reply, sizeof(reply)) != 0)
+		{
+			st->error = "timeout";
+			break;
+		}
+		pd = q->pipe[q->pipe_head];
+		q->pipe_head = (q->pipe_head + 1) % SEQ_PIPE_MAX;
+		q->pipe_len--;
 
-	s->newtp.c_cc[VTIME] = 10;
-	s->newtp.c_cc[VMIN] = 0;
+		st = &(q->steps[pd.step]);
+		v = strtod(reply, NULL);
+		if (pd.is_switch)
+		{
+			st->switched = 1;
+			st->t_switch = now_ns();
+			if ((st->settle_ms == 0) && (st->stable <= 0))
+				seq_accept(st, v);
+			else
+				st->prev = v;
+		}
+		else
+		{
+			st->queued--;
+			if ((st->stable > 0) && !st->settled)
+			{
+				if ((v - st->prev <= st->stable) && (st->prev - v <= st->stable))
+				{
+					st->settled = 1;
+					seq_accept(st, v);
+				}
+				else if (now_ns() - st->t_switch > (st->settle_ms + SEQ_STABLE_MS) * 1000000ULL)
+				{
+					st->error = "unstable";
+					break;
+				}
+				st->prev = v;
+			}
+			else
+				seq_accept(st, v);
+		}
 
-	if (strncmp(p, "115200", 6) == 0)
-		s->newtp.c_cflag |= B115200;
-	else if (strncmp(p, "57600", 5) == 0)
-		s->newtp.c_cflag |= B57600;
-	else if (strncmp(p, "38400", 5) == 0)
-		s->newtp.c_cflag |= B38400;
-	else if (strncmp(p, "19200", 5) == 0)
-		s->newtp.c_cflag |= B19200;
-	else if (strncmp(p, "9600", 4) == 0)
-		s->newtp.c_cflag |= B9600;
-	else
-	{
-		fprintf(stdout, "Invalid serial speed\r\n");
-		exit(1);
+		while ((i < q->count) && (q->steps[i].accepted >= q->steps[i].samples))
+			i++;
 	}
 
-	//  This meter only accepts 8n1, no flow control
-
-	s->newtp.c_iflag &= ~(IXON | IXOFF | IXANY);
-
-	r = tcsetattr(s->fd, TCSANOW, &(s->newtp));
-	if (r)
+	if (i < q->count)
 	{
-		fprintf(stderr, "%s:%d: Error setting terminal (%s)\n", FL, strerror(errno));
-		return -1;
+		// abandoned mid way, whatever is still in flight is junk
+		usleep(SEQ_REPLY_MS * 1000);
+		tcflush(g->serial_params.fd, TCIOFLUSH);
+		q->rx_len = 0;
 	}
 
-	if (g->debug)
-		fprintf(stderr, "Serial port opened, FD[%d]\n", s->fd);
-	return 0;
-}
-
-#define PORT_OK 0
-#define PORT_CANT_LOCK 10
-#define PORT_INVALID 11
-#define PORT_CANT_SET 12
-#define PORT_NO_SUCCESS -1
-
-int find_port(struct glb *g)
-{
-
-	/*
-		For this multimeter, we actually *want* the read to time out
-		because it means that it's not just spewing out data, ie not
-		a SCPI device
-	 */
-	struct serial_params_s *s = &(g->serial_params);
+	uint64_t dt = now_ns() - t0;
+	const char *verdict[SEQ_STEPS_MAX];
+	char esc[SSIZE];
 
-	for (int port_number = 0; port_number < 10; port_number++)
+	for (int k = 0; k < q->count; k++)
 	{
-		snprintf(s->device, sizeof(s->device) - 1, "/dev/ttyUSB%d", port_number);
-		if (g->debug)
-			fprintf(stderr, "Testing port %s\n", s->device);
-		int r = open_port(g);
-		if (r == PORT_OK)
-		{
-			char temp1[100];
-			memset(temp1,'\0',sizeof(temp1));
-			read(s->fd, &temp1, sizeof(temp1));
-			int bytes_read = 0;
-			fd_set set;
-			struct timeval timeout;
-
-			FD_ZERO(&set);
-			FD_SET(s->fd, &set);
+		struct seq_step_s *st = &(q->steps[k]);
 
-			timeout.tv_sec = 0;
-			timeout.tv_usec = 300000; // 0.3 seconds
+		verdict[k] = st->error;
+		if (!verdict[k])
+		{
+			if (st->accepted < st->samples)
+				verdict[k] = "skipped";
+			else if (st->min < st->low)
+				verdict[k] = "low";
+			else if (st->max > st->high)
+				verdict[k] = "high";
+			else
+				verdict[k] = "ok";
+		}
+		if (strcmp(verdict[k], "ok") != 0)
+			pass = 0;
+	}
 
-			{
-				char temp_char	 = 0;
-				int rv;
+	if (g->headless == HEADLESS_JSON)
+		len += snprintf(rec + len, sizeof(rec) - len, "{\"t\":%ld.%06ld,\"dut\":\"%s\",\"result\":\"%s\",\"ms\":%.1f,\"steps\":[",
+						(long)wall.tv_sec, wall.tv_nsec / 1000, json_escape(id, esc, sizeof(esc)), pass ? "PASS" : "FAIL", dt / 1e6);
+	else
+		len += snprintf(rec + len, sizeof(rec) - len, "%s\t%s\t%.1fms", id, pass ? "PASS" : "FAIL", dt / 1e6);
 
-				bytes_read = 0;
-				rv = select(s->fd + 1, &set, NULL, NULL, &timeout);
-				if (g->debug)
-					fprintf(stderr, "select result = %d\n", rv);
-				if (rv == -1)
-				{
-					break;
-				}
-				else if (rv == 0)
-				{
-				}
-				else
-					bytes_read = read(s->fd, &temp_char, sizeof(temp_char));
+	for (int k = 0; (k < q->count) && (len < sizeof(rec)); k++)
+	{
+		struct seq_step_s *st = &(q->steps[k]);
+		double mean = st->accepted ? st->sum / st->accepted : 0.0;
+
+		if (g->headless == HEADLESS_JSON)
+			len += snprintf(rec + len, sizeof(rec) - len, "%s{\"name\":\"%s\",\"mode\":\"%s\",\"n\":%d,\"mean\":%.10g,\"min\":%.10g,\"max\":%.10g,\"low\":%.10g,\"high\":%.10g,\"result\":\"%s\"}",
+							k ? "," : "", json_escape(st->name, esc, sizeof(esc)), mmodes[st->mode_index].scpi, st->accepted, mean, st->min, st->max, st->low, st->high, verdict[k]);
+		else
+			len += snprintf(rec + len, sizeof(rec) - len, "\t%s=%.10g %s", st->name, mean, verdict[k]);
+	}
+	if (len < sizeof(rec))
+		len += snprintf(rec + len, sizeof(rec) - len, g->headless == HEADLESS_JSON ? "]}\n" : "\n");
+	if (len >= sizeof(rec))
+		len = sizeof(rec) - 1;
 
-				if (g->debug)
-					fprintf(stderr, "%d bytes read after select\n", bytes_read);
-				if (bytes_read > 0)
-				{
-					/*
-						not our meter!
-					 */
-					break;
-				}
-				else if ((rv == 0) && (bytes_read == 0))
-				{
-					char buf[100];
+	if (write(STDOUT_FILENO, rec, len) < 0)
+		quit_signal = SIGPIPE;
 
-					if (g->debug)
-						fprintf(stderr, "Testing port with *IDN? query\n");
-					size_t bytes_written = write(s->fd, "*IDN?\r\n", strlen("*IDN?\r\n"));
-					if (bytes_written > 0)
-					{
-						size_t bytes_read = read(s->fd, buf, 99);
-						if (bytes_read > 0)
-						{
-							buf[bytes_read] = '\0';
-							if (g->debug)
-								fprintf(stderr, " %ld bytes read, '%s'\n", bytes_read, buf);
-							if (strstr(buf, "DM3058")||strstr(buf, "DM3068"))
-							{
-								if (g->debug)
-									fprintf(stderr, "Port %s selected\n", s->device);
-								return PORT_OK;
-							}
-						}
-					}
-				}
-			}
+	q->duts++;
+	q->passed += pass;
+	q->total_ns += dt;
 
-			close(s->fd);
-		} // port OK
-	}	  // for each port
-	return PORT_NO_SUCCESS;
+	return pass;
 }
 
 /*
- * data_read()
+ * sequence_run()
  *
- * char *b : buffer for data
- * ssize_t s : size of buffer; function returns if size limit is hit
+ * One DUT per line on stdin until EOF or a signal
  *
  */
-int data_read(glb *g)
+int sequence_run(struct glb *g)
 {
-	int bp = 0;
-	ssize_t bytes_read = 0;
+	struct sequence_s *q = g->sequence;
+	struct sigaction sa;
+	char id[256];
+
+	if (seq_load(q) != 0)
+		return -1;
 
-	do
+	// ctrl-c has to interrupt the wait for the next DUT
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_quit_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	tcflush(g->serial_params.fd, TCIOFLUSH);
+	fprintf(stderr, "Sequencer: %d steps from %s, %d queries in flight, one DUT per line on stdin\n", q->count, q->path, q->depth);
+
+	while (!quit_signal && fgets(id, sizeof(id), stdin))
 	{
-		char temp_char;
-		bytes_read = read(g->serial_params.fd, &temp_char, 1);
-		if (bytes_read)
-		{
-			*(g->bp) = temp_char;
-			if (*(g->bp) == '\n')
-			{
-				g->read_state++; // switch to next read state
-				*(g->bp) = '\0';
-				break;
-			}
+		id[strcspn(id, "\r\n")] = '\0';
+		if (id[0] == '\0')
+			snprintf(id, sizeof(id), "%lu", (unsigned long)q->duts + 1);
+		seq_dut(g, q, id);
+	}
 
-			if (*(g->bp) != '\r')
-			{
-				if (g->debug)
-					fprintf(stderr, "%c", *(g->bp));
-				(g->bp)++;
-				*(g->bp) = '\0';
-				g->bytes_remaining--;
-			}
-		}
-	} while (bytes_read && g->bytes_remaining > 0);
+	if (q->duts)
+		fprintf(stderr, "Sequencer: %lu DUTs, %lu passed, %.1f ms per DUT, %.1f queries per DUT\n", (unsigned long)q->duts,
+				(unsigned long)q->passed, q->total_ns / 1e6 / q->duts, (double)q->queries / q->duts);
 
-	return bp;
+	return 0;
 }
 
 /*
- * data_write()
- *		const char *d : pointer to data to write/send
- *		ssize_t s : number of bytes to send
+ * query_idn()
+ *
+ * Ask the meter who it is, only used at startup before the
+ * polling state machine is running
  *
  */
-int data_write(glb *g, const char *d, ssize_t s)
+int query_idn(struct glb *g)
 {
-	ssize_t sz;
+	int n;
+
+	tcflush(g->serial_params.fd, TCIOFLUSH);
+	if (data_write(g, "*IDN?\r\n", 7) < 0)
+		return -1;
+
+	n = serial_line(g->serial_params.fd, g->idn, sizeof(g->idn), 1000);
+	if (n < 0)
+		g->idn[0] = '\0';
 
 	if (g->debug)
-		fprintf(stderr, "%s:%d: Sending '%s' [%ld bytes]\n", FL, d, s);
-	sz = write(g->serial_params.fd, d, s);
-	if (sz < 0)
-	{
-		g->error_flag = true;
-		fprintf(stdout, "Error sending serial data: %s\n", strerror(errno));
-	}
+		fprintf(stderr, "%s:%d: IDN '%s'\n", FL, g->idn);
 
-	return sz;
+	return n > 0 ? 0 : -1;
 }
 
+#if USE_X11
 /*
  * grab_key()
  *
@@ -670,6 +8715,7 @@ void grab_key(Display *display, Window rootWindow, int keycode, int modifier)
 		XGrabKey(display, keycode, modifier | Mod2Mask | LockMask, rootWindow, false, GrabModeAsync, GrabModeAsync);
 	}
 }
+#endif
 
 /*-----------------------------------------------------------------\
   Date Code:	: 20180127-220307
@@ -691,12 +8737,25 @@ Changes:
 int main(int argc, char **argv)
 {
 
+#if USE_SDL
 	SDL_Event event;
 	SDL_Surface *surface, *surface_2;
-	SDL_Texture *texture, *texture_2;
+	SDL_Texture *texture = NULL, *texture_2 = NULL;
+	int texW = 0, texH = 0, texW2 = 0, texH2 = 0;
+	uint64_t text_t = 0;
+	char shown1[4096], shown2[5000]; // text currently in the textures
+	int flash_shown = 0; // alarm colour currently on screen
+	SDL_Window *window = NULL;
+	SDL_Renderer *renderer = NULL;
+	TTF_Font *font = NULL;
+	TTF_Font *font_small = NULL;
+#endif
+#if USE_X11
+	Display *dpy = NULL;
+	XEvent ev;
+#endif
 
 	struct glb g; // Global structure for passing variables around
-	char tfn[4096];
 	bool quit = false;
 	bool paused = false;
 
@@ -711,14 +8770,53 @@ int main(int argc, char **argv)
 	 * Parse our command line parameters
 	 */
 	parse_parameters(&g, argc, argv);
-	if (g.device == NULL)
+
+#if !USE_SDL
+	if (!g.headless)
+	{
+		fprintf(stderr, "Built without SDL, running headless (-H text)\n");
+		g.headless = HEADLESS_TEXT;
+	}
+#endif
+
+	if (g.sequence)
+	{
+		if (!g.sequence->path)
+		{
+			fprintf(stdout, "-Tp needs a step file, -T <step file>\n");
+			exit(1);
+		}
+		if (g.replay)
+		{
+			fprintf(stdout, "-T drives the meter, it can't be used with -R\n");
+			exit(1);
+		}
+		if (g.rpc || g.proxy)
+		{
+			fprintf(stdout, "-T drives the meter, it can't be used with -J or -X\n");
+			exit(1);
+		}
+		if (!g.headless)
+			g.headless = HEADLESS_TEXT; // the window has nothing to show
+	}
+
+	if (g.replay && g.proxy)
+	{
+		fprintf(stdout, "-X needs the meter, it can't be used with -R\n");
+		exit(1);
+	}
+
+	if (g.replay && !g.replay->path)
 	{
-		fprintf(stdout, "Require valid device (ie, -p /dev/usbtmc2 )\nExiting\n");
+		fprintf(stdout, "-Rs/-Rf need a log to replay, -R <log file>\n");
 		exit(1);
 	}
 
+	if (g.interval < 0)
+		g.interval = (g.headless || g.replay) ? 0 : 100000; // 100ms / 100,000us interval of sleeping between frames
+
 	if (g.debug)
-		fprintf(stdout, "START\n");
+		fprintf(stderr, "START\n");
 
 	g.comms_mode = CMODE_SERIAL;
 	snprintf(g.serial_params.device, PATH_MAX, "%s", g.device);
@@ -732,77 +8830,220 @@ int main(int argc, char **argv)
 	if (g.font_size > 200)
 		g.font_size = 200;
 
-	if (g.output_file)
-		snprintf(tfn, sizeof(tfn), "%s.tmp", g.output_file);
+	if (g.shm_name && (shm_start(&g) != 0))
+		fprintf(stderr, "Shared memory output disabled\n");
 
-	find_port(&g);
-	//		  open_port( &g );
+	signal(SIGINT, handle_quit_signal);
+	signal(SIGTERM, handle_quit_signal);
 
-	Display *dpy = XOpenDisplay(0);
-	Window root = DefaultRootWindow(dpy);
-	XEvent ev;
-	Window grab_window = root;
-
-	// Shift key = ShiftMask / 0x01
-	// CapLocks = LockMask / 0x02
-	// Control = ControlMask / 0x04
-	// Alt = Mod1Mask / 0x08
-	//
-	// Numlock = Mod2Mask / 0x10
-	// Windows key = Mod4Mask / 0x40
-	grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_a), Mod4Mask | Mod1Mask);
-	grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_r), Mod4Mask | Mod1Mask);
-	grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_v), Mod4Mask | Mod1Mask);
-	grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_c), Mod4Mask | Mod1Mask);
-	grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_d), Mod4Mask | Mod1Mask);
-	grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_f), Mod4Mask | Mod1Mask);
-	XSelectInput(dpy, root, KeyPressMask);
+	if (g.web && (web_start(g.web) != 0))
+	{
+		fprintf(stderr, "Web view disabled\n");
+		free(g.web);
+		g.web = NULL;
+	}
+	if (g.proxy && (proxy_start(g.proxy) != 0))
+		exit(1);
+	if (g.rpc && (rpc_start(g.rpc) != 0))
+	{
+		fprintf(stderr, "Control socket disabled\n");
+		free(g.rpc);
+		g.rpc = NULL;
+	}
+	if (g.headless)
+		signal(SIGPIPE, SIG_IGN);
+
+	if (g.alarms && (alarm_start(g.alarms) != 0))
+		exit(1);
+	for (int i = 0; g.alarms && !g.pretrig && (i < g.alarms->count); i++)
+	{
+		if (g.alarms->rules[i].actions & ALARM_ACT_CAPTURE)
+			fprintf(stderr, "Alarm %s: :capture needs -P <file prefix>\n", g.alarms->rules[i].spec);
+	}
 
 	/*
-	 * Setup SDL2 and fonts
+	 * If we were given a port, use it directly rather than
+	 * probing every ttyUSB, saves up to 3s at startup
 	 *
 	 */
+	if (g.replay)
+	{
+		if (replay_open(&g) != 0)
+			exit(1);
+	}
+	else if (g.device[0] != '\0')
+	{
+		if (open_port(&g) != PORT_OK)
+		{
+			fprintf(stderr, "Unable to open %s\n", g.device);
+			exit(1);
+		}
+		if (g.serial_params.probe && (serial_probe(&g) != 0))
+			fprintf(stderr, "No *IDN? reply from %s at any rate the meter offers, staying at %d baud\n", g.device, g.serial_params.baud);
+	}
+	else if (find_port(&g) != PORT_OK)
+	{
+		fprintf(stderr, "No DM3058/DM3068 answered *IDN? on /dev/ttyUSB0-%d, use -p <port>\n", SERIAL_PROBE_PORTS - 1);
+		exit(1);
+	}
+
+	if (g.serial_fastest && !g.replay)
+		serial_fastest(&g);
+
+	if (g.logger)
+	{
+		if (!g.logger->path)
+		{
+			fprintf(stdout, "-Ls needs a log file, -L <log file>\n");
+			exit(1);
+		}
+		if ((g.idn[0] == '\0') && !g.replay)
+			query_idn(&g);
+		g.logger->idn = g.idn;
+		g.logger->integ = (g.integ != NULL);
+		if (logger_start(g.logger) != 0)
+			exit(1);
+	}
 
-	SDL_Init(SDL_INIT_VIDEO);
-	TTF_Init();
-	TTF_Font *font = TTF_OpenFont("RobotoMono-Regular.ttf", g.font_size);
-	TTF_Font *font_small = TTF_OpenFont("RobotoMono-Regular.ttf", g.font_size / 2);
+	if (g.pretrig)
+	{
+		if (!g.pretrig->prefix)
+		{
+			fprintf(stdout, "-Pb/-Pa/-Pm need somewhere to write, -P <file prefix>\n");
+			exit(1);
+		}
+		if ((g.idn[0] == '\0') && !g.replay)
+			query_idn(&g);
+		g.pretrig->idn = g.idn;
+		if (pretrig_start(g.pretrig) != 0)
+			exit(1);
+	}
 
 	/*
-	 * Get the required window size.
-	 *
-	 * Parameters passed can override the font self-detect sizing
+	 * The sequencer drives the meter itself, by the time it returns
+	 * there's nothing left to do but clean up
 	 *
 	 */
-	TTF_SizeText(font, " 00.0000V DCAC ", &g.window_width, &g.window_height);
-	g.window_height *= 1.85;
-
-	if (g.wx_forced)
-		g.window_width = g.wx_forced;
-	if (g.wy_forced)
-		g.window_height = g.wy_forced;
+	if (g.sequence)
+	{
+		sequence_run(&g);
+		quit = true;
+	}
 
-	SDL_Window *window = SDL_CreateWindow("DM3058E", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, g.window_width, g.window_height, 0);
-	SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
-	if (!font)
+#if USE_X11
+	if (!g.headless && !g.replay)
 	{
-		fprintf(stderr, "Error trying to open font :( \r\n");
-		exit(1);
+		dpy = XOpenDisplay(0);
+		if (!dpy)
+		{
+			fprintf(stderr, "Unable to open X display, hotkeys disabled\n");
+		}
+		else
+		{
+			Window root = DefaultRootWindow(dpy);
+			Window grab_window = root;
+
+			// Shift key = ShiftMask / 0x01
+			// CapLocks = LockMask / 0x02
+			// Control = ControlMask / 0x04
+			// Alt = Mod1Mask / 0x08
+			//
+			// Numlock = Mod2Mask / 0x10
+			// Windows key = Mod4Mask / 0x40
+			grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_a), Mod4Mask | Mod1Mask);
+			grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_r), Mod4Mask | Mod1Mask);
+			grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_v), Mod4Mask | Mod1Mask);
+			grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_c), Mod4Mask | Mod1Mask);
+			grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_d), Mod4Mask | Mod1Mask);
+			grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_f), Mod4Mask | Mod1Mask);
+			grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_l), Mod4Mask | Mod1Mask);
+			grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_n), Mod4Mask | Mod1Mask);
+			grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_z), Mod4Mask | Mod1Mask);
+			grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_Up), Mod4Mask | Mod1Mask);
+			grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_Down), Mod4Mask | Mod1Mask);
+			XSelectInput(dpy, root, KeyPressMask);
+		}
 	}
-	SDL_RendererInfo info;
-	SDL_GetRendererInfo(renderer, &info);
-	fprintf(stderr, "Renderer Information --\n"
-					"Name: %s\n"
-					"Flags: %lX\n"
-					"%s%s%s%s\n"
-					"---\n",
-			info.name, info.flags, info.flags & SDL_RENDERER_SOFTWARE ? "Software" : "", info.flags & SDL_RENDERER_ACCELERATED ? "Accelerated" : "", info.flags & SDL_RENDERER_PRESENTVSYNC ? "Vsync Sync" : "", info.flags & SDL_RENDERER_TARGETTEXTURE ? "Target texture supported" : "");
+#endif
+
+#if USE_SDL
+	if (!g.headless)
+	{
+		/*
+		 * Setup SDL2 and fonts
+		 *
+		 */
 
-	/* Select the color for drawing. It is set to red here. */
-	SDL_SetRenderDrawColor(renderer, g.background_color.r, g.background_color.g, g.background_color.b, 255);
+		SDL_Init(SDL_INIT_VIDEO);
+		TTF_Init();
+		if (g.font_medium)
+			font = TTF_OpenFontRW(SDL_RWFromConstMem(font_robotomono_medium, FONT_SIZE(font_robotomono_medium)), 1, g.font_size);
+		else
+			font = TTF_OpenFontRW(SDL_RWFromConstMem(font_robotomono_regular, FONT_SIZE(font_robotomono_regular)), 1, g.font_size);
+		font_small = TTF_OpenFontRW(SDL_RWFromConstMem(font_robotomono_regular, FONT_SIZE(font_robotomono_regular)), 1, g.font_size / 2);
+		if (!font || !font_small)
+		{
+			fprintf(stderr, "Error trying to open font :( \r\n");
+			exit(1);
+		}
 
-	/* Clear the entire screen to our selected color. */
-	SDL_RenderClear(renderer);
+		/*
+		 * Get the required window size.
+		 *
+		 * The font is monospaced and embedded, so the size of
+		 * " 00.0000V DCAC " follows straight from its metrics
+		 *
+		 * Parameters passed can override the font self-detect sizing
+		 *
+		 */
+		const struct font_layout_s *fl = font_layout(g.font_size);
+		g.window_width = fl->advance * (sizeof(" 00.0000V DCAC ") - 1);
+		g.window_height = fl->height * 1.85;
+
+		int bar_h = g.bar.enabled ? fl->height / 5 : 0;
+		g.window_height += bar_h;
+
+		if (g.wx_forced)
+			g.window_width = g.wx_forced;
+		if (g.wy_forced)
+			g.window_height = g.wy_forced;
+
+		if (g.bar.enabled)
+			bargraph_layout(&(g.bar), fl->advance / 2, g.window_height - bar_h - (bar_h / 4), g.window_width - fl->advance, bar_h);
+
+		Uint32 window_flags = 0;
+		if (g.overlay)
+			window_flags |= SDL_WINDOW_BORDERLESS | SDL_WINDOW_ALWAYS_ON_TOP | SDL_WINDOW_SKIP_TASKBAR;
+
+		window = SDL_CreateWindow("DM3058E", g.wpx < 0 ? SDL_WINDOWPOS_UNDEFINED : g.wpx, g.wpy < 0 ? SDL_WINDOWPOS_UNDEFINED : g.wpy, g.window_width, g.window_height, window_flags);
+		renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+#if USE_X11
+		if (g.overlay)
+			overlay_setup(&g, window);
+#else
+		if (g.overlay)
+		{
+			fprintf(stderr, "%s:%d: overlay needs an X11 window, built with USE_X11=0 so it isn't click-through\n", FL);
+			if (g.overlay_opacity < 1.0)
+				SDL_SetWindowOpacity(window, g.overlay_opacity);
+		}
+#endif
+		SDL_RendererInfo info;
+		SDL_GetRendererInfo(renderer, &info);
+		fprintf(stderr, "Renderer Information --\n"
+						"Name: %s\n"
+						"Flags: %X\n"
+						"%s%s%s%s\n"
+						"---\n",
+				info.name, info.flags, info.flags & SDL_RENDERER_SOFTWARE ? "Software" : "", info.flags & SDL_RENDERER_ACCELERATED ? "Accelerated" : "", info.flags & SDL_RENDERER_PRESENTVSYNC ? "Vsync Sync" : "", info.flags & SDL_RENDERER_TARGETTEXTURE ? "Target texture supported" : "");
+
+		/* Select the color for drawing. It is set to red here. */
+		SDL_SetRenderDrawColor(renderer, g.background_color.r, g.background_color.g, g.background_color.b, 255);
+
+		/* Clear the entire screen to our selected color. */
+		SDL_RenderClear(renderer);
+	}
+#endif
 
 	/*
 	 *
@@ -813,10 +9054,25 @@ int main(int argc, char **argv)
 	char line1[4096];
 	char line2[5000];
 
+	line1[0] = '\0';
+	line2[0] = '\0';
+#if USE_SDL
+	shown1[0] = '\0';
+	shown2[0] = '\0';
+#endif
+
 	while (!quit)
 	{
 
-		if (!paused && !quit)
+		if (quit_signal)
+		{
+			if (g.debug)
+				fprintf(stderr, "Signal %d, quitting\n", (int)quit_signal);
+			quit = true;
+		}
+
+#if USE_X11
+		if (dpy && !paused && !quit)
 		{
 			if (XCheckMaskEvent(dpy, KeyPressMask, &ev))
 			{
@@ -830,33 +9086,49 @@ int main(int argc, char **argv)
 					ks = XkbKeycodeToKeysym(dpy, ev.xkey.keycode, 0, 0);
 					if (g.debug)
 						fprintf(stderr, "Hot key pressed %X => %lx!\n", ev.xkey.keycode, ks);
-					if (g.read_state != READSTATE_NONE && g.read_state != READSTATE_DONE)
-					{
-						data_read(&g);
-					}
-					g.read_state = READSTATE_NONE; // TO PREVENT NEXT MEAS COMMAND TO SWITCH THE RANGE BACK
+					/*
+					 * Only queued here, the mode switch goes out ahead of
+					 * the polling on this pass through the loop and the
+					 * reply to any poll in flight is dropped when it comes
+					 *
+					 */
 					switch (ks)
 					{
 					case XK_r:
-						data_write(&g, mmodes[MMODES_RES].query, strlen(mmodes[MMODES_RES].query));
+						cmd_user(&g, MMODES_RES);
 						break;
 					case XK_v:
-						data_write(&g, mmodes[MMODES_VOLT_DC].query, strlen(mmodes[MMODES_VOLT_DC].query));
+						cmd_user(&g, MMODES_VOLT_DC);
 						break;
 					case XK_a:
-						data_write(&g, mmodes[MMODES_VOLT_AC].query, strlen(mmodes[MMODES_VOLT_AC].query));
+						cmd_user(&g, MMODES_VOLT_AC);
 						break;
 					case XK_c:
-						data_write(&g, mmodes[MMODES_CONT].query, strlen(mmodes[MMODES_CONT].query));
+						cmd_user(&g, MMODES_CONT);
 						break;
 					case XK_d:
-						data_write(&g, mmodes[MMODES_DIOD].query, strlen(mmodes[MMODES_DIOD].query));
+						cmd_user(&g, MMODES_DIOD);
 						break;
 					case XK_u:
-						data_write(&g, mmodes[MMODES_CAP].query, strlen(mmodes[MMODES_CAP].query));
+						cmd_user(&g, MMODES_CAP);
 						break;
 					case XK_f:
-						data_write(&g, mmodes[MMODES_FREQ].query, strlen(mmodes[MMODES_FREQ].query));
+						cmd_user(&g, MMODES_FREQ);
+						break;
+					case XK_l:
+						range_toggle(&g);
+						break;
+					case XK_n:
+						rate_cycle(&g);
+						break;
+					case XK_z:
+						math_null(&g);
+						break;
+					case XK_Up:
+						range_step(&g, 1);
+						break;
+					case XK_Down:
+						range_step(&g, -1);
 						break;
 					default:
 						break;
@@ -868,8 +9140,10 @@ int main(int argc, char **argv)
 				}
 			} // check mask
 		}
+#endif
 
-		while (SDL_PollEvent(&event))
+#if USE_SDL
+		while (!g.headless && SDL_PollEvent(&event))
 		{
 			switch (event.type)
 			{
@@ -882,31 +9156,102 @@ int main(int argc, char **argv)
 				if (event.key.keysym.sym == SDLK_p)
 				{
 					paused ^= 1;
-					g.read_state = READSTATE_NONE; // TO PREVENT NEXT MEAS COMMAND TO SWITCH THE RANGE BACK
-												   ////if (paused == true)
-												   // data_write( &g, SCPI_LOCAL, strlen(SCPI_LOCAL) ); //RIGOL DOESNT SUPPORT THAT
+					if (g.replay && !paused)
+						replay_anchor(g.replay);
+					cmd_abandon(&g); // TO PREVENT NEXT MEAS COMMAND TO SWITCH THE RANGE BACK
+									 ////if (paused == true)
+									 // data_write( &g, SCPI_LOCAL, strlen(SCPI_LOCAL) ); //RIGOL DOESNT SUPPORT THAT
+				}
+				if ((event.key.keysym.sym == SDLK_t) && g.pretrig)
+					pretrig_fire(g.pretrig, "key");
+				if (event.key.keysym.sym == SDLK_z)
+					math_null(&g);
+				if (!g.replay)
+				{
+					switch (event.key.keysym.sym)
+					{
+					case SDLK_l:
+						range_toggle(&g);
+						break;
+					case SDLK_n:
+						rate_cycle(&g);
+						break;
+					case SDLK_UP:
+						range_step(&g, 1);
+						break;
+					case SDLK_DOWN:
+						range_step(&g, -1);
+						break;
+					}
+				}
+				if (g.replay)
+				{
+					switch (event.key.keysym.sym)
+					{
+					case SDLK_LEFT:
+						replay_key(g.replay, -10, 0);
+						break;
+					case SDLK_RIGHT:
+						replay_key(g.replay, 10, 0);
+						break;
+					case SDLK_PAGEUP:
+						replay_key(g.replay, -600, 0);
+						break;
+					case SDLK_PAGEDOWN:
+						replay_key(g.replay, 600, 0);
+						break;
+					case SDLK_EQUALS:
+					case SDLK_PLUS:
+					case SDLK_KP_PLUS:
+						replay_key(g.replay, 0, 1);
+						break;
+					case SDLK_MINUS:
+					case SDLK_KP_MINUS:
+						replay_key(g.replay, 0, -1);
+						break;
+					}
 				}
 				break;
+			case SDL_WINDOWEVENT:
+				g.frame_dirty = 1;
+				break;
 			case SDL_QUIT:
 				quit = true;
 				break;
 			}
 		}
+#endif
+
+		if (g.rpc)
+			rpc_poll(&g, &paused);
 
 		if (!paused && !quit)
 		{
 
-			if (g.read_state != READSTATE_NONE && g.read_state != READSTATE_DONE)
+			if (g.replay)
+			{
+				if ((replay_step(&g) < 0) && g.headless)
+					quit = true;
+			}
+			else
 			{
-				data_read(&g);
+				if (g.proxy)
+					proxy_poll(&g);
+				cmd_flush(&g);
+				cmd_expire(&g);
+				if (g.cmdq.n > 0)
+					data_read(&g);
 			}
 
 			switch (g.read_state)
 			{
 			case READSTATE_NONE:
-				tcflush(g.serial_params.fd, TCIOFLUSH); // clear buffer TO PREVENT NEX READ ERROR
 			case READSTATE_DONE:
-				data_write(&g, SCPI_MEAS, strlen(SCPI_MEAS));
+				if (g.cmdq.n > 0)
+					break; // a user command's reply is still to come
+				if (g.read_state == READSTATE_NONE)
+					tcflush(g.serial_params.fd, TCIFLUSH); // clear buffer TO PREVENT NEX READ ERROR, not output, a setting may still be going out
+				poll_write(&g, SCPI_MEAS);
 				g.bp = g.read_buffer;
 				*(g.bp) = '\0';
 				g.bytes_remaining = READ_BUF_SIZE;
@@ -919,7 +9264,7 @@ int main(int argc, char **argv)
 				{
 					if (g.debug)
 						fprintf(stderr, "%s: NO NEW MEASURMENT COMPLETE\n", g.read_buffer);
-					data_write(&g, SCPI_MEAS, strlen(SCPI_MEAS));
+					poll_write(&g, SCPI_MEAS);
 					g.bp = g.read_buffer;
 					*(g.bp) = '\0';
 					g.bytes_remaining = READ_BUF_SIZE;
@@ -929,12 +9274,17 @@ int main(int argc, char **argv)
 				{
 					if (g.debug)
 						fprintf(stderr, "%s: WE HAVE A NEW MEASUREMENT\n", g.read_buffer);
-					data_write(&g, SCPI_FUNC, strlen(SCPI_FUNC));
+					poll_write(&g, SCPI_FUNC);
 					g.bp = g.read_buffer;
 					*(g.bp) = '\0';
 					g.bytes_remaining = READ_BUF_SIZE;
 					g.read_state = READSTATE_READING_FUNCTION;
 				}
+				if (g.read_state == READSTATE_FINISHED_MEASURE)
+				{
+					// neither, eg the tail of a reply cut short; poll again
+					g.read_state = READSTATE_NONE;
+				}
 				break;
 
 			case READSTATE_FINISHED_FUNCTION:
@@ -955,12 +9305,23 @@ int main(int argc, char **argv)
 				if (mi == MMODES_MAX)
 				{
 					fprintf(stderr, "%s:%d: Unknown mode '%s'\n", FL, g.read_buffer);
+					g.read_state = READSTATE_NONE;
 					continue;
 				}
 
 				g.mode_index = mi;
 
-				data_write(&g, mmodes[mi].query, strlen(mmodes[mi].query));
+				if (rate_due(&g))
+				{
+					poll_write(&g, rate_due(&g));
+					g.read_state = READSTATE_READING_RATE;
+					g.bp = g.read_buffer;
+					*(g.bp) = '\0';
+					g.bytes_remaining = READ_BUF_SIZE;
+					break;
+				}
+
+				poll_write(&g, mmodes[mi].query);
 				g.read_state = READSTATE_READING_VAL;
 				g.bp = g.read_buffer;
 				*(g.bp) = '\0';
@@ -969,12 +9330,20 @@ int main(int argc, char **argv)
 
 			case READSTATE_FINISHED_VAL:
 				g.v = strtod(g.read_buffer, NULL);
+				acq_estimate(&g);
 				snprintf(g.value, sizeof(g.value), "%f", g.v);
-				if (strcmp(mmodes[mi].range, SKIP) == 0)
+				if (strcmp(mmodes[g.mode_index].range, SKIP) == 0)
+				{
+					g.range_index = -1;
 					g.read_state = READSTATE_FINISHED_ALL;
+				}
+				else if (range_skip(&g))
+				{
+					g.read_state = READSTATE_FINISHED_ALL; // locked, the range is known
+				}
 				else
 				{
-					data_write(&g, mmodes[mi].range, strlen(mmodes[mi].range));
+					poll_write(&g, mmodes[g.mode_index].range);
 					g.read_state = READSTATE_READING_RANGE;
 					g.bp = g.read_buffer;
 					*(g.bp) = '\0';
@@ -984,6 +9353,8 @@ int main(int argc, char **argv)
 
 			case READSTATE_FINISHED_RANGE:
 				snprintf(g.range, sizeof(g.range), "%s", g.read_buffer);
+				g.range_index = atoi(g.read_buffer);
+				range_check(&g);
 				// RIGOL DOESNT SUPPORT CONT MODE TRESHOLD READ
 				//  if (g.mode_index == MMODES_CONT)
 				//  {
@@ -1004,6 +9375,59 @@ int main(int argc, char **argv)
 				g.read_state = READSTATE_FINISHED_ALL;
 				break;
 
+			case READSTATE_FINISHED_RATE:
+				if (rate_reply(&g))
+				{
+					g.read_state = READSTATE_NONE; // setting it, read after it's sent
+					break;
+				}
+				poll_write(&g, mmodes[g.mode_index].query);
+				g.read_state = READSTATE_READING_VAL;
+				g.bp = g.read_buffer;
+				*(g.bp) = '\0';
+				g.bytes_remaining = READ_BUF_SIZE;
+				break;
+
+			case READSTATE_TIMEOUT:
+				/*
+				 * No reply by the deadline.  Ask again, and if that
+				 * goes unanswered too start over from a clean slate
+				 *
+				 */
+				if ((g.cmdq.retries < CMD_RETRIES) && !cmd_forget(&g))
+				{
+					g.cmdq.retries++;
+					g.bp = g.read_buffer;
+					*(g.bp) = '\0';
+					g.bytes_remaining = READ_BUF_SIZE;
+					poll_write(&g, g.cmdq.poll_cmd);
+					g.read_state = g.cmdq.timeout_state;
+				}
+				else if (g.read_state == READSTATE_TIMEOUT)
+				{
+					cmd_resync(&g); // out of retries, cmd_forget() didn't already
+				}
+				break;
+
+			case READSTATE_RESYNC:
+				if (now_ns() >= g.cmdq.resync_until)
+					g.read_state = READSTATE_NONE;
+				else
+					usleep(10000);
+				break;
+
+			case READSTATE_READING_MEASURE:
+			case READSTATE_READING_FUNCTION:
+			case READSTATE_READING_VAL:
+			case READSTATE_READING_RANGE:
+			case READSTATE_READING_CONTLIMIT:
+			case READSTATE_READING_RATE:
+				break; // reply still on its way, data_read() didn't wait past a UI tick
+
+			case READSTATE_REPLAY:
+			case READSTATE_FINISHED_ALL: // replay reading due
+				break;
+
 			case READSTATE_ERROR:
 			default:
 				snprintf(g.range, sizeof(g.range), "---");
@@ -1018,229 +9442,37 @@ int main(int argc, char **argv)
 			{
 				g.read_state = READSTATE_DONE;
 
-				switch (g.mode_index)
-				{
-				case MMODES_VOLT_DC:
-					if (strcmp(g.range, "0") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 07.3f mV DC", g.v * 1000.0);
-						snprintf(g.range, sizeof(g.range), "200mV");
-					}
-					else if (strcmp(g.range, "1") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 07.5f V DC", g.v);
-						snprintf(g.range, sizeof(g.range), "2V");
-					}
-					else if (strcmp(g.range, "2") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 07.4f V DC", g.v);
-						snprintf(g.range, sizeof(g.range), "20V");
-					}
-					else if (strcmp(g.range, "3") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 07.3f V DC", g.v);
-						snprintf(g.range, sizeof(g.range), "200V");
-					}
-					else if (strcmp(g.range, "4") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 07.2f V DC", g.v);
-						snprintf(g.range, sizeof(g.range), "1000V");
-					}
-					break;
-
-				case MMODES_VOLT_AC:
-					if (strcmp(g.range, "0") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 07.3f mV AC", g.v * 1000.0);
-						snprintf(g.range, sizeof(g.range), "200mV");
-					}
-					else if (strcmp(g.range, "1") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 07.5f V AC", g.v);
-						snprintf(g.range, sizeof(g.range), "2V");
-					}
-					else if (strcmp(g.range, "2") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 07.4f V AC", g.v);
-						snprintf(g.range, sizeof(g.range), "20V");
-					}
-					else if (strcmp(g.range, "3") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 07.3f V AC", g.v);
-						snprintf(g.range, sizeof(g.range), "200V");
-					}
-					else if (strcmp(g.range, "4") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 07.2f V AC", g.v);
-						snprintf(g.range, sizeof(g.range), "750V");
-					}
-					break;
-
-				case MMODES_CURR_DC:
-					if (strcmp(g.range, "0") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 07.2f uA DC", g.v * 1000.0);
-						snprintf(g.range, sizeof(g.range), "20uA");
-					}
-					else if (strcmp(g.range, "1") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 07.4f mA DC", g.v);
-						snprintf(g.range, sizeof(g.range), "2mA");
-					}
-					else if (strcmp(g.range, "2") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 07.4f mA DC", g.v);
-						snprintf(g.range, sizeof(g.range), "20mA");
-					}
-					else if (strcmp(g.range, "3") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 07.2f mA DC", g.v);
-						snprintf(g.range, sizeof(g.range), "200mA");
-					}
-					else if (strcmp(g.range, "4") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 07.1f A DC", g.v);
-						snprintf(g.range, sizeof(g.range), "2A");
-					}
-					else if (strcmp(g.range, "5") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 07.1f A DC", g.v);
-						snprintf(g.range, sizeof(g.range), "10A");
-					}
-					break;
-				case MMODES_CURR_AC:
-					if (strcmp(g.range, "0") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 07.2f mA AC", g.v * 1000.0);
-						snprintf(g.range, sizeof(g.range), "20mA");
-					}
-					else if (strcmp(g.range, "1") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 07.4f mA AC", g.v);
-						snprintf(g.range, sizeof(g.range), "200mA");
-					}
-					else if (strcmp(g.range, "2") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 07.4f A AC", g.v);
-						snprintf(g.range, sizeof(g.range), "2A");
-					}
-					else if (strcmp(g.range, "3") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 07.2f A AC", g.v);
-						snprintf(g.range, sizeof(g.range), "10A");
-					}
-
-				case MMODES_RES:
-				case MMODES_FRES:
-					if (strcmp(g.range, "0") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "%06.3f %s", g.v, oo);
-						snprintf(g.range, sizeof(g.range), "200%s", oo);
-					}
-					else if (strcmp(g.range, "1") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "%06.5f k%s", g.v / 1000, oo);
-						snprintf(g.range, sizeof(g.range), "2K%s", oo);
-					}
-					else if (strcmp(g.range, "2") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "%06.4f k%s", g.v / 1000, oo);
-						snprintf(g.range, sizeof(g.range), "20K%s", oo);
-					}
-					else if (strcmp(g.range, "3") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "%06.3f k%s", g.v / 1000, oo);
-						snprintf(g.range, sizeof(g.range), "200K%s", oo);
-					}
-					else if (strcmp(g.range, "4") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "%06.5f M%s", g.v / 1000000, oo);
-						snprintf(g.range, sizeof(g.range), "1M%s", oo);
-					}
-					else if (strcmp(g.range, "5") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "%06.4f M%s", g.v / 1000000, oo);
-						snprintf(g.range, sizeof(g.range), "10M%s", oo);
-					}
-					else if (strcmp(g.range, "6") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "%06.3f M%s", g.v / 1000000, oo);
-						snprintf(g.range, sizeof(g.range), "100M%s", oo);
-					}
-
-					if (g.v >= 9000000000000000.000000)
-						snprintf(g.value, sizeof(g.value), "O.L");
-					break;
-
-				case MMODES_CAP:
-					if (strcmp(g.range, "0") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 6.3f nF", g.v * 1E+9);
-						snprintf(g.range, sizeof(g.range), "2nF");
-					}
-					else if (strcmp(g.range, "1") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 06.2f nF", g.v * 1E+9);
-						snprintf(g.range, sizeof(g.range), "20nF");
-					}
-					else if (strcmp(g.range, "2") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 06.1f nF", g.v * 1E+9);
-						snprintf(g.range, sizeof(g.range), "200nF");
-					}
-					else if (strcmp(g.range, "3") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 06.3f %sF", g.v * 1E+6, uu);
-						snprintf(g.range, sizeof(g.range), "2%sF", uu);
-					}
-					else if (strcmp(g.range, "4") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 06.2f %sF", g.v * 1E+6, uu);
-						snprintf(g.range, sizeof(g.range), "200%sF", uu);
-					}
-					else if (strcmp(g.range, "5") == 0)
-					{
-						snprintf(g.value, sizeof(g.value), "% 06.3f %sF", g.v * 1E+6, uu);
-						snprintf(g.range, sizeof(g.range), "100000%sF", uu);
-					}
-					if (g.v >= 51000000000000)
-						snprintf(g.value, sizeof(g.value), "O.L");
-					break;
+				math_reading(&g);
 
-				case MMODES_CONT:
+				snprintf(line1, sizeof(line1), "%s", g.value);
+				snprintf(line2, sizeof(line2), "%s, %s%s%s", mmodes[g.mode_index].label, g.range,
+						 (g.rangelock.locked && (g.rangelock.mode_index == g.mode_index)) ? " LOCK" : "",
+						 g.math[g.mode_index].rel ? " REL" : "");
+				if (g.sample.rate)
 				{
-					if (g.v > g.cont_threshold)
-					{
-						if (g.v > 1000)
-							g.v = 999.9;
-						snprintf(g.value, sizeof(g.value), "OPEN [%05.1f%s]", g.v, oo);
-					}
+					size_t l2 = strlen(line2);
+					if (g.rate.sps > 0)
+						snprintf(line2 + l2, sizeof(line2) - l2, ", %c %.1f/s", g.sample.rate, g.rate.sps);
 					else
-					{
-						snprintf(g.value, sizeof(g.value), "SHRT [%05.1f%s]", g.v, oo);
-					}
-					snprintf(g.range, sizeof(g.range), "Threshold: %d%s", g.cont_threshold, oo);
+						snprintf(line2 + l2, sizeof(line2) - l2, ", %c", g.sample.rate);
 				}
-				break;
-
-				case MMODES_DIOD:
+				if (g.integ && (g.mode_index == MMODES_CURR_DC))
 				{
-					if (g.v > 9.999)
-					{
-						snprintf(g.value, sizeof(g.value), "OL / OPEN");
-					}
-					else
-					{
-						snprintf(g.value, sizeof(g.value), "%06.4f V", g.v);
-					}
-					snprintf(g.range, sizeof(g.range), "None");
-				}
-				break;
+					size_t l2 = strlen(line2);
+					integ_text(g.integ, line2 + l2, sizeof(line2) - l2);
 				}
-				snprintf(line1, sizeof(line1), "%s", g.value);
-				snprintf(line2, sizeof(line2), "%s, %s", mmodes[g.mode_index].label, g.range);
 				if (g.debug)
 					fprintf(stderr, "Value:%f Range: %s\n", g.v, g.range);
+
+				publish_sample(&g);
+
+				/*
+				 * -t is the delay between readings, not between
+				 * serial transactions
+				 *
+				 */
+				if (g.interval)
+					usleep(g.interval);
 			}
 		}
 		else if (paused)
@@ -1254,69 +9486,99 @@ int main(int argc, char **argv)
 		 *
 		 */
 
+		if (g.headless)
+		{
+			if (g.error_flag)
+				sleep(1);
+		}
+#if USE_SDL
+		else
 		{
 			/*
 			 * Rendering
 			 *
+			 * The text textures are only re-rendered when the text
+			 * changes, and at most every g.text_interval, while the
+			 * bar graph follows every sample.  Nothing at all is
+			 * drawn when nothing changed.
 			 *
 			 */
-			int texW = 0;
-			int texH = 0;
-			int texW2 = 0;
-			int texH2 = 0;
-			SDL_RenderClear(renderer);
-			surface = TTF_RenderUTF8_Blended(font, line1, g.font_color_pri);
-			texture = SDL_CreateTextureFromSurface(renderer, surface);
-			SDL_QueryTexture(texture, NULL, NULL, &texW, &texH);
-			SDL_Rect dstrect = {0, 0, texW, texH};
-			SDL_RenderCopy(renderer, texture, NULL, &dstrect);
-
-			surface_2 = TTF_RenderUTF8_Blended(font_small, line2, g.font_color_sec);
-			texture_2 = SDL_CreateTextureFromSurface(renderer, surface_2);
-			SDL_QueryTexture(texture_2, NULL, NULL, &texW2, &texH2);
-			dstrect = {0, texH - (texH / 5), texW2, texH2};
-			SDL_RenderCopy(renderer, texture_2, NULL, &dstrect);
-
-			SDL_RenderPresent(renderer);
+			uint64_t now = now_ns();
+			int flash = g.alarms ? alarm_flash(g.alarms, now) : 0;
 
-			SDL_DestroyTexture(texture);
-			SDL_FreeSurface(surface);
-			if (1)
+			if (flash != flash_shown)
+				g.frame_dirty = 1;
+
+			if (((strcmp(line1, shown1) != 0) || (strcmp(line2, shown2) != 0)) && (now - text_t >= (uint64_t)g.text_interval * 1000ULL))
 			{
-				SDL_DestroyTexture(texture_2);
+				if (texture)
+					SDL_DestroyTexture(texture);
+				if (texture_2)
+					SDL_DestroyTexture(texture_2);
+
+				surface = TTF_RenderUTF8_Blended(font, line1, g.font_color_pri);
+				texture = SDL_CreateTextureFromSurface(renderer, surface);
+				SDL_QueryTexture(texture, NULL, NULL, &texW, &texH);
+
+				surface_2 = TTF_RenderUTF8_Blended(font_small, line2, g.font_color_sec);
+				texture_2 = SDL_CreateTextureFromSurface(renderer, surface_2);
+				SDL_QueryTexture(texture_2, NULL, NULL, &texW2, &texH2);
+
+#if USE_X11
+				if (g.overlay)
+				{
+					SDL_Surface *sfs[2] = {surface, surface_2};
+					SDL_Rect dst[2] = {{0, 0, texW, texH}, {0, texH - (texH / 5), texW2, texH2}};
+					overlay_shape(&g, window, sfs, dst, 2);
+				}
+#endif
+				SDL_FreeSurface(surface);
 				SDL_FreeSurface(surface_2);
+
+				snprintf(shown1, sizeof(shown1), "%s", line1);
+				snprintf(shown2, sizeof(shown2), "%s", line2);
+				text_t = now;
+				g.frame_dirty = 1;
 			}
 
-			if (g.error_flag)
+			if (g.frame_dirty)
 			{
-				sleep(1);
+				if (flash)
+					SDL_SetRenderDrawColor(renderer, 200, 0, 0, 255);
+				SDL_RenderClear(renderer);
+				if (flash)
+					SDL_SetRenderDrawColor(renderer, g.background_color.r, g.background_color.g, g.background_color.b, 255);
+				if (texture)
+				{
+					SDL_Rect dstrect = {0, 0, texW, texH};
+					SDL_RenderCopy(renderer, texture, NULL, &dstrect);
+
+					dstrect = {0, texH - (texH / 5), texW2, texH2};
+					SDL_RenderCopy(renderer, texture_2, NULL, &dstrect);
+				}
+
+				bargraph_draw(&g, renderer);
+
+				SDL_RenderPresent(renderer);
+				g.frame_dirty = 0;
+				flash_shown = flash;
+				if (flash && g.alarms->flash_t0_ns)
+				{
+					alarm_latency(&(g.alarms->lat[ALARM_LAT_FLASH]), g.alarms->flash_t0_ns);
+					g.alarms->flash_t0_ns = 0;
+				}
 			}
-			else
+
+			if (g.error_flag)
 			{
-				usleep(g.interval);
+				sleep(1);
 			}
-		}
-
-		if (g.output_file)
-		{
-			/*
-			 * Only write the file out if it doesn't
-			 * exist.
-			 *
-			 */
-			if (!fileExists(g.output_file))
+			else if (paused)
 			{
-				FILE *f;
-				f = fopen(tfn, "w");
-				if (f)
-				{
-					fprintf(f, "%s\t%s", line1, mmodes[g.mode_index].logmode);
-					fclose(f);
-					chmod(tfn, S_IROTH | S_IWOTH | S_IRUSR | S_IWUSR);
-					rename(tfn, g.output_file);
-				}
+				usleep(g.interval ? g.interval : 20000);
 			}
 		}
+#endif
 
 	} // while(1)
 
@@ -1325,16 +9587,79 @@ int main(int argc, char **argv)
 		close(g.usb_fhandle);
 	}
 
-	close(g.serial_params.fd);
-	flock(g.serial_params.fd, LOCK_UN);
+	if (g.cmdq.hotkey_n)
+		fprintf(stderr, "Hotkeys: %lu, first reading after %.1f ms on average, %.1f ms at most\n", (unsigned long)g.cmdq.hotkey_n,
+				g.cmdq.hotkey_sum_ns / 1e6 / g.cmdq.hotkey_n, g.cmdq.hotkey_max_ns / 1e6);
+	for (int mi = 0; mi <= MMODES_MAX; mi++)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			if (g.rate.ns[mi][k])
+				fprintf(stderr, "Rate: %s %c, %.1f readings/s\n", mmodes[mi].scpi, RATES[k], g.rate.n[mi][k] * 1e9 / g.rate.ns[mi][k]);
+		}
+	}
+	if (g.debug && g.acq_n)
+		fprintf(stderr, "Timing: value query round trip %.2f ms, reading time +/- %.2f ms on average\n",
+				g.acq_rtt_ns / 1e6 / g.acq_n, g.acq_unc_ns / 1e6 / g.acq_n);
+	if (g.integ)
+	{
+		fprintf(stderr, "Charge: %.9g Ah over %.1f s", g.integ->as / 3600.0, g.integ->a_s);
+		if (g.integ->w_s > 0)
+			fprintf(stderr, ", energy: %.9g Wh over %.1f s", g.integ->ws / 3600.0, g.integ->w_s);
+		fprintf(stderr, ", %lu gaps not bridged (%.1f s)\n", (unsigned long)g.integ->gaps, g.integ->gap_s);
+	}
+	if (g.rangelock.sets)
+		fprintf(stderr, "Range lock: %lu range queries saved, lock restored %lu times\n", (unsigned long)g.rangelock.skipped,
+				(unsigned long)g.rangelock.restored);
+	if (g.debug || g.cmdq.timeouts)
+		fprintf(stderr, "Commands: %lu sent, %lu stale replies dropped, %lu timeouts, %lu resyncs, %lu others never answered\n",
+				(unsigned long)g.cmdq.seq, (unsigned long)g.cmdq.stale_replies, (unsigned long)g.cmdq.timeouts,
+				(unsigned long)g.cmdq.resyncs, (unsigned long)g.cmdq.expired);
+
+	if (!g.replay)
+	{
+		close(g.serial_params.fd);
+		flock(g.serial_params.fd, LOCK_UN);
+	}
+
+	if (g.logger)
+		logger_stop(g.logger);
+
+	if (g.alarms)
+		alarm_stop(g.alarms);
+
+	if (g.pretrig)
+		pretrig_stop(g.pretrig);
 
-	XCloseDisplay(dpy);
+	if (g.rpc)
+		rpc_stop(g.rpc);
 
-	TTF_CloseFont(font);
-	SDL_DestroyRenderer(renderer);
-	SDL_DestroyWindow(window);
-	TTF_Quit();
-	SDL_Quit();
+	if (g.proxy)
+		proxy_stop(g.proxy);
+
+	if (g.shm)
+		shm_stop(&g);
+
+#if USE_X11
+	if (dpy)
+		XCloseDisplay(dpy);
+#endif
+
+#if USE_SDL
+	if (!g.headless)
+	{
+		if (texture)
+			SDL_DestroyTexture(texture);
+		if (texture_2)
+			SDL_DestroyTexture(texture_2);
+		TTF_CloseFont(font);
+		TTF_CloseFont(font_small);
+		SDL_DestroyRenderer(renderer);
+		SDL_DestroyWindow(window);
+		TTF_Quit();
+		SDL_Quit();
+	}
+#endif
 
 	return 0;
 }
@@ -0,0 +1,273 @@
+/*
+ * DM3058E shared memory interface
+ *
+ * dm3058e-sdl -S <name> publishes every reading into a POSIX shared
+ * memory segment (/dev/shm/<name>).  Consumers map it read-only and
+ * read the latest sample without any system call, lock or file
+ * handshake; the writer never waits for a reader.
+ *
+ * Plain C (and C++), GCC/Clang __atomic builtins, no library needed
+ * beyond librt on older glibc:
+ *
+ *	struct dm3058e_shm *shm = dm3058e_shm_open(DM3058E_SHM_NAME);
+ *	struct dm3058e_shm_sample s;
+ *
+ *	if (shm && (dm3058e_shm_latest(shm, &s) == 0))
+ *		printf("%s %s\n", s.display, s.range_text);
+ *
+ * The latest sample is guarded by a seqlock: seq is odd while the
+ * writer is updating it, so a reader copies the sample and checks
+ * seq didn't move.  dm3058e_shm_try_latest() makes exactly one
+ * attempt, which makes it wait-free; dm3058e_shm_latest() retries.
+ *
+ * Readers that need every sample follow the ring instead.  The
+ * producer writes each sample into the next slot and moves head;
+ * every reader keeps its own cursor in its own memory, so any
+ * number of them can follow at their own pace without the producer
+ * knowing they exist.  A reader that falls more than ring_size
+ * behind has been lapped; it's told how many samples it lost and
+ * carries on from the oldest one still in the ring.
+ *
+ *	struct dm3058e_shm_reader rd;
+ *
+ *	dm3058e_shm_reader_init(shm, &rd, 0);
+ *	while (running)
+ *	{
+ *		while (dm3058e_shm_next(shm, &rd, &s) > 0)
+ *			use(&s);
+ *		usleep(10000);
+ *	}
+ *
+ * dm3058e_shm_slot() / dm3058e_shm_slot_valid() give access to a
+ * slot in place, without the copy.
+ *
+ */
+#ifndef DM3058E_SHM_H
+#define DM3058E_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DM3058E_SHM_NAME "/dm3058e"
+#define DM3058E_SHM_MAGIC 0x4d485344 // "DSHM"
+#define DM3058E_SHM_VERSION 2
+#define DM3058E_SHM_RING_SLOTS 4096 // default, always a power of two
+
+struct dm3058e_shm_sample
+{
+	uint64_t seq;		// sample number, 1 for the first one published
+	uint64_t t_mono_ns; // CLOCK_MONOTONIC when the reading completed
+	int64_t t_wall_ns;	// CLOCK_REALTIME at the same moment
+	double value;		// raw value as returned by the meter, SI units
+	int32_t mode;		// mode index, see mode below
+	int32_t range;		// meter range code, -1 if the function has none
+	char mode_name[8];	// SCPI function, eg "DCV"
+	char units[8];		// eg "V DC", UTF-8
+	char range_text[16]; // eg "20V"
+	char display[32];	// the text the display shows, eg " 1.2345 V DC"
+};
+
+struct dm3058e_shm_slot
+{
+	uint64_t seq; // sample seq once the slot is complete, 0 while it's written
+	struct dm3058e_shm_sample s;
+	uint8_t pad[128 - 8 - sizeof(struct dm3058e_shm_sample)];
+};
+
+struct dm3058e_shm
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;		   // of the whole segment
+	uint32_t producer_pid; // 0 once the producer has exited
+	uint32_t ring_size;	   // slots, power of two
+	uint32_t ring_offset;  // from the start of the segment
+	uint32_t timeouts;	   // meter replies that missed their deadline, so far
+	uint32_t resyncs;	   // times the link was cleared and restarted
+
+	uint8_t pad0[32];
+
+	// seqlock, own cache line so readers polling it don't share with the header
+	uint64_t seq;
+	uint8_t pad1[56];
+	struct dm3058e_shm_sample latest;
+
+	uint8_t pad2[64 - sizeof(struct dm3058e_shm_sample) % 64];
+	uint64_t head; // samples written to the ring, the next one goes in slot head % ring_size
+	uint8_t pad3[56];
+};
+
+struct dm3058e_shm_reader
+{
+	uint64_t next; // seq - 1 of the next sample to read
+	uint64_t lost; // samples overwritten before this reader got to them
+};
+
+/*
+ * dm3058e_shm_try_latest()
+ *
+ * One attempt at a consistent copy of the latest sample.  0 on
+ * success, -1 if the writer was busy (try again) and -2 if nothing
+ * has been published yet.
+ *
+ */
+static inline int dm3058e_shm_try_latest(const struct dm3058e_shm *shm, struct dm3058e_shm_sample *out)
+{
+	uint64_t s1, s2;
+
+	s1 = __atomic_load_n(&(shm->seq), __ATOMIC_ACQUIRE);
+	if (s1 & 1)
+		return -1;
+	if (s1 == 0)
+		return -2;
+
+	memcpy(out, (const void *)&(shm->latest), sizeof(*out));
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	s2 = __atomic_load_n(&(shm->seq), __ATOMIC_RELAXED);
+
+	return s1 == s2 ? 0 : -1;
+}
+
+/*
+ * dm3058e_shm_latest()
+ *
+ * As above but retries while the writer is mid update, which only
+ * ever lasts the time of a ~100 byte copy
+ *
+ */
+static inline int dm3058e_shm_latest(const struct dm3058e_shm *shm, struct dm3058e_shm_sample *out)
+{
+	int r;
+
+	while ((r = dm3058e_shm_try_latest(shm, out)) == -1)
+		;
+
+	return r;
+}
+
+/*
+ * dm3058e_shm_slot()
+ *
+ * Slot that sample n (0 based) is or was written to
+ *
+ */
+static inline const struct dm3058e_shm_slot *dm3058e_shm_slot(const struct dm3058e_shm *shm, uint64_t n)
+{
+	const struct dm3058e_shm_slot *ring = (const struct dm3058e_shm_slot *)((const uint8_t *)shm + shm->ring_offset);
+
+	return &ring[n & (shm->ring_size - 1)];
+}
+
+/*
+ * dm3058e_shm_slot_valid()
+ *
+ * Non-zero if the slot still holds sample n; check it after using
+ * a slot in place, if it fails the producer lapped the reader and
+ * what was read can't be trusted
+ *
+ */
+static inline int dm3058e_shm_slot_valid(const struct dm3058e_shm_slot *slot, uint64_t n)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&(slot->seq), __ATOMIC_RELAXED) == n + 1;
+}
+
+/*
+ * dm3058e_shm_reader_init()
+ *
+ * Start a cursor at the next sample, or with backlog set at the
+ * oldest one still in the ring
+ *
+ */
+static inline void dm3058e_shm_reader_init(const struct dm3058e_shm *shm, struct dm3058e_shm_reader *rd, int backlog)
+{
+	uint64_t head = __atomic_load_n(&(shm->head), __ATOMIC_ACQUIRE);
+
+	rd->next = head;
+	if (backlog)
+		rd->next = head > shm->ring_size ? head - shm->ring_size : 0;
+	rd->lost = 0;
+}
+
+/*
+ * dm3058e_shm_next()
+ *
+ * Copy out the reader's next sample.  1 if there was one, 0 if
+ * the reader has caught up.  Overruns are added to rd->lost.
+ *
+ */
+static inline int dm3058e_shm_next(const struct dm3058e_shm *shm, struct dm3058e_shm_reader *rd, struct dm3058e_shm_sample *out)
+{
+	while (1)
+	{
+		uint64_t head = __atomic_load_n(&(shm->head), __ATOMIC_ACQUIRE);
+		const struct dm3058e_shm_slot *slot;
+
+		if (rd->next >= head)
+			return 0;
+
+		if (head - rd->next > shm->ring_size)
+		{
+			rd->lost += head - rd->next - shm->ring_size;
+			rd->next = head - shm->ring_size;
+		}
+
+		slot = dm3058e_shm_slot(shm, rd->next);
+		if (__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) == rd->next + 1)
+		{
+			memcpy(out, (const void *)&(slot->s), sizeof(*out));
+			if (dm3058e_shm_slot_valid(slot, rd->next))
+			{
+				rd->next++;
+				return 1;
+			}
+		}
+
+		// overwritten under us, the producer is a lap ahead
+		rd->lost++;
+		rd->next++;
+	}
+}
+
+/*
+ * dm3058e_shm_open()
+ *
+ * Map a producer's segment read-only, NULL if there isn't one or
+ * it's not a version this header understands
+ *
+ */
+static inline struct dm3058e_shm *dm3058e_shm_open(const char *name)
+{
+	struct dm3058e_shm *shm;
+	struct stat st;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+	if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(struct dm3058e_shm)))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	shm = (struct dm3058e_shm *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED)
+		return NULL;
+
+	if ((shm->magic != DM3058E_SHM_MAGIC) || (shm->version != DM3058E_SHM_VERSION))
+	{
+		munmap(shm, st.st_size);
+		return NULL;
+	}
+
+	return shm;
+}
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * Embedded RobotoMono fonts
+ *
+ * The TTF files are pulled into .rodata at build time with .incbin
+ * so the binaries run from any directory and never touch the disk
+ * for assets.  Open them with SDL_RWFromConstMem().
+ *
+ * The assembler resolves the paths relative to the directory make
+ * runs from, see the Makefile.
+ *
+ */
+#ifndef FONTS_H
+#define FONTS_H
+
+#include <stdint.h>
+
+#define FONT_INCBIN(sym, file)                         \
+	__asm__(".section .rodata\n"                       \
+			".global " #sym "\n"                       \
+			".balign 16\n" #sym ":\n"                  \
+			".incbin \"" file "\"\n"                   \
+			".global " #sym "_end\n" #sym "_end:\n"    \
+			".byte 0\n"                                \
+			".previous\n");                            \
+	extern "C" const uint8_t sym[];                    \
+	extern "C" const uint8_t sym##_end[];
+
+FONT_INCBIN(font_robotomono_regular, "RobotoMono-Regular.ttf")
+FONT_INCBIN(font_robotomono_medium, "RobotoMono-Medium.ttf")
+
+#define FONT_SIZE(sym) ((int)(sym##_end - sym))
+
+/*
+ * RobotoMono metrics in font design units, taken from the head,
+ * hhea and hmtx tables (identical for Regular and Medium).  Being
+ * monospaced, every glyph has the same advance, so text extents
+ * are known without asking SDL_ttf to measure anything.
+ *
+ */
+#define ROBOTOMONO_UNITS_PER_EM 2048
+#define ROBOTOMONO_ASCENT 2146
+#define ROBOTOMONO_DESCENT 555
+#define ROBOTOMONO_ADVANCE 1229
+
+#define FONT_PT_MIN 10
+#define FONT_PT_MAX 200
+
+struct font_layout_s
+{
+	int advance; // pixels per character
+	int height;	 // pixels per line, as TTF_FontHeight()
+};
+
+/*
+ * font_layout()
+ *
+ * Pixel metrics for a point size, computed once per size and
+ * then served from the table.  SDL_ttf renders at 72dpi so the
+ * point size is also the pixels per em.
+ *
+ */
+static inline const struct font_layout_s *font_layout(int pt)
+{
+	static struct font_layout_s cache[FONT_PT_MAX + 1];
+	struct font_layout_s *l;
+
+	if (pt < 1)
+		pt = 1;
+	if (pt > FONT_PT_MAX)
+		pt = FONT_PT_MAX;
+
+	l = &cache[pt];
+	if (l->height == 0)
+	{
+		l->advance = (pt * ROBOTOMONO_ADVANCE + ROBOTOMONO_UNITS_PER_EM / 2) / ROBOTOMONO_UNITS_PER_EM;
+		l->height = (pt * ROBOTOMONO_ASCENT + ROBOTOMONO_UNITS_PER_EM - 1) / ROBOTOMONO_UNITS_PER_EM + (pt * ROBOTOMONO_DESCENT + ROBOTOMONO_UNITS_PER_EM - 1) / ROBOTOMONO_UNITS_PER_EM;
+	}
+
+	return l;
+}
+
+#endif
@@ -7,14 +7,32 @@
  *
  */
 
+/*
+ * The display (SDL2/SDL_ttf) and global hotkey (X11) layers can
+ * be left out at build time, eg: make USE_SDL=0 USE_X11=0
+ * which gives a lean binary that only runs in headless mode
+ *
+ */
+#ifndef USE_SDL
+#define USE_SDL 1
+#endif
+
+#ifndef USE_X11
+#define USE_X11 1
+#endif
+
+#if USE_SDL
 #include <SDL.h>
 #include <SDL_ttf.h>
+#include "fonts.h"
+#endif
 
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/file.h>
 #include <sys/types.h>
@@ -24,9 +42,18 @@
 #include <fcntl.h>
 #include <errno.h>
 
+#if USE_X11
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/XKBlib.h>
+#endif
+
+#if !USE_SDL
+typedef struct SDL_Color
+{
+	uint8_t r, g, b, a;
+} SDL_Color;
+#endif
 
 #define FL __FILE__, __LINE__
 
@@ -98,6 +125,10 @@ struct mmode_s
 
 #define READ_BUF_SIZE 4096
 
+#define HEADLESS_NONE 0
+#define HEADLESS_TEXT 1
+#define HEADLESS_JSON 2
+
 struct mmode_s mmodes[] = {
 	{"VOLT", "Volts DC", "MEAS:VOLT:DC?\r\n", "V DC", "VOLTSDC"},
 	{"VOLT:AC", "Volts AC", "MEAS:VOLT:AC?\r\n", "V AC", "VOLTSAC"},
@@ -134,6 +165,18 @@ struct serial_params_s
 	struct termios oldtp, newtp;
 };
 
+/*
+ * One completed reading, as handed to the outputs by publish_sample()
+ *
+ */
+struct sample_s
+{
+	uint64_t t_ns;		 // CLOCK_MONOTONIC when the reading completed
+	struct timespec wall; // CLOCK_REALTIME at the same moment
+	double v;			 // raw value as returned by the meter
+	int mode_index;
+};
+
 struct glb
 {
 	uint8_t debug;
@@ -162,8 +205,12 @@ struct glb
 	char func[READ_BUF_SIZE];
 	char range[READ_BUF_SIZE];
 
+	struct sample_s sample;
+
+	int headless;
 	int interval;
 	int font_size;
+	int font_medium;
 	int window_width, window_height;
 	int wx_forced, wy_forced;
 	SDL_Color font_color_pri, font_color_sec, background_color;
@@ -179,6 +226,17 @@ struct glb
  */
 struct glb *glbs;
 
+/*
+ * Set from the signal handler, checked by the main loop
+ *
+ */
+volatile sig_atomic_t quit_signal = 0;
+
+void handle_quit_signal(int sig)
+{
+	quit_signal = sig;
+}
+
 /*
  * Test to see if a file exists
  *
@@ -217,13 +275,15 @@ int init(struct glb *g)
 	g->flags = 0;
 	g->error_flag = 0;
 	g->output_file = NULL;
-	g->interval = 100000; // 100ms / 100,000us interval of sleeping between frames
+	g->interval = -1; // default decided once we know if we're headless
+	g->headless = HEADLESS_NONE;
 	g->device[0] = '\0';
 	g->comms_mode = CMODE_NONE;
 
 	g->serial_parameters_string = NULL;
 
 	g->font_size = 60;
+	g->font_medium = 0;
 	g->window_width = 400;
 	g->window_height = 100;
 	g->wx_forced = 0;
@@ -249,13 +309,15 @@ void show_help(void)
 					"\t-q: quiet output\r\n"
 					"\t-v: show version\r\n"
 					"\t-z <font size in pt>\r\n"
+					"\t-m: use the medium weight font for the reading\r\n"
 					"\t-cv <volts colour, a0a0ff>\r\n"
 					"\t-ca <amps colour, ffffa0>\r\n"
 					"\t-cb <background colour, 101010>\r\n"
-					"\t-t <interval> (sleep delay between samples, default 100,000us)\r\n"
+					"\t-t <interval> (sleep delay between samples, default 100,000us, headless 0us)\r\n"
 					"\t-p <comport>: Set the com port for the meter, eg: -p /dev/ttyUSB0\r\n"
 					"\t-s <115200|57600|38400|19200|9600> serial speed (default 115200)\r\n"
 					"\t-o <output file>\r\n"
+					"\t-H <text|json> headless; no X11/SDL, stream every reading to stdout\r\n"
 					"\r\n"
 					"\texample: gdm-8341-sdl -p /dev/ttyUSB0 -s 38400\r\n",
 			BUILD_VER, BUILD_DATE);
@@ -354,6 +416,36 @@ int parse_parameters(struct glb *g, int argc, char **argv)
 				g->debug = 1;
 				break;
 
+			case 'm':
+				g->font_medium = 1;
+				break;
+
+			case 'H':
+				/*
+				 * Headless; one line per reading on stdout,
+				 * either tab separated text or JSON
+				 *
+				 */
+				i++;
+				if (i < argc)
+				{
+					if (strcmp(argv[i], "json") == 0)
+						g->headless = HEADLESS_JSON;
+					else if (strcmp(argv[i], "text") == 0)
+						g->headless = HEADLESS_TEXT;
+					else
+					{
+						fprintf(stdout, "Invalid headless format '%s'; -H <text|json>\n", argv[i]);
+						exit(1);
+					}
+				}
+				else
+				{
+					fprintf(stdout, "Insufficient parameters; -H <text|json>\n");
+					exit(1);
+				}
+				break;
+
 			case 'q':
 				g->quiet = 1;
 				break;
@@ -648,6 +740,86 @@ int data_write(glb *g, const char *d, ssize_t s)
 	return sz;
 }
 
+/*
+ * now_ns()
+ *
+ * Monotonic time in nanoseconds, used for all sample timing
+ *
+ */
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * stream_sample()
+ *
+ * Headless output, one line per reading on stdout.  The range
+ * is the human label set by the formatter, eg "20V"
+ *
+ */
+int stream_sample(struct glb *g, struct sample_s *s)
+{
+	char line[SSIZE];
+	int sz;
+
+	if (g->headless == HEADLESS_JSON)
+	{
+		sz = snprintf(line, sizeof(line), "{\"t\":%ld.%06ld,\"value\":%.10g,\"mode\":\"%s\",\"range\":\"%s\",\"display\":\"%s\"}\n",
+					  (long)s->wall.tv_sec, s->wall.tv_nsec / 1000, s->v, mmodes[s->mode_index].scpi, g->range, g->value);
+	}
+	else
+	{
+		sz = snprintf(line, sizeof(line), "%ld.%06ld\t%.10g\t%s\t%s\t%s\n",
+					  (long)s->wall.tv_sec, s->wall.tv_nsec / 1000, s->v, mmodes[s->mode_index].scpi, g->range, g->value);
+	}
+
+	if (sz >= (int)sizeof(line))
+		sz = sizeof(line) - 1;
+
+	/*
+	 * One write per reading so whatever is on the other end of
+	 * the pipe sees it immediately, no stdio buffering
+	 *
+	 */
+	if (write(STDOUT_FILENO, line, sz) < 0)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * publish_sample()
+ *
+ * Called once for every completed reading, after formatting.
+ * Fills in g->sample and hands it to the enabled outputs.
+ *
+ */
+void publish_sample(struct glb *g)
+{
+	struct sample_s *s = &(g->sample);
+
+	s->t_ns = now_ns();
+	clock_gettime(CLOCK_REALTIME, &(s->wall));
+	s->v = g->v;
+	s->mode_index = g->mode_index;
+
+	if (g->headless)
+	{
+		if (stream_sample(g, s) != 0)
+		{
+			// reader went away, nothing left to do
+			quit_signal = SIGPIPE;
+		}
+	}
+}
+
+#if USE_X11
 /*
  * grab_key()
  *
@@ -666,6 +838,7 @@ void grab_key(Display *display, Window rootWindow, int keycode, int modifier)
 		XGrabKey(display, keycode, modifier | Mod2Mask | LockMask, rootWindow, false, GrabModeAsync, GrabModeAsync);
 	}
 }
+#endif
 
 /*-----------------------------------------------------------------\
   Date Code:	: 20180127-220307
@@ -687,9 +860,19 @@ Changes:
 int main(int argc, char **argv)
 {
 
+#if USE_SDL
 	SDL_Event event;
 	SDL_Surface *surface, *surface_2;
 	SDL_Texture *texture, *texture_2;
+	SDL_Window *window = NULL;
+	SDL_Renderer *renderer = NULL;
+	TTF_Font *font = NULL;
+	TTF_Font *font_small = NULL;
+#endif
+#if USE_X11
+	Display *dpy = NULL;
+	XEvent ev;
+#endif
 
 	struct glb g; // Global structure for passing variables around
 	char tfn[4096];
@@ -707,14 +890,20 @@ int main(int argc, char **argv)
 	 * Parse our command line parameters
 	 */
 	parse_parameters(&g, argc, argv);
-	if (g.device == NULL)
+
+#if !USE_SDL
+	if (!g.headless)
 	{
-		fprintf(stdout, "Require valid device (ie, -p /dev/usbtmc2 )\nExiting\n");
-		exit(1);
+		fprintf(stderr, "Built without SDL, running headless (-H text)\n");
+		g.headless = HEADLESS_TEXT;
 	}
+#endif
+
+	if (g.interval < 0)
+		g.interval = g.headless ? 0 : 100000; // 100ms / 100,000us interval of sleeping between frames
 
 	if (g.debug)
-		fprintf(stdout, "START\n");
+		fprintf(stderr, "START\n");
 
 	g.comms_mode = CMODE_SERIAL;
 	snprintf(g.serial_params.device, PATH_MAX, "%s", g.device);
@@ -731,73 +920,114 @@ int main(int argc, char **argv)
 	if (g.output_file)
 		snprintf(tfn, sizeof(tfn), "%s.tmp", g.output_file);
 
-	find_port(&g);
-	//		  open_port( &g );
-
-	Display *dpy = XOpenDisplay(0);
-	Window root = DefaultRootWindow(dpy);
-	XEvent ev;
-	Window grab_window = root;
-
-	// Shift key = ShiftMask / 0x01
-	// CapLocks = LockMask / 0x02
-	// Control = ControlMask / 0x04
-	// Alt = Mod1Mask / 0x08
-	//
-	// Numlock = Mod2Mask / 0x10
-	// Windows key = Mod4Mask / 0x40
-	grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_r), Mod4Mask | Mod1Mask);
-	grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_v), Mod4Mask | Mod1Mask);
-	grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_c), Mod4Mask | Mod1Mask);
-	grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_d), Mod4Mask | Mod1Mask);
-	grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_f), Mod4Mask | Mod1Mask);
-	XSelectInput(dpy, root, KeyPressMask);
-
-	/*
-	 * Setup SDL2 and fonts
-	 *
-	 */
-
-	SDL_Init(SDL_INIT_VIDEO);
-	TTF_Init();
-	TTF_Font *font = TTF_OpenFont("RobotoMono-Regular.ttf", g.font_size);
-	TTF_Font *font_small = TTF_OpenFont("RobotoMono-Regular.ttf", g.font_size / 2);
+	signal(SIGINT, handle_quit_signal);
+	signal(SIGTERM, handle_quit_signal);
+	if (g.headless)
+		signal(SIGPIPE, SIG_IGN);
 
 	/*
-	 * Get the required window size.
-	 *
-	 * Parameters passed can override the font self-detect sizing
+	 * If we were given a port, use it directly rather than
+	 * probing every ttyUSB, saves up to 3s at startup
 	 *
 	 */
-	TTF_SizeText(font, " 00.0000V DCAC ", &g.window_width, &g.window_height);
-	g.window_height *= 1.85;
-
-	if (g.wx_forced)
-		g.window_width = g.wx_forced;
-	if (g.wy_forced)
-		g.window_height = g.wy_forced;
+	if (g.device[0] != '\0')
+	{
+		if (open_port(&g) != PORT_OK)
+		{
+			fprintf(stderr, "Unable to open %s\n", g.device);
+			exit(1);
+		}
+	}
+	else
+		find_port(&g);
 
-	SDL_Window *window = SDL_CreateWindow("gdm-8341", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, g.window_width, g.window_height, 0);
-	SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
-	if (!font)
+#if USE_X11
+	if (!g.headless)
 	{
-		fprintf(stderr, "Error trying to open font :( \r\n");
-		exit(1);
+		dpy = XOpenDisplay(0);
+		if (!dpy)
+		{
+			fprintf(stderr, "Unable to open X display, hotkeys disabled\n");
+		}
+		else
+		{
+			Window root = DefaultRootWindow(dpy);
+			Window grab_window = root;
+
+			// Shift key = ShiftMask / 0x01
+			// CapLocks = LockMask / 0x02
+			// Control = ControlMask / 0x04
+			// Alt = Mod1Mask / 0x08
+			//
+			// Numlock = Mod2Mask / 0x10
+			// Windows key = Mod4Mask / 0x40
+			grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_r), Mod4Mask | Mod1Mask);
+			grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_v), Mod4Mask | Mod1Mask);
+			grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_c), Mod4Mask | Mod1Mask);
+			grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_d), Mod4Mask | Mod1Mask);
+			grab_key(dpy, grab_window, XKeysymToKeycode(dpy, XK_f), Mod4Mask | Mod1Mask);
+			XSelectInput(dpy, root, KeyPressMask);
+		}
 	}
-	SDL_RendererInfo info;
-	SDL_GetRendererInfo(renderer, &info);
-	fprintf(stderr, "Renderer Information --\n"
-					"Name: %s\n"
-					"Flags: %lX\n"
-					"%s%s%s%s\n"
-					"---\n",
-			info.name, info.flags, info.flags & SDL_RENDERER_SOFTWARE ? "Software" : "", info.flags & SDL_RENDERER_ACCELERATED ? "Accelerated" : "", info.flags & SDL_RENDERER_PRESENTVSYNC ? "Vsync Sync" : "", info.flags & SDL_RENDERER_TARGETTEXTURE ? "Target texture supported" : "");
+#endif
 
-	/* Select the color for drawing. It is set to red here. */
-	SDL_SetRenderDrawColor(renderer, g.background_color.r, g.background_color.g, g.background_color.b, 255);
+#if USE_SDL
+	if (!g.headless)
+	{
+		/*
+		 * Setup SDL2 and fonts
+		 *
+		 */
 
-	/* Clear the entire screen to our selected color. */
-	SDL_RenderClear(renderer);
+		SDL_Init(SDL_INIT_VIDEO);
+		TTF_Init();
+		if (g.font_medium)
+			font = TTF_OpenFontRW(SDL_RWFromConstMem(font_robotomono_medium, FONT_SIZE(font_robotomono_medium)), 1, g.font_size);
+		else
+			font = TTF_OpenFontRW(SDL_RWFromConstMem(font_robotomono_regular, FONT_SIZE(font_robotomono_regular)), 1, g.font_size);
+		font_small = TTF_OpenFontRW(SDL_RWFromConstMem(font_robotomono_regular, FONT_SIZE(font_robotomono_regular)), 1, g.font_size / 2);
+		if (!font || !font_small)
+		{
+			fprintf(stderr, "Error trying to open font :( \r\n");
+			exit(1);
+		}
+
+		/*
+		 * Get the required window size.
+		 *
+		 * The font is monospaced and embedded, so the size of
+		 * " 00.0000V DCAC " follows straight from its metrics
+		 *
+		 * Parameters passed can override the font self-detect sizing
+		 *
+		 */
+		const struct font_layout_s *fl = font_layout(g.font_size);
+		g.window_width = fl->advance * (sizeof(" 00.0000V DCAC ") - 1);
+		g.window_height = fl->height * 1.85;
+
+		if (g.wx_forced)
+			g.window_width = g.wx_forced;
+		if (g.wy_forced)
+			g.window_height = g.wy_forced;
+
+		window = SDL_CreateWindow("gdm-8341", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, g.window_width, g.window_height, 0);
+		renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+		SDL_RendererInfo info;
+		SDL_GetRendererInfo(renderer, &info);
+		fprintf(stderr, "Renderer Information --\n"
+						"Name: %s\n"
+						"Flags: %X\n"
+						"%s%s%s%s\n"
+						"---\n",
+				info.name, info.flags, info.flags & SDL_RENDERER_SOFTWARE ? "Software" : "", info.flags & SDL_RENDERER_ACCELERATED ? "Accelerated" : "", info.flags & SDL_RENDERER_PRESENTVSYNC ? "Vsync Sync" : "", info.flags & SDL_RENDERER_TARGETTEXTURE ? "Target texture supported" : "");
+
+		/* Select the color for drawing. It is set to red here. */
+		SDL_SetRenderDrawColor(renderer, g.background_color.r, g.background_color.g, g.background_color.b, 255);
+
+		/* Clear the entire screen to our selected color. */
+		SDL_RenderClear(renderer);
+	}
+#endif
 
 	/*
 	 *
@@ -808,10 +1038,21 @@ int main(int argc, char **argv)
 	char line1[4096];
 	char line2[5000];
 
+	line1[0] = '\0';
+	line2[0] = '\0';
+
 	while (!quit)
 	{
 
-		if (!paused && !quit)
+		if (quit_signal)
+		{
+			if (g.debug)
+				fprintf(stderr, "Signal %d, quitting\n", (int)quit_signal);
+			quit = true;
+		}
+
+#if USE_X11
+		if (dpy && !paused && !quit)
 		{
 			if (XCheckMaskEvent(dpy, KeyPressMask, &ev))
 			{
@@ -855,8 +1096,10 @@ int main(int argc, char **argv)
 				}
 			} // check mask
 		}
+#endif
 
-		while (SDL_PollEvent(&event))
+#if USE_SDL
+		while (!g.headless && SDL_PollEvent(&event))
 		{
 			switch (event.type)
 			{
@@ -878,6 +1121,7 @@ int main(int argc, char **argv)
 				break;
 			}
 		}
+#endif
 
 		if (!paused && !quit)
 		{
@@ -1174,6 +1418,16 @@ int main(int argc, char **argv)
 				snprintf(line2, sizeof(line2), "%s, %s", mmodes[g.mode_index].label, g.range);
 				if (g.debug)
 					fprintf(stderr, "Value:%f Range: %s\n", g.v, g.range);
+
+				publish_sample(&g);
+
+				/*
+				 * Headless has no frame rate, so -t is applied
+				 * per completed reading instead
+				 *
+				 */
+				if (g.headless && g.interval)
+					usleep(g.interval);
 			}
 		}
 		else if (paused)
@@ -1187,6 +1441,13 @@ int main(int argc, char **argv)
 		 *
 		 */
 
+		if (g.headless)
+		{
+			if (g.error_flag)
+				sleep(1);
+		}
+#if USE_SDL
+		else
 		{
 			/*
 			 * Rendering
@@ -1229,6 +1490,7 @@ int main(int argc, char **argv)
 				usleep(g.interval);
 			}
 		}
+#endif
 
 		if (g.output_file)
 		{
@@ -1261,13 +1523,22 @@ int main(int argc, char **argv)
 	close(g.serial_params.fd);
 	flock(g.serial_params.fd, LOCK_UN);
 
-	XCloseDisplay(dpy);
+#if USE_X11
+	if (dpy)
+		XCloseDisplay(dpy);
+#endif
 
-	TTF_CloseFont(font);
-	SDL_DestroyRenderer(renderer);
-	SDL_DestroyWindow(window);
-	TTF_Quit();
-	SDL_Quit();
+#if USE_SDL
+	if (!g.headless)
+	{
+		TTF_CloseFont(font);
+		TTF_CloseFont(font_small);
+		SDL_DestroyRenderer(renderer);
+		SDL_DestroyWindow(window);
+		TTF_Quit();
+		SDL_Quit();
+	}
+#endif
 
 	return 0;
 }
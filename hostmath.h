@@ -0,0 +1,181 @@
+/*
+ * Host side math channels
+ *
+ * Shared by dm3058e-sdl (-M, applied to every reading before it's
+ * formatted) and meterlog (-M, applied to a csv export a capture
+ * block at a time)
+ *
+ * The meter's own REL/dB/dBm math isn't available while the panel
+ * is locked under remote control, so it's done here instead, on
+ * the raw double, set per mode and always in this order:
+ *
+ *   m = (v - null) * scale + offset
+ *   dB : 20 log10(|m| / ref)       ref in the mode's units, default 1
+ *   dBm: 10 log10(m^2 / ref / 1mW) ref in ohms, default 600
+ *
+ * Options are given as a list, eg "rel:scale=100:units=degC",
+ * see hostmath_option().  Logs and captures always keep the raw
+ * value, the math is only ever applied on the way out.
+ *
+ */
+#ifndef HOSTMATH_H
+#define HOSTMATH_H
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HOSTMATH_DB_NONE 0
+#define HOSTMATH_DB 1
+#define HOSTMATH_DBM 2
+
+#define HOSTMATH_DBM_REF 600.0 // ohms, the audio reference
+
+struct hostmath_s
+{
+	int rel;		 // subtract null
+	int rel_pending; // take null from the next reading
+	double null;
+	double scale, offset;
+	int db;		// HOSTMATH_DB_*
+	double ref; // dB reference level, or dBm reference impedance
+	char units[16]; // shown instead of the mode's units, "" to keep them
+};
+
+static inline void hostmath_init(struct hostmath_s *m)
+{
+	memset(m, 0, sizeof(*m));
+	m->scale = 1.0;
+}
+
+/*
+ * hostmath_active()
+ *
+ * Non-zero if there's anything to apply
+ *
+ */
+static inline int hostmath_active(const struct hostmath_s *m)
+{
+	return m->rel || m->rel_pending || (m->scale != 1.0) || (m->offset != 0.0) || m->db || m->units[0];
+}
+
+/*
+ * hostmath_linear()
+ *
+ * Only a null is subtracted, so the result still has the mode's
+ * units and fits the meter's range formatting
+ *
+ */
+static inline int hostmath_linear(const struct hostmath_s *m)
+{
+	return (m->scale == 1.0) && (m->offset == 0.0) && !m->db && !m->units[0];
+}
+
+/*
+ * hostmath_units()
+ *
+ * Units of the result, NULL if they're the mode's own
+ *
+ */
+static inline const char *hostmath_units(const struct hostmath_s *m)
+{
+	if (m->units[0])
+		return m->units;
+	if (m->db == HOSTMATH_DB)
+		return "dB";
+	if (m->db == HOSTMATH_DBM)
+		return "dBm";
+	return NULL;
+}
+
+/*
+ * hostmath_option()
+ *
+ * One option: rel[=<null>] db[=<ref>] dbm[=<ohms>] scale=<a>
+ * offset=<b> units=<text>.  rel without a value takes the null
+ * from the next reading.  0 if it was understood.
+ *
+ */
+static inline int hostmath_option(struct hostmath_s *m, const char *f)
+{
+	char *e;
+
+	if (strcmp(f, "rel") == 0)
+	{
+		m->rel_pending = 1;
+	}
+	else if (strncmp(f, "rel=", 4) == 0)
+	{
+		m->null = strtod(f + 4, &e);
+		m->rel = 1;
+		m->rel_pending = 0;
+		return *e ? -1 : 0;
+	}
+	else if ((strcmp(f, "db") == 0) || (strncmp(f, "db=", 3) == 0))
+	{
+		m->db = HOSTMATH_DB;
+		m->ref = f[2] ? strtod(f + 3, &e) : 1.0;
+		return (f[2] && *e) || (m->ref <= 0) ? -1 : 0;
+	}
+	else if ((strcmp(f, "dbm") == 0) || (strncmp(f, "dbm=", 4) == 0))
+	{
+		m->db = HOSTMATH_DBM;
+		m->ref = f[3] ? strtod(f + 4, &e) : HOSTMATH_DBM_REF;
+		return (f[3] && *e) || (m->ref <= 0) ? -1 : 0;
+	}
+	else if (strncmp(f, "scale=", 6) == 0)
+	{
+		m->scale = strtod(f + 6, &e);
+		return *e ? -1 : 0;
+	}
+	else if (strncmp(f, "offset=", 7) == 0)
+	{
+		m->offset = strtod(f + 7, &e);
+		return *e ? -1 : 0;
+	}
+	else if (strncmp(f, "units=", 6) == 0)
+	{
+		snprintf(m->units, sizeof(m->units), "%s", f + 6);
+	}
+	else
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * hostmath_block()
+ *
+ * Apply the math to n values in place.  Each stage is its own
+ * branch free loop over the whole array so the compiler can keep
+ * it in vector registers; a single reading is just n = 1.
+ *
+ */
+static inline void hostmath_block(const struct hostmath_s *m, double *v, size_t n)
+{
+	const double null = m->rel ? m->null : 0.0;
+	const double scale = m->scale, offset = m->offset;
+
+	for (size_t i = 0; i < n; i++)
+		v[i] = (v[i] - null) * scale + offset;
+
+	if (m->db == HOSTMATH_DB)
+	{
+		const double k = 1.0 / m->ref;
+
+		for (size_t i = 0; i < n; i++)
+			v[i] = 20.0 * log10(fabs(v[i]) * k);
+	}
+	else if (m->db == HOSTMATH_DBM)
+	{
+		const double k = 1.0 / (m->ref * 1e-3);
+
+		for (size_t i = 0; i < n; i++)
+			v[i] = 10.0 * log10(v[i] * v[i] * k);
+	}
+}
+
+#endif
@@ -0,0 +1,891 @@
+/*
+ * meterlog
+ *
+ * Reader for the dm3058e-sdl binary capture (.dmc), see capture.h,
+ * and a follower of the live shared memory ring (-S), see
+ * dm3058e-shm.h
+ *
+ * The file is mmap'd and walked a block at a time, so multi GB
+ * overnight captures are converted or summarised without being
+ * loaded into RAM.  -f / -t use the block sync records to jump
+ * straight to the wanted time span, and csv -n uses the min/max
+ * pyramid files next to the capture so a span of any length comes
+ * out at n points by touching about n pyramid entries.  csv -M runs
+ * the host side math (hostmath.h) over each block's values in one
+ * pass before the rows are printed.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#include "capture.h"
+#include "dm3058e-shm.h"
+#include "hostmath.h"
+
+#define FL __FILE__, __LINE__
+
+char help[] = " -h\n"
+			  "Usage: meterlog <command> [-f <seconds>] [-t <seconds>] <capture.dmc>\n"
+			  "       meterlog follow [-b] [shm name]\n"
+			  "\n"
+			  "\tinfo   : header, record count and time span\n"
+			  "\tcsv    : convert to CSV on stdout\n"
+			  "\tstats  : per mode count, min, max, mean and standard deviation\n"
+			  "\tpyramid: (re)build the min/max pyramid files, <capture>.p1 ... .p6\n"
+			  "\tfollow : every live reading from dm3058e-sdl -S as CSV (default " DM3058E_SHM_NAME ")\n"
+			  "\n"
+			  "\t-b : follow from the oldest reading still in the ring\n"
+			  "\t-f <seconds> : start at this many seconds into the capture\n"
+			  "\t-t <seconds> : stop at this many seconds into the capture\n"
+			  "\t-n <points>  : csv; min/max/mean over n equal time buckets, eg one per pixel\n"
+			  "\t-M <mode>:<math>[:<math>] : csv; add a math column, repeatable, eg -M DCV:rel\n"
+			  "\t     rel[=<null>] db[=<ref>] dbm[=<ohms>] scale=<a> offset=<b> units=<text>\n"
+			  "\t     rel alone nulls on the first reading of the mode in the span\n"
+			  "\n"
+			  "\texample: meterlog csv -f 3600 -t 7200 overnight.dmc > hour2.csv\n";
+
+enum {
+	CMD_INFO,
+	CMD_CSV,
+	CMD_STATS,
+	CMD_FOLLOW,
+	CMD_PYRAMID
+};
+
+struct stats_s
+{
+	uint64_t count;
+	double min, max;
+	double mean, m2; // Welford running mean and sum of squared deviations
+};
+
+struct glb
+{
+	int cmd;
+	char *path;
+	uint64_t from_us, to_us;
+	int backlog;
+
+	struct capture_view_s cv;
+	struct stats_s stats[CAPTURE_MODES_MAX];
+	uint64_t first_us, last_us, samples, max_gap_us;
+	uint64_t trigger_us, triggers; // pre-trigger captures, see dm3058e-sdl -P
+
+	// DCI integrated into A.h, trapezoid, not across a -E gap or another mode
+	double charge_as, charge_s;
+	uint64_t charge_last_us, gaps;
+	double charge_last_a;
+	int charge_have;
+
+	int buckets;
+	struct stats_s *bucket;
+	uint64_t bucket_from, bucket_us;
+
+	// pyramid levels, mapped
+	const struct pyramid_entry_s *lv[PYRAMID_LEVELS];
+	uint64_t lv_n[PYRAMID_LEVELS];
+	FILE *lv_out[PYRAMID_LEVELS];
+
+	// -M, resolved against the capture's own mode table once it's open
+	const char *math_spec[CAPTURE_MODES_MAX];
+	int math_specs;
+	struct hostmath_s math[CAPTURE_MODES_MAX];
+	int math_on;
+	double *mv;	  // math values of the block being walked
+	uint32_t rec; // index of the record being visited in its block
+};
+
+/*
+ * mode_name()
+ *
+ */
+const char *mode_name(struct glb *g, int mode)
+{
+	if ((mode < 0) || ((uint32_t)mode >= g->cv.hdr->mode_count) || (mode >= CAPTURE_MODES_MAX))
+		return "?";
+	return g->cv.hdr->modes[mode].scpi;
+}
+
+/*
+ * math_parse()
+ *
+ * Resolve the -M specs now the capture's modes are known
+ *
+ */
+int math_parse(struct glb *g)
+{
+	for (int k = 0; k < g->math_specs; k++)
+	{
+		char *s = strdup(g->math_spec[k]), *save, *f;
+		int mi;
+
+		f = strtok_r(s, ":", &save);
+		for (mi = 0; f && (mi < (int)g->cv.hdr->mode_count) && (mi < CAPTURE_MODES_MAX); mi++)
+		{
+			if (strcasecmp(f, g->cv.hdr->modes[mi].scpi) == 0)
+				break;
+		}
+		if (!f || (mi >= (int)g->cv.hdr->mode_count) || (mi >= CAPTURE_MODES_MAX))
+		{
+			fprintf(stderr, "%s:%d: Math '%s': the capture has no such mode\n", FL, g->math_spec[k]);
+			free(s);
+			return -1;
+		}
+		while ((f = strtok_r(NULL, ":", &save)))
+		{
+			if (hostmath_option(&(g->math[mi]), f) != 0)
+			{
+				fprintf(stderr, "%s:%d: Math '%s': can't use '%s'\n", FL, g->math_spec[k], f);
+				free(s);
+				return -1;
+			}
+		}
+		free(s);
+	}
+
+	g->mv = (double *)malloc(g->cv.hdr->block_records * sizeof(double));
+	g->math_on = (g->mv != NULL);
+
+	return g->math_on ? 0 : -1;
+}
+
+/*
+ * math_block()
+ *
+ * The math for records [from, n) of a block, into g->mv.  Values
+ * are gathered out of the records once, then each run of one mode
+ * (normally the whole block) gets a single hostmath_block() pass.
+ *
+ */
+void math_block(struct glb *g, const struct capture_record_s *r, uint32_t from, uint32_t n)
+{
+	uint32_t i, j;
+
+	for (i = from; i < n; i++)
+		g->mv[i] = r[i].value;
+
+	for (i = from; i < n; i = j)
+	{
+		struct hostmath_s *m;
+
+		for (j = i + 1; (j < n) && (r[j].mode == r[i].mode); j++)
+			;
+		if ((r[i].flags & CAPTURE_FLAG_FILLER) || (r[i].mode >= CAPTURE_MODES_MAX))
+			continue;
+		m = &(g->math[r[i].mode]);
+		if (!hostmath_active(m))
+			continue;
+		if (m->rel_pending)
+		{
+			m->null = g->mv[i];
+			m->rel = 1;
+			m->rel_pending = 0;
+		}
+		hostmath_block(m, g->mv + i, j - i);
+	}
+}
+
+/*
+ * walk()
+ *
+ * Visit every sample in [from_us, to_us], starting from the block
+ * the sync index points at rather than the top of the file.  With
+ * -M the block's math is done on its first visited record.
+ *
+ */
+void walk(struct glb *g, void (*fn)(struct glb *, uint64_t, const struct capture_record_s *))
+{
+	struct capture_view_s *cv = &(g->cv);
+	uint64_t b;
+
+	if (cv->blocks == 0)
+		return;
+
+	for (b = capture_find_block(cv, g->from_us); b < cv->blocks; b++)
+	{
+		const struct capture_sync_s *sync = capture_block_sync(cv, b);
+		const struct capture_record_s *r = capture_block_records(cv, b);
+		uint32_t n = capture_block_count(cv, b);
+		uint64_t t_us = sync->t_us;
+		int math_done = !g->math_on;
+
+		if (sync->t_us > g->to_us)
+			break;
+
+		for (uint32_t i = 0; i < n; i++)
+		{
+			if (r[i].flags & CAPTURE_FLAG_FILLER)
+				break; // rest of the block is padding
+			t_us += r[i].dt_us;
+			if (t_us < g->from_us)
+				continue;
+			if (t_us > g->to_us)
+				return;
+			if (!math_done)
+			{
+				math_block(g, r, i, n);
+				math_done = 1;
+			}
+			g->rec = i;
+			fn(g, t_us, &r[i]);
+		}
+	}
+}
+
+/*
+ * csv_row()
+ *
+ */
+void csv_row(struct glb *g, uint64_t t_us, const struct capture_record_s *r)
+{
+	uint64_t ns = g->cv.hdr->start_wall_ns + t_us * 1000ULL;
+
+	char rate[2] = {capture_flags_rate(r->flags), '\0'};
+
+	printf("%lu.%06lu,%lu.%09lu,%.17g,%s,%d,%s",
+		   (unsigned long)(t_us / 1000000ULL), (unsigned long)(t_us % 1000000ULL),
+		   (unsigned long)(ns / 1000000000ULL), (unsigned long)(ns % 1000000000ULL),
+		   r->value, mode_name(g, r->mode), r->range, rate);
+	if (g->math_on)
+		printf(",%.17g", g->mv[g->rec]);
+	printf("\n");
+}
+
+/*
+ * stats_row()
+ *
+ */
+void stats_row(struct glb *g, uint64_t t_us, const struct capture_record_s *r)
+{
+	struct stats_s *s;
+	double d;
+
+	if (g->samples == 0)
+		g->first_us = t_us;
+	else if (t_us - g->last_us > g->max_gap_us)
+		g->max_gap_us = t_us - g->last_us;
+	g->last_us = t_us;
+	g->samples++;
+
+	if (r->flags & CAPTURE_FLAG_TRIGGER)
+	{
+		if (g->triggers++ == 0)
+			g->trigger_us = t_us;
+	}
+
+	if (r->flags & CAPTURE_FLAG_GAP)
+		g->gaps++;
+
+	if (strcmp(mode_name(g, r->mode), "DCI") == 0)
+	{
+		if (g->charge_have && !(r->flags & CAPTURE_FLAG_GAP) && (fabs(r->value) < 1e9))
+		{
+			double dt = (t_us - g->charge_last_us) / 1e6;
+
+			g->charge_as += (g->charge_last_a + r->value) * 0.5 * dt;
+			g->charge_s += dt;
+		}
+		g->charge_have = fabs(r->value) < 1e9;
+		g->charge_last_us = t_us;
+		g->charge_last_a = r->value;
+	}
+	else
+	{
+		g->charge_have = 0;
+	}
+
+	if (r->mode >= CAPTURE_MODES_MAX)
+		return;
+	s = &(g->stats[r->mode]);
+
+	if (s->count == 0)
+	{
+		s->min = s->max = r->value;
+	}
+	if (r->value < s->min)
+		s->min = r->value;
+	if (r->value > s->max)
+		s->max = r->value;
+
+	s->count++;
+	d = r->value - s->mean;
+	s->mean += d / s->count;
+	s->m2 += d * (r->value - s->mean);
+}
+
+/*
+ * print_time()
+ *
+ */
+void print_time(const char *label, int64_t wall_ns)
+{
+	time_t t = wall_ns / 1000000000LL;
+	struct tm tm;
+	char buf[64];
+
+	localtime_r(&t, &tm);
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+	printf("%-10s: %s.%03ld\n", label, buf, (long)((wall_ns / 1000000LL) % 1000));
+}
+
+/*
+ * do_info()
+ *
+ */
+void do_info(struct glb *g)
+{
+	const struct capture_header_s *h = g->cv.hdr;
+
+	printf("File      : %s (%lu bytes)\n", g->path, (unsigned long)g->cv.size);
+	printf("Format    : v%u, %u records per block, %lu blocks\n", h->version, h->block_records, (unsigned long)g->cv.blocks);
+	printf("Meter     : %.*s\n", (int)sizeof(h->idn), h->idn);
+	print_time("Started", h->start_wall_ns);
+	printf("Times     : %s\n", (h->flags & CAPTURE_HDR_ACQ_TIME) ? "reading taken, estimated from the query round trip" : "reading came in");
+
+	walk(g, stats_row);
+	if (g->samples)
+	{
+		print_time("First", h->start_wall_ns + g->first_us * 1000LL);
+		print_time("Last", h->start_wall_ns + g->last_us * 1000LL);
+		printf("Span      : %.3f s\n", (g->last_us - g->first_us) / 1e6);
+		if (g->triggers)
+		{
+			print_time("Trigger", h->start_wall_ns + g->trigger_us * 1000LL);
+			printf("Window    : %.3f s before, %.3f s after\n", (g->trigger_us - g->first_us) / 1e6, (g->last_us - g->trigger_us) / 1e6);
+		}
+	}
+	printf("Samples   : %lu\n", (unsigned long)g->samples);
+}
+
+/*
+ * do_stats()
+ *
+ */
+void do_stats(struct glb *g)
+{
+	walk(g, stats_row);
+
+	printf("%-6s %12s %16s %16s %16s %16s\n", "mode", "count", "min", "max", "mean", "stddev");
+	for (int i = 0; i < CAPTURE_MODES_MAX; i++)
+	{
+		struct stats_s *s = &(g->stats[i]);
+
+		if (s->count == 0)
+			continue;
+		printf("%-6s %12lu %16.9g %16.9g %16.9g %16.9g\n", mode_name(g, i), (unsigned long)s->count,
+			   s->min, s->max, s->mean, s->count > 1 ? sqrt(s->m2 / (s->count - 1)) : 0.0);
+	}
+	if (g->samples > 1)
+		printf("\n%lu samples over %.3f s, %.2f samples/s, longest gap %.3f s\n", (unsigned long)g->samples,
+			   (g->last_us - g->first_us) / 1e6, (g->samples - 1) / ((g->last_us - g->first_us) / 1e6), g->max_gap_us / 1e6);
+	if (g->charge_s > 0)
+		printf("DCI charge %.9g Ah over %.3f s, %lu gaps not bridged\n", g->charge_as / 3600.0, g->charge_s, (unsigned long)g->gaps);
+}
+
+/*
+ * pyramid_load()
+ *
+ * Map whichever pyramid levels exist next to the capture
+ *
+ */
+void pyramid_load(struct glb *g)
+{
+	char name[PATH_MAX + 8];
+
+	for (int i = 0; i < PYRAMID_LEVELS; i++)
+	{
+		const struct pyramid_header_s *h;
+		struct stat st;
+		void *map;
+		int fd;
+
+		snprintf(name, sizeof(name), "%s.p%d", g->path, i + 1);
+		fd = open(name, O_RDONLY);
+		if (fd < 0)
+			continue;
+		if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(struct pyramid_header_s)))
+		{
+			close(fd);
+			continue;
+		}
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED)
+			continue;
+
+		h = (const struct pyramid_header_s *)map;
+		if ((memcmp(h->magic, PYRAMID_MAGIC, 8) != 0) || (h->entry_size != sizeof(struct pyramid_entry_s)) || (h->factor != PYRAMID_FACTOR))
+		{
+			munmap(map, st.st_size);
+			continue;
+		}
+		g->lv[i] = (const struct pyramid_entry_s *)(h + 1);
+		g->lv_n[i] = (st.st_size - sizeof(*h)) / sizeof(struct pyramid_entry_s);
+	}
+}
+
+/*
+ * pyramid_emit()
+ *
+ */
+void pyramid_emit(void *ctx, int level, const struct pyramid_entry_s *e)
+{
+	struct glb *g = (struct glb *)ctx;
+
+	fwrite(e, sizeof(*e), 1, g->lv_out[level - 1]);
+}
+
+struct pyramid_s build;
+
+void pyramid_row(struct glb *g, uint64_t t_us, const struct capture_record_s *r)
+{
+	pyramid_add(&build, t_us, r->value, r->mode, pyramid_emit, g);
+}
+
+/*
+ * do_pyramid()
+ *
+ * Build the pyramid for a capture written without one, or after
+ * a crash left it short
+ *
+ */
+int do_pyramid(struct glb *g)
+{
+	struct pyramid_header_s h;
+	char name[PATH_MAX + 8], tmp[PATH_MAX + 16];
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, PYRAMID_MAGIC, 8);
+	h.version = PYRAMID_VERSION;
+	h.factor = PYRAMID_FACTOR;
+	h.entry_size = sizeof(struct pyramid_entry_s);
+
+	for (int i = 0; i < PYRAMID_LEVELS; i++)
+	{
+		snprintf(tmp, sizeof(tmp), "%s.p%d.tmp", g->path, i + 1);
+		g->lv_out[i] = fopen(tmp, "w");
+		if (!g->lv_out[i])
+		{
+			fprintf(stderr, "%s:%d: Can't create '%s' (%s)\n", FL, tmp, strerror(errno));
+			return 1;
+		}
+		h.level = i + 1;
+		fwrite(&h, sizeof(h), 1, g->lv_out[i]);
+	}
+
+	g->from_us = 0;
+	g->to_us = UINT64_MAX;
+	walk(g, pyramid_row);
+	pyramid_flush(&build, pyramid_emit, g);
+
+	for (int i = 0; i < PYRAMID_LEVELS; i++)
+	{
+		long n = (ftell(g->lv_out[i]) - sizeof(h)) / sizeof(struct pyramid_entry_s);
+
+		fclose(g->lv_out[i]);
+		snprintf(tmp, sizeof(tmp), "%s.p%d.tmp", g->path, i + 1);
+		snprintf(name, sizeof(name), "%s.p%d", g->path, i + 1);
+		rename(tmp, name);
+		printf("%s: %ld entries\n", name, n);
+	}
+
+	return 0;
+}
+
+/*
+ * bucket_index()
+ *
+ */
+uint64_t bucket_index(struct glb *g, uint64_t t_us)
+{
+	uint64_t k = (t_us - g->bucket_from) / g->bucket_us;
+
+	return k < (uint64_t)g->buckets ? k : g->buckets - 1;
+}
+
+/*
+ * bucket_add()
+ *
+ * Buckets are per mode, volts and ohms never share a row
+ *
+ */
+void bucket_add(struct glb *g, uint64_t t_us, const struct pyramid_entry_s *e)
+{
+	struct stats_s *b;
+
+	if (e->mode >= CAPTURE_MODES_MAX)
+		return;
+	b = &(g->bucket[bucket_index(g, t_us) * CAPTURE_MODES_MAX + e->mode]);
+
+	if ((b->count == 0) || (e->min < b->min))
+		b->min = e->min;
+	if ((b->count == 0) || (e->max > b->max))
+		b->max = e->max;
+	b->mean += e->sum; // a plain sum until printed
+	b->count += e->count;
+}
+
+void bucket_row(struct glb *g, uint64_t t_us, const struct capture_record_s *r)
+{
+	struct pyramid_entry_s e;
+
+	e.min = e.max = e.sum = r->value;
+	e.count = 1;
+	e.mode = r->mode;
+	bucket_add(g, t_us, &e);
+}
+
+/*
+ * last_us()
+ *
+ * Time of the final sample, from the last block only
+ *
+ */
+uint64_t last_us(struct glb *g)
+{
+	struct capture_view_s *cv = &(g->cv);
+	const struct capture_record_s *r;
+	uint64_t t_us;
+	uint32_t n;
+
+	if (cv->blocks == 0)
+		return 0;
+	t_us = capture_block_sync(cv, cv->blocks - 1)->t_us;
+	r = capture_block_records(cv, cv->blocks - 1);
+	n = capture_block_count(cv, cv->blocks - 1);
+	for (uint32_t i = 0; (i < n) && !(r[i].flags & CAPTURE_FLAG_FILLER); i++)
+		t_us += r[i].dt_us;
+
+	return t_us;
+}
+
+/*
+ * do_decimate()
+ *
+ * csv -n: pick the coarsest pyramid level that still gives at
+ * least PYRAMID_FACTOR entries per bucket, take what it covers from
+ * there and only go to the raw records for the tail it doesn't (a
+ * capture still being written, or no pyramid at all) and for the
+ * entries that straddle a bucket edge or the span's ends, so no
+ * bucket gets readings from outside it.  With that many entries a
+ * bucket the straddlers are at most 1/PYRAMID_FACTOR of the span.
+ *
+ */
+void do_decimate(struct glb *g)
+{
+	struct capture_view_s *cv = &(g->cv);
+	uint64_t from = g->from_us, to = g->to_us, covered = 0, est, scale = 1;
+	int level = 0;
+
+	if (cv->blocks == 0)
+		return;
+	if (to > last_us(g))
+		to = last_us(g);
+	if (to <= from)
+		return;
+
+	g->bucket = (struct stats_s *)calloc((size_t)g->buckets * CAPTURE_MODES_MAX, sizeof(struct stats_s));
+	if (!g->bucket)
+	{
+		fprintf(stderr, "%s:%d: Unable to allocate %d points\n", FL, g->buckets);
+		return;
+	}
+	g->bucket_from = from;
+	g->bucket_us = (to - from) / g->buckets + 1;
+
+	// samples in the span, to the nearest block
+	est = capture_block_sync(cv, capture_find_block(cv, to))->index + capture_block_count(cv, capture_find_block(cv, to))
+		  - capture_block_sync(cv, capture_find_block(cv, from))->index;
+
+	pyramid_load(g);
+	for (int i = 0; i < PYRAMID_LEVELS; i++)
+	{
+		scale *= PYRAMID_FACTOR;
+		if (!g->lv[i] || (est / scale < (uint64_t)g->buckets * PYRAMID_FACTOR))
+			break;
+		level = i + 1;
+	}
+
+	if (level)
+	{
+		const struct pyramid_entry_s *e = g->lv[level - 1];
+		uint64_t n = g->lv_n[level - 1];
+
+		for (uint64_t k = pyramid_find(e, n, from); (k < n) && (e[k].t_first_us <= to); k++)
+		{
+			uint64_t first = e[k].t_first_us, last = e[k].t_last_us < to ? e[k].t_last_us : to;
+
+			if ((first < from) || (last < e[k].t_last_us) || (bucket_index(g, first) != bucket_index(g, last)))
+			{
+				// only part of it is wanted, or it's in two buckets
+				g->from_us = first < from ? from : first;
+				g->to_us = last;
+				walk(g, bucket_row);
+			}
+			else
+			{
+				bucket_add(g, first, &e[k]);
+			}
+			covered = last;
+		}
+	}
+
+	if (covered < to)
+	{
+		g->from_us = covered ? covered + 1 : from;
+		g->to_us = to;
+		walk(g, bucket_row);
+	}
+
+	fprintf(stderr, "%d points from pyramid level %d\n", g->buckets, level);
+	printf("t_rel,mode,min,max,mean,count\n");
+	for (int k = 0; k < g->buckets; k++)
+	{
+		for (int m = 0; m < CAPTURE_MODES_MAX; m++)
+		{
+			struct stats_s *b = &(g->bucket[k * CAPTURE_MODES_MAX + m]);
+
+			if (b->count == 0)
+				continue;
+			printf("%.6f,%s,%.17g,%.17g,%.17g,%lu\n", (from + k * g->bucket_us) / 1e6, mode_name(g, m), b->min, b->max,
+				   b->mean / b->count, (unsigned long)b->count);
+		}
+	}
+	free(g->bucket);
+}
+
+volatile sig_atomic_t quit_signal = 0;
+
+void handle_quit_signal(int sig)
+{
+	quit_signal = sig;
+}
+
+/*
+ * do_follow()
+ *
+ * Tail the producer's shared memory ring until ctrl-c or the
+ * producer exits
+ *
+ */
+int do_follow(struct glb *g)
+{
+	const char *name = g->path ? g->path : DM3058E_SHM_NAME;
+	struct dm3058e_shm *shm;
+	struct dm3058e_shm_reader rd;
+	struct dm3058e_shm_sample s;
+	uint64_t count = 0;
+
+	shm = dm3058e_shm_open(name);
+	if (!shm)
+	{
+		fprintf(stderr, "%s:%d: No dm3058e shared memory '%s', is dm3058e-sdl running with -S?\n", FL, name);
+		return 1;
+	}
+
+	signal(SIGINT, handle_quit_signal);
+	signal(SIGTERM, handle_quit_signal);
+
+	dm3058e_shm_reader_init(shm, &rd, g->backlog);
+	printf("seq,t_wall,value,mode,range\n");
+	while (!quit_signal && __atomic_load_n(&(shm->producer_pid), __ATOMIC_ACQUIRE))
+	{
+		while (dm3058e_shm_next(shm, &rd, &s) > 0)
+		{
+			printf("%lu,%ld.%09ld,%.17g,%s,%d\n", (unsigned long)s.seq, (long)(s.t_wall_ns / 1000000000LL),
+				   (long)(s.t_wall_ns % 1000000000LL), s.value, s.mode_name, s.range);
+			count++;
+		}
+		fflush(stdout);
+		usleep(10000);
+	}
+
+	fprintf(stderr, "Followed %lu readings, %lu lost to overruns\n", (unsigned long)count, (unsigned long)rd.lost);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct glb g;
+	struct stat st;
+	void *map;
+	int fd;
+
+	memset(&g, 0, sizeof(g));
+	g.to_us = UINT64_MAX;
+	for (int i = 0; i < CAPTURE_MODES_MAX; i++)
+		hostmath_init(&(g.math[i]));
+
+	if (argc < 2)
+	{
+		fprintf(stdout, "%s", help);
+		exit(1);
+	}
+
+	if (strcmp(argv[1], "info") == 0)
+		g.cmd = CMD_INFO;
+	else if (strcmp(argv[1], "csv") == 0)
+		g.cmd = CMD_CSV;
+	else if (strcmp(argv[1], "stats") == 0)
+		g.cmd = CMD_STATS;
+	else if (strcmp(argv[1], "follow") == 0)
+		g.cmd = CMD_FOLLOW;
+	else if (strcmp(argv[1], "pyramid") == 0)
+		g.cmd = CMD_PYRAMID;
+	else
+	{
+		fprintf(stdout, "Unknown command '%s'\n%s", argv[1], help);
+		exit(1);
+	}
+
+	for (int i = 2; i < argc; i++)
+	{
+		if (argv[i][0] == '-')
+		{
+			switch (argv[i][1])
+			{
+			case 'h':
+				fprintf(stdout, "%s", help);
+				exit(1);
+				break;
+
+			case 'b':
+				g.backlog = 1;
+				break;
+
+			case 'n':
+				i++;
+				if (i < argc)
+					g.buckets = atoi(argv[i]);
+				else
+				{
+					fprintf(stdout, "Insufficient parameters; -n <points>\n");
+					exit(1);
+				}
+				break;
+
+			case 'M':
+				i++;
+				if ((i < argc) && (g.math_specs < CAPTURE_MODES_MAX))
+					g.math_spec[g.math_specs++] = argv[i];
+				else
+				{
+					fprintf(stdout, "Insufficient parameters; -M <mode>:<math>\n");
+					exit(1);
+				}
+				break;
+
+			case 'f':
+				i++;
+				if (i < argc)
+					g.from_us = (uint64_t)(atof(argv[i]) * 1e6);
+				else
+				{
+					fprintf(stdout, "Insufficient parameters; -f <seconds>\n");
+					exit(1);
+				}
+				break;
+
+			case 't':
+				i++;
+				if (i < argc)
+					g.to_us = (uint64_t)(atof(argv[i]) * 1e6);
+				else
+				{
+					fprintf(stdout, "Insufficient parameters; -t <seconds>\n");
+					exit(1);
+				}
+				break;
+
+			default:
+				fprintf(stdout, "Unknown option '%s'\n%s", argv[i], help);
+				exit(1);
+			}
+		}
+		else
+			g.path = argv[i];
+	}
+
+	if (g.cmd == CMD_FOLLOW)
+		return do_follow(&g);
+
+	if (!g.path)
+	{
+		fprintf(stdout, "No capture file given\n%s", help);
+		exit(1);
+	}
+
+	fd = open(g.path, O_RDONLY);
+	if ((fd < 0) || (fstat(fd, &st) != 0))
+	{
+		fprintf(stderr, "%s:%d: Can't open '%s' (%s)\n", FL, g.path, strerror(errno));
+		exit(1);
+	}
+	if (st.st_size < CAPTURE_HEADER_SIZE)
+	{
+		fprintf(stderr, "%s:%d: '%s' is too short to be a capture\n", FL, g.path);
+		exit(1);
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+	{
+		fprintf(stderr, "%s:%d: Can't mmap '%s' (%s)\n", FL, g.path, strerror(errno));
+		exit(1);
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	if (capture_view(&g.cv, map, st.st_size) != 0)
+	{
+		fprintf(stderr, "%s:%d: '%s' is not a dm3058e capture\n", FL, g.path);
+		exit(1);
+	}
+
+	switch (g.cmd)
+	{
+	case CMD_INFO:
+		do_info(&g);
+		break;
+
+	case CMD_CSV:
+		if (g.buckets > 0)
+		{
+			// the pyramid holds raw min/max/mean, dB of a mean isn't the mean of the dB
+			if (g.math_specs)
+				fprintf(stderr, "%s:%d: -M is ignored with -n\n", FL);
+			do_decimate(&g);
+			break;
+		}
+		if (g.math_specs && (math_parse(&g) != 0))
+			exit(1);
+		printf("t_rel,t_wall,value,mode,range,rate%s\n", g.math_on ? ",math" : "");
+		walk(&g, csv_row);
+		free(g.mv);
+		break;
+
+	case CMD_PYRAMID:
+		do_pyramid(&g);
+		break;
+
+	case CMD_STATS:
+		do_stats(&g);
+		break;
+	}
+
+	munmap(map, st.st_size);
+	close(fd);
+
+	return 0;
+}